@@ -20,11 +20,18 @@ done
 cd ../bin
 chown root:root mail-in
 chown root:root mail-out
+chown root:root mail-outd
+chown root:root mail-tool
+chown root:root mail-list
 chmod -v u+s mail-out
 chmod -v u+s mail-in
 chmod go-rwx mail-out
+chmod go-rwx mail-outd
+chmod 755 mail-tool
+chmod go-rwx mail-list
 
 cd ..
 chmod 555 bin/ 
 chmod 555 tmp/
+chmod 700 blobs/
 chmod 555 mail/
\ No newline at end of file
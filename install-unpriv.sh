@@ -11,7 +11,7 @@ then
 fi
 mkdir "$1"
 cd $1
-mkdir bin mail tmp
+mkdir bin mail tmp blobs
 declare -a arr=("jyk2149" "addleness" "analects" "annalistic" "anthropomorphologically" "blepharosphincterectomy" "corector" "durwaun" "dysphasia" "encampment" "endoscopic" "exilic" "forfend" "gorbellied" "gushiness" "muermo" "neckar" "outmate" "outroll" "overrich" "philosophicotheological" "pockwood" "polypose" "refluxed" "reinsure" "repine" "scerne" "starshine" "unauthoritativeness" "unminced" "unrosed" "untranquil" "urushinic" "vegetocarbonaceous" "wamara" "whaledom")
 for p in "${arr[@]}"
 do
@@ -0,0 +1,868 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <regex>
+#include <cstdlib>
+#include <cctype>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <thread>
+#include <filesystem>
+#include "mail_utils.h"
+#include "mail_reader.h"
+#include "mail_registry.h"
+#include "mail_parser.h"
+#include "mail_store.h"
+#include "mail_stats.h"
+
+// Benchmarks for the mail-in and mail-out primitives.
+// Every result is printed as one JSON object per line so runs can be diffed.
+//
+// Usage: mail-bench [body|parse|seq|ipc|shard ...]     (all of them by default)
+//        mail-bench gen [-m messages] [-r recipients] [-b body bytes] [-s seed] > input
+//        mail-bench check     (the fast paths against their reference versions and the fanout
+//                              sync count, exit 1 on a mismatch)
+
+namespace fs = std::filesystem;
+
+/*
+Input: (size_t) Approximate body size in bytes, (unsigned) Random seed.
+Output: (std::string) A DATA section: text lines, some empty, some dot-stuffed, then ".".
+*/
+static std::string makeBody(size_t size, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::string body;
+    while (body.size() < size)
+    {
+        unsigned kind = rng() % 20;
+        if (kind == 0)
+        {
+            body += '\n';
+            continue;
+        }
+        size_t len = rng() % 100;
+        if (kind == 1)
+        {
+            body += '.'; // Stuffed, never a bare "." (that would end the body early)
+            len++;
+        }
+        for (size_t i = 0; i < len; i++)
+        {
+            body += (char)('a' + rng() % 26);
+        }
+        body += '\n';
+    }
+    body += ".\n";
+    return body;
+}
+
+/*
+Input: (std::string) Input to append to, (std::vector<std::string>) Mailbox names,
+       (long) Recipients, (long) Body bytes, (std::mt19937) Random source.
+Appends one message from a random mailbox to random recipients.
+*/
+static void appendMessage(std::string &out, const std::vector<std::string> &names, long recipients, long bodyBytes, std::mt19937 &rng)
+{
+    out += "MAIL FROM:<" + names[rng() % names.size()] + ">\n";
+    for (long r = 0; r < recipients; r++)
+    {
+        out += "RCPT TO:<" + names[rng() % names.size()] + ">\n";
+    }
+    out += "DATA\n";
+    out += makeBody(bodyBytes, rng());
+}
+
+/*
+Input: (std::string) DATA section, (std::string) Body out.
+Output: (long long) Bytes in mail-in's accounting.
+The original loop: std::getline, a std::string per line, substr to un-stuff.
+*/
+static long long getlineLoop(const std::string &input, std::string &body)
+{
+    std::istringstream in(input);
+    std::vector<std::string> lines;
+    std::string line;
+    long long bytes = 0;
+    while (std::getline(in, line))
+    {
+        bytes += line.empty() ? 1 : line.size();
+        if (line == ".")
+        {
+            break;
+        }
+        if (!line.empty() && line[0] == '.')
+        {
+            line = line.substr(1);
+        }
+        lines.push_back(line);
+    }
+    for (const std::string &l : lines)
+    {
+        body += l;
+        body += '\n';
+    }
+    return bytes;
+}
+
+/*
+Input: (std::string) DATA section, (std::string) Body out.
+Output: (long long) Bytes in mail-in's accounting.
+The line loop scanBody replaced: memchr per line, string_view lines, appended one by one.
+*/
+static long long lineLoop(const std::string &input, std::string &body)
+{
+    const char *p = input.data();
+    const char *end = p + input.size();
+    long long bytes = 0;
+    while (p < end)
+    {
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        std::string_view line(p, (nl ? nl : end) - p);
+        p += line.size() + 1;
+        bytes += line.empty() ? 1 : line.size();
+        if (line == ".")
+        {
+            break;
+        }
+        size_t start = (!line.empty() && line[0] == '.') ? 1 : 0;
+        body.append(line.data() + start, line.size() - start);
+        body += '\n';
+    }
+    return bytes;
+}
+
+/*
+Input: (std::string) DATA section, (std::string) Body out.
+Output: (long long) Bytes in mail-in's accounting.
+*/
+static long long scanLoop(const std::string &input, std::string &body)
+{
+    return scanBody(input.data(), input.size(), true, &body).bytes;
+}
+
+/*
+Input: (const char*) Benchmark name, (const char*) Variant, (size_t) Input bytes, function under test,
+       (long long) Most iterations the function allows.
+Runs the function until at least 0.2 s have passed (or maxIterations) and prints one result line.
+*/
+template <typename Fn>
+static void run(const char *bench, const char *variant, size_t inputBytes, Fn fn, long long maxIterations = LLONG_MAX)
+{
+    using clock = std::chrono::steady_clock;
+    long long iterations = 0;
+    clock::time_point begin = clock::now();
+    double elapsed = 0;
+    do
+    {
+        fn();
+        iterations++;
+        elapsed = std::chrono::duration<double>(clock::now() - begin).count();
+    } while (elapsed < 0.2 && iterations < maxIterations);
+
+    double ns = elapsed * 1e9 / iterations;
+    std::cout << "{\"bench\":\"" << bench << "\",\"variant\":\"" << variant
+              << "\",\"bytes\":" << inputBytes << ",\"iterations\":" << iterations
+              << ",\"ns_per_op\":" << (long long)ns
+              << ",\"mb_per_s\":" << (long long)(inputBytes / (ns / 1e9) / 1e6) << "}" << std::endl;
+}
+
+/*
+Body scanning: the old loops against every scanBody kernel the CPU can run.
+*/
+static int benchBodyScan()
+{
+    const size_t sizes[] = {1 << 10, 100 << 10, 10 << 20};
+    const ScanKernel kernels[] = {SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2};
+    const char *kernelNames[] = {"scan_scalar", "scan_sse2", "scan_avx2"};
+    ScanKernel detected = activeScanKernel();
+
+    for (size_t size : sizes)
+    {
+        std::string input = makeBody(size, size);
+        std::string expected;
+        long long expectedBytes = lineLoop(input, expected);
+
+        std::string body;
+        run("body_scan", "getline", input.size(), [&]() { body.clear(); getlineLoop(input, body); });
+        run("body_scan", "line_loop", input.size(), [&]() { body.clear(); lineLoop(input, body); });
+
+        for (int k = 0; k < 3; k++)
+        {
+            if (!useScanKernel(kernels[k]))
+            {
+                continue;
+            }
+
+            // A fast wrong answer is no answer
+            body.clear();
+            if (scanLoop(input, body) != expectedBytes || body != expected)
+            {
+                std::cerr << kernelNames[k] << " disagrees with the line loop" << std::endl;
+                return 1;
+            }
+            run("body_scan", kernelNames[k], input.size(), [&]() { body.clear(); scanLoop(input, body); });
+        }
+        useScanKernel(detected);
+    }
+
+    return 0;
+}
+
+/*
+Input: (unsigned) Random seed.
+Output: (std::vector<std::string>) Control lines as they show up in real input: mostly
+well formed MAIL FROM / RCPT TO / DATA in mixed case, some malformed ones.
+*/
+static std::vector<std::string> makeControlLines(unsigned seed)
+{
+    const char *forms[] = {"MAIL FROM:<", "mail from:<", "Mail From:<", "RCPT TO:<", "rcpt to:<", "Rcpt To:<"};
+    std::mt19937 rng(seed);
+    std::vector<std::string> lines;
+    for (int i = 0; i < 1000; i++)
+    {
+        unsigned kind = rng() % 10;
+        if (kind == 0)
+        {
+            lines.push_back(rng() % 2 ? "DATA" : "data");
+            continue;
+        }
+
+        std::string name(1, (char)('a' + rng() % 26));
+        size_t len = 3 + rng() % 12;
+        for (size_t k = 0; k < len; k++)
+        {
+            const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789_-+";
+            name += alphabet[rng() % (sizeof(alphabet) - 1)];
+        }
+
+        std::string line = forms[rng() % 6] + name + ">";
+        if (kind == 1)
+        {
+            line.insert(line.size() - 1, "/.."); // Bad mailbox characters
+        }
+        else if (kind == 2)
+        {
+            line.pop_back(); // Missing '>'
+        }
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+/*
+Control line parsing: every checker on the same mix of lines.
+*/
+static int benchParse()
+{
+    std::vector<std::string> lines = makeControlLines(1);
+    size_t bytes = 0;
+    std::vector<std::string> names;
+    for (const std::string &line : lines)
+    {
+        bytes += line.size();
+        size_t open = line.find('<');
+        names.push_back(open == std::string::npos ? line : line.substr(open + 1, line.size() - open - 2));
+    }
+
+    // Every result lands in a volatile, so none of the calls can be optimized out
+    volatile long long sink = 0;
+    run("parse", "checkMailFrom", bytes, [&]() { for (const std::string &l : lines) sink += checkMailFrom(l); });
+    run("parse", "checkRcptTo", bytes, [&]() { for (const std::string &l : lines) sink += checkRcptTo(l); });
+    run("parse", "checkDataDelimiter", bytes, [&]() { for (const std::string &l : lines) sink += checkDataDelimiter(l); });
+    run("parse", "classifyControlLine", bytes, [&]() {
+        std::string_view mailbox;
+        for (const std::string &l : lines) sink += classifyControlLine(l, mailbox);
+    });
+    run("parse", "extractUsername", bytes, [&]() { for (const std::string &l : lines) sink += extractUsername(l).size(); });
+
+    size_t nameBytes = 0;
+    for (const std::string &name : names)
+    {
+        nameBytes += name.size();
+    }
+    run("parse", "validMailboxChars", nameBytes, [&]() { for (const std::string &n : names) sink += validMailboxChars(n); });
+
+    return 0;
+}
+
+/*
+The std::regex checkers classifyControlLine replaced, kept as the reference it must match.
+*/
+static bool regexMailFrom(const std::string &line)
+{
+    static const std::regex rgx("^[mM][aA][iI][lL] [fF][rR][oO][mM]:<.{1,255}>$");
+    return line.length() <= MAILBOX_NAME_MAX + MAIL_FROM_MAX && std::regex_match(line, rgx);
+}
+
+static bool regexRcptTo(const std::string &line)
+{
+    static const std::regex rgx("^[rR][cC][pP][tT] [tT][oO]:<.{1,255}>$");
+    return line.length() <= MAILBOX_NAME_MAX + MAIL_FROM_MAX && std::regex_match(line, rgx);
+}
+
+static bool regexDataDelimiter(const std::string &line)
+{
+    static const std::regex rgx("^[dD][aA][tT][aA]$");
+    return line.length() <= MAILBOX_NAME_MAX + RCPT_TO_MAX && std::regex_match(line, rgx);
+}
+
+/*
+Input: (std::mt19937) Random source.
+Output: (std::string) A line near the control line grammar: a keyword in random case (sometimes
+cut short or misspelled) or random bytes, then 0 to 300 bytes of mailbox characters or of
+those plus brackets, CR, LF, NUL and high bytes, then '>', nothing, or '>' and a tail.
+*/
+static std::string makeNearControlLine(std::mt19937 &rng)
+{
+    const char *keywords[] = {"mail from:<", "rcpt to:<", "data", "mail from:", "rcpt to<", "mail  from:<", "dat"};
+    const char alphabet[] = "abcXYZ019+-_ <>.:\r\n\0\x80\xff";
+    std::string line;
+    unsigned kind = rng() % 8;
+    if (kind < 7)
+    {
+        for (const char *k = keywords[rng() % 7]; *k != '\0'; k++)
+        {
+            line += (rng() % 2) ? (char)std::toupper(*k) : *k;
+        }
+    }
+    else
+    {
+        for (size_t i = rng() % 12; i > 0; i--)
+        {
+            line += (char)(rng() % 256);
+        }
+    }
+
+    // Lengths around the 255 byte limit often; half the time only characters "." accepts
+    unsigned shape = rng() % 4;
+    size_t len = shape == 0 ? 250 + rng() % 10 : shape == 1 ? rng() % 301 : rng() % 20;
+    size_t choices = rng() % 2 ? sizeof(alphabet) - 1 : 12;
+    for (size_t i = 0; i < len; i++)
+    {
+        line += alphabet[rng() % choices];
+    }
+    unsigned ending = rng() % 4;
+    if (ending < 2)
+    {
+        line += '>';
+    }
+    else if (ending == 2)
+    {
+        line += ">x";
+    }
+    return line;
+}
+
+/*
+Output: (int) 1 if classifyControlLine and the check* wrappers disagree with the regex
+checkers (or the mailbox with extractUsername) on any of 300k generated lines, 0 otherwise.
+*/
+static int checkControlLines()
+{
+    std::mt19937 rng(1);
+    long cases = 300000;
+    long mismatches = 0;
+    for (long i = 0; i < cases; i++)
+    {
+        std::string line = makeNearControlLine(rng);
+        ControlLine expected = regexMailFrom(line) ? CONTROL_MAIL_FROM :
+                               regexRcptTo(line) ? CONTROL_RCPT_TO :
+                               regexDataDelimiter(line) ? CONTROL_DATA : CONTROL_INVALID;
+
+        std::string_view mailbox;
+        ControlLine control = classifyControlLine(line, mailbox);
+        bool same = control == expected &&
+                    checkMailFrom(line) == (expected == CONTROL_MAIL_FROM) &&
+                    checkRcptTo(line) == (expected == CONTROL_RCPT_TO) &&
+                    checkDataDelimiter(line) == (expected == CONTROL_DATA);
+        if (same && (control == CONTROL_MAIL_FROM || control == CONTROL_RCPT_TO))
+        {
+            same = mailbox == extractUsername(line);
+        }
+        if (!same && mismatches++ == 0)
+        {
+            std::cerr << "classifyControlLine disagrees with the regex checkers on a " << line.size()
+                      << " byte line (got " << control << ", expected " << expected << ")" << std::endl;
+        }
+    }
+
+    std::cout << "{\"check\":\"control_lines\",\"cases\":" << cases << ",\"mismatches\":" << mismatches << "}" << std::endl;
+    return mismatches != 0;
+}
+
+/*
+The std::isalpha/std::isdigit validators the class table and SIMD kernels replaced,
+kept as the reference they must match ("C" locale, bytes as unsigned char).
+*/
+static bool referenceIsAlpha(std::string_view str)
+{
+    return !str.empty() && std::all_of(str.begin(), str.end(), [](char c) { return std::isalpha((unsigned char)c) != 0; });
+}
+
+static bool referenceIsNumeric(std::string_view str)
+{
+    return std::all_of(str.begin(), str.end(), [](char c) { return std::isdigit((unsigned char)c) != 0; });
+}
+
+static bool referenceMailboxChars(std::string_view str)
+{
+    if (str.empty() || !std::isalpha((unsigned char)str[0]))
+    {
+        return false;
+    }
+    return std::all_of(str.begin(), str.end(), [](char c) {
+        return std::isalpha((unsigned char)c) || std::isdigit((unsigned char)c) || c == '+' || c == '-' || c == '_';
+    });
+}
+
+/*
+Input: (std::string_view) A name.
+Output: (bool) Whether isAlpha, isNumeric and validMailboxChars all agree with the references on it.
+*/
+static bool sameAsReference(std::string_view name)
+{
+    std::string copy(name);
+    return validMailboxChars(name) == referenceMailboxChars(name) &&
+           isAlpha(copy) == referenceIsAlpha(name) &&
+           isNumeric(copy) == referenceIsNumeric(name);
+}
+
+/*
+Output: (int) 1 if, with any kernel this CPU runs, the name validators disagree with the
+std::isalpha/std::isdigit versions, 0 otherwise. Covers every string of 0 to 2 bytes, and
+every byte value at every position of names of 1 to 80 bytes and of the lengths around 128
+and 256, each also one byte off alignment.
+*/
+static int checkNameValidators()
+{
+    const NameKernel kernels[] = {NAME_SCALAR, NAME_SSE2, NAME_AVX2};
+    const char *kernelNames[] = {"name_scalar", "name_sse2", "name_avx2"};
+    const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+-_";
+    NameKernel detected = activeNameKernel();
+
+    std::vector<size_t> lengths;
+    for (size_t length = 1; length <= 80; length++)
+    {
+        lengths.push_back(length);
+    }
+    for (size_t length : {127, 128, 129, 255, 256, 257})
+    {
+        lengths.push_back(length);
+    }
+
+    int rc = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        if (!useNameKernel(kernels[k]))
+        {
+            continue;
+        }
+
+        long cases = 0;
+        long mismatches = 0;
+        auto check = [&](std::string_view name) {
+            cases++;
+            if (!sameAsReference(name) && mismatches++ == 0)
+            {
+                std::cerr << kernelNames[k] << " disagrees with the std::isalpha validators on a "
+                          << name.size() << " byte name" << std::endl;
+            }
+        };
+
+        check("");
+        for (int a = 0; a < 256; a++)
+        {
+            check(std::string(1, (char)a));
+            for (int b = 0; b < 256; b++)
+            {
+                check(std::string{(char)a, (char)b});
+            }
+        }
+
+        // A valid name with one byte replaced; the view starts at buffer + shift
+        std::string buffer(260, 'a');
+        for (size_t i = 0; i < buffer.size(); i++)
+        {
+            buffer[i] = i == 1 ? 'a' : alphabet[(i * 7) % (sizeof(alphabet) - 1)];
+        }
+        for (size_t length : lengths)
+        {
+            for (size_t shift = 0; shift < 2; shift++)
+            {
+                std::string name = buffer.substr(0, length + shift);
+                name[shift] = 'q'; // Leading letter
+                for (size_t pos = shift; pos < name.size(); pos++)
+                {
+                    char kept = name[pos];
+                    for (int c = 0; c < 256; c++)
+                    {
+                        name[pos] = (char)c;
+                        check(std::string_view(name).substr(shift));
+                    }
+                    name[pos] = kept;
+                }
+            }
+        }
+
+        std::cout << "{\"check\":\"mailbox_names\",\"variant\":\"" << kernelNames[k] << "\",\"cases\":" << cases
+                  << ",\"mismatches\":" << mismatches << "}" << std::endl;
+        rc |= mismatches != 0;
+    }
+    useNameKernel(detected);
+    return rc;
+}
+
+/*
+Input: (const char*) Scratch directory made by mkdtemp.
+Output: (bool) True once it and everything in it are gone.
+*/
+static bool removeScratch(const char *scratch)
+{
+    std::error_code error;
+    if (fs::remove_all(scratch, error) == (std::uintmax_t)-1)
+    {
+        std::cerr << "Cannot remove " << scratch << ": " << error.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+Message numbering in a scratch mailbox holding 10, 1k and 50k messages: the
+sequence file path, and the directory scan that rebuilds a missing one.
+*/
+static int benchSequence()
+{
+    char scratch[] = "/tmp/mail-bench.XXXXXX";
+    if (mkdtemp(scratch) == NULL)
+    {
+        std::cerr << "Cannot create a scratch mailbox" << std::endl;
+        return 1;
+    }
+
+    const long counts[] = {10, 1000, 50000};
+    long made = 0;
+    int rc = 0;
+    for (long count : counts)
+    {
+        for (; made < count; made++)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "/%05ld", made + 1);
+            int fd = open((std::string(scratch) + name).c_str(), O_WRONLY | O_CREAT, 0600);
+            close(fd);
+        }
+
+        int dir = open(scratch, O_RDONLY | O_DIRECTORY);
+        std::string variant = std::to_string(count);
+
+        // Rebuilt from a scan each time: the sequence file is removed before every call
+        std::string scan = "scan_" + variant;
+        run("getNextNumber", scan.c_str(), 0, [&]() {
+            unlinkat(dir, MAILBOX_SEQ_FILE, 0);
+            rc |= getNextNumber(dir) == "ERROR";
+        });
+
+        // Steady state: every call takes the next number (room for 99999 in all)
+        std::string seq = "seq_" + variant;
+        unlinkat(dir, MAILBOX_SEQ_FILE, 0);
+        run("getNextNumber", seq.c_str(), 0, [&]() { rc |= getNextNumber(dir) == "ERROR"; }, 40000);
+        unlinkat(dir, MAILBOX_SEQ_FILE, 0);
+
+        close(dir);
+    }
+
+    rc |= !removeScratch(scratch);
+    if (rc)
+    {
+        std::cerr << "getNextNumber failed" << std::endl;
+    }
+    return rc;
+}
+
+/*
+Header building for mail-out with 1, 10 and 100 recipients.
+*/
+static int benchIpc()
+{
+    const int counts[] = {1, 10, 100};
+    for (int count : counts)
+    {
+        FullMessage message;
+        message.mailFrom = "alice";
+        for (int i = 0; i < count; i++)
+        {
+            message.rcptTo.push_back("recipient" + std::to_string(i));
+        }
+
+        size_t bytes = ipcHelper(message).size();
+        std::string variant = std::to_string(count) + "_rcpt";
+        size_t sink = 0;
+        run("ipcHelper", variant.c_str(), bytes, [&]() { sink += ipcHelper(message).size(); });
+        if (sink == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Whole-input parsing of a 64 MB file of generated mail (4 KB bodies, a few
+rejected messages) without delivering it, with parseParallel on 1, 2, 4 ...
+threads up to the core count.
+*/
+static int benchShards()
+{
+    char scratch[] = "/tmp/mail-bench.XXXXXX";
+    if (mkdtemp(scratch) == NULL)
+    {
+        std::cerr << "Cannot create a scratch tree" << std::endl;
+        return 1;
+    }
+
+    // Mailboxes user0 .. user99 and an input that uses them, with every 50th sender unknown
+    std::string tree = scratch;
+    mkdir((tree + "/mail").c_str(), 0700);
+    std::vector<std::string> names;
+    for (int i = 0; i < 100; i++)
+    {
+        names.push_back("user" + std::to_string(i));
+        mkdir((tree + "/mail/" + names.back()).c_str(), 0700);
+    }
+    std::string input;
+    std::mt19937 rng(1);
+    for (long m = 0; input.size() < (64 << 20); m++)
+    {
+        appendMessage(input, names, 1 + m % 3, 4 << 10, rng);
+        if (m % 50 == 0)
+        {
+            input += "MAIL FROM:<nobody>\nRCPT TO:<user1>\nDATA\n" + makeBody(1 << 10, m);
+        }
+    }
+    int fd = open((tree + "/input").c_str(), O_RDWR | O_CREAT, 0600);
+    int rc = fd < 0 || !writeAll(fd, input.data(), input.size());
+
+    // MailboxRegistry opens ./mail when it is constructed
+    int cwd = open(".", O_RDONLY | O_DIRECTORY);
+    rc |= chdir(scratch) != 0;
+    MailboxRegistry mailboxes;
+    rc |= !mailboxes.load();
+    rc |= cwd < 0 || fchdir(cwd) != 0;
+
+    // Rejected messages print a diagnostic each; keep them off the results
+    int err = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+
+    int cores = std::max(1u, std::thread::hardware_concurrency());
+    for (int threads = 1; threads <= cores; threads *= 2)
+    {
+        std::string variant = "threads_" + std::to_string(threads);
+        run("parseInput", variant.c_str(), input.size(), [&]() {
+            rc |= lseek(fd, 0, SEEK_SET) != 0; // Parsing leaves the offset at the end, as reading does
+            rc |= parseParallel(fd, threads, mailboxes, SPOOL_THRESHOLD, NULL) != PARSE_END_INPUT;
+        }, 10);
+    }
+
+    dup2(err, STDERR_FILENO);
+    close(err);
+    close(null);
+    close(fd);
+    close(cwd);
+    rc |= !removeScratch(scratch);
+    if (rc)
+    {
+        std::cerr << "Parsing failed" << std::endl;
+    }
+    return rc;
+}
+
+/*
+Output: (std::vector<std::string>) Mailbox names for generated input: the
+current tree's ./mail when run from a tree dir, user0 .. user99 otherwise.
+*/
+static std::vector<std::string> generatorMailboxes()
+{
+    std::vector<std::string> names;
+    DIR *dir = opendir("./mail");
+    if (dir != NULL)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (validMailboxChars(entry->d_name))
+            {
+                names.push_back(entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    if (names.empty())
+    {
+        for (int i = 0; i < 100; i++)
+        {
+            names.push_back("user" + std::to_string(i));
+        }
+    }
+    return names;
+}
+
+/*
+Input: (int) Argument count, (char**) Arguments after "gen".
+Output: (int) Exit code.
+Writes synthetic mail-in input to stdout: -m messages, each from a random mailbox
+to -r random recipients, with a -b byte body from makeBody.
+*/
+static int generate(int argc, char *argv[])
+{
+    long messages = 1000;
+    long recipients = 1;
+    long bodyBytes = 1024;
+    unsigned seed = 1;
+    for (int i = 0; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i];
+        long value = std::atol(argv[i + 1]);
+        if (flag == "-m") messages = value;
+        else if (flag == "-r") recipients = value;
+        else if (flag == "-b") bodyBytes = value;
+        else if (flag == "-s") seed = value;
+        else
+        {
+            std::cerr << "Usage: mail-bench gen [-m messages] [-r recipients] [-b body bytes] [-s seed]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::string> names = generatorMailboxes();
+    std::mt19937 rng(seed);
+    std::string out;
+    for (long m = 0; m < messages; m++)
+    {
+        appendMessage(out, names, recipients, bodyBytes, rng);
+        if (out.size() > (1 << 20))
+        {
+            std::cout << out;
+            out.clear();
+        }
+    }
+    std::cout << out;
+    return 0;
+}
+
+/*
+Input: (std::vector<std::string>) Mailbox names, (uint32_t) FRAME_* flags.
+Output: (MailStats) What deliverMessage counted delivering a small message to them from
+the tree in the current directory, zeroed if any mailbox failed.
+*/
+static MailStats deliverCounted(const std::vector<std::string> &mailboxes, uint32_t flags)
+{
+    MailStats stats = MailStats();
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return stats;
+    }
+    bool sent = sendFrame(fds[1], "From: bench\nTo: box\n\n", "hello\n", flags | FRAME_WANT_STATS);
+    close(fds[1]);
+    std::string statuses = sent ? deliverMessage(fds[0], mailboxes) : "";
+    close(fds[0]);
+
+    if (statuses.size() == mailboxes.size() + sizeof(stats) &&
+        statuses.find_first_not_of(MAIL_OUT_DELIVERED) >= mailboxes.size())
+    {
+        std::memcpy(&stats, statuses.data() + mailboxes.size(), sizeof(stats));
+    }
+    return stats;
+}
+
+/*
+Output: (int) 1 if a FRAME_SYNC delivery into a fanout mailbox does not sync what its
+name depends on, 0 otherwise: the first message syncs the directories it created (0
+and 0/000) and the mailbox, the second the leaf 0/000 and the mailbox, and without
+FRAME_SYNC nothing is synced.
+*/
+static int checkFanoutSync()
+{
+    char scratch[] = "/tmp/mail-bench.XXXXXX";
+    if (mkdtemp(scratch) == NULL)
+    {
+        std::cerr << "Cannot create a scratch tree" << std::endl;
+        return 1;
+    }
+
+    std::string tree = scratch;
+    bool made = mkdir((tree + "/" + MAIL_TMP_DIR).c_str(), 0700) == 0 && mkdir((tree + "/" + MAIL_DIR).c_str(), 0700) == 0 &&
+                mkdir((tree + "/" + MAIL_DIR + "/box").c_str(), 0700) == 0;
+    int marker = made ? open((tree + "/" + MAIL_DIR + "/box/" + MAILBOX_FANOUT_FILE).c_str(), O_WRONLY | O_CREAT, MAILBOX_FANOUT_MODE) : -1;
+    made = marker >= 0;
+    if (marker >= 0)
+    {
+        close(marker);
+    }
+
+    // deliverMessage works on the tree in the current directory
+    const uint64_t expected[] = {3, 2, 0};
+    const uint32_t flags[] = {FRAME_SYNC, FRAME_SYNC, 0};
+    long mismatches = 0;
+    int cwd = open(".", O_RDONLY | O_DIRECTORY);
+    made = made && cwd >= 0 && chdir(scratch) == 0;
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++)
+    {
+        MailStats stats = made ? deliverCounted({"box"}, flags[i]) : MailStats();
+        std::string name = messageName(i + 1, true);
+        struct stat st;
+        bool stored = stats.counters[STAT_OUT_MESSAGES] == 1 && stat((std::string(MAIL_DIR) + "/box/" + name).c_str(), &st) == 0;
+        if ((!stored || stats.counters[STAT_OUT_DIR_SYNCS] != expected[i]) && mismatches++ == 0)
+        {
+            std::cerr << "Delivering " << name << " synced " << stats.counters[STAT_OUT_DIR_SYNCS] << " directories, expected "
+                      << expected[i] << (stored ? "" : " (not stored)") << std::endl;
+        }
+    }
+    if (cwd >= 0)
+    {
+        made = fchdir(cwd) == 0 && made;
+        close(cwd);
+    }
+    made = removeScratch(scratch) && made;
+
+    std::cout << "{\"check\":\"fanout_sync\",\"cases\":" << sizeof(expected) / sizeof(expected[0]) << ",\"mismatches\":" << mismatches << "}"
+              << std::endl;
+    return mismatches != 0 || !made;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && std::string(argv[1]) == "gen")
+    {
+        return generate(argc - 2, argv + 2);
+    }
+    if (argc > 1 && std::string(argv[1]) == "check")
+    {
+        return checkControlLines() | checkNameValidators() | checkFanoutSync();
+    }
+
+    std::vector<std::string> selected(argv + 1, argv + argc);
+    auto wanted = [&](const char *name) {
+        return selected.empty() || std::find(selected.begin(), selected.end(), name) != selected.end();
+    };
+
+    int rc = 0;
+    if (wanted("body")) rc |= benchBodyScan();
+    if (wanted("parse")) rc |= benchParse();
+    if (wanted("seq")) rc |= benchSequence();
+    if (wanted("ipc")) rc |= benchIpc();
+    if (wanted("shard")) rc |= benchShards();
+    return rc;
+}
@@ -6,262 +6,143 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <csignal>
 #include "mail_utils.h"
-
-int main()
+#include "mail_delivery.h"
+#include "mail_reader.h"
+#include "mail_parser.h"
+#include "mail_registry.h"
+#include "mail_stats.h"
+
+/*
+Input: (void*) The DeliveryScheduler, (int) Input fd.
+Waits for input while the scheduler keeps reaping and committing (see DeliveryScheduler::waitForInput).
+*/
+static void waitForInput(void *scheduler, int fd)
 {
-    // Set flags for parsing input
-    bool mailFromMode = true;
-    bool rcptToMode = false;
-    bool dataMode = false;
-    bool skipMode = false;
-    int bytesRead = 0;
-
-    // Store all full messages parsed
-    std::vector<FullMessage> fullMessages;
+    ((DeliveryScheduler *)scheduler)->waitForInput(fd);
+}
 
-    // Read the input file (preventing overflow)
-    std::string line;
-    
-    // Store read data while reading
-    std::string mailFromUsername;
-    std::vector<std::string> rcptToUsernames;
-    std::vector<std::string> messageLines;
-    
-    try
+int main(int argc, char* argv[])
+{
+    // Optional: -j N caps the number of mail-out processes running at once
+    // Optional: --stats (or MAIL_STATS in the environment) prints counters and timings at exit
+    // Optional: --spool BYTES sets how much of a body is held in memory before it goes to tmp/
+    // Optional: --sync none|message|group (with --sync-batch N, --sync-window MS) sets durability
+    // Optional: --dedup stores each distinct body once, in blobs/
+    // Optional: --compress LEVEL (1-9) has mail-out store messages zlib compressed
+    // Optional: --parse-threads N parses a file input on N threads (same results as one)
+    int jobs = defaultDeliveryJobs();
+    bool stats = getenv(MAIL_STATS_ENV) != NULL;
+    long long spoolThreshold = SPOOL_THRESHOLD;
+    SyncPolicy sync{SYNC_NONE, SYNC_GROUP_BATCH, SYNC_GROUP_WINDOW_MS};
+    bool dedup = false;
+    int compressLevel = 0;
+    int parseThreads = 1;
+    for (int i = 1; i < argc; i++)
     {
-        while (std::getline(std::cin, line))
+        std::string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc && isNumeric(argv[i + 1]) && std::strlen(argv[i + 1]) <= 4)
         {
-            if (line.empty())
-            {
-                bytesRead += 1;
-                if (bytesRead > MAX_MSG_SIZE)
-                {
-                    std::cerr << "Maximum message size exceeded. Aborting mail-in parsing.\n";
-                    return 1;
-                }
-            }
-            else
-            {
-                bytesRead += line.size();
-                if (bytesRead > MAX_MSG_SIZE)
-                {
-                    std::cerr << "Maximum message size exceeded. Aborting mail-in parsing.\n";
-                    return 1;
-                }
-            }
-
-            // SKIP MODE -- get to end of line '.'
-            if (skipMode)
-            {
-                if (line.empty())
-                {
-                    continue;
-                }
-                if (line == ".")
-                {
-                    // Flush out the variables, ready for new message
-                    mailFromUsername.clear();
-                    rcptToUsernames.clear();
-                    messageLines.clear();
-
-                    skipMode = false;
-                    mailFromMode = true;
-                    rcptToMode = false;
-                    dataMode = false;
-                }
-            }
-            // MODE 1: MAIL FROM:<username>
-            else if(mailFromMode && !rcptToMode && !dataMode && !skipMode)
-            {
-                // Reject newlines out of place
-                if (line.empty())
-                {
-                    std::cerr << "Empty line found in control lines. Skipping to end-of-message.\n";
-                    skipMode = true;
-                    continue; 
-                }
-
-                // Check correct MAIL FROM format
-                if (!checkMailFrom(line))
-                {
-                    std::cerr << "MAIL FROM control line invalid formatting. Skipping to end-of-message.\n";
-                    skipMode = true;
-                    continue;
-                }
-
-                // Extract username from brackets
-                std::string testUsername = extractUsername(line); 
-                if ( !validMailboxChars(testUsername) )
-                {
-                    std::cerr << "Invalid MAIL FROM username. Skipping to end-of-message.\n";
-                    skipMode = true;
-                    continue;
-                }
-
-                if( !doesMailboxExist(testUsername) )
-                {
-                    std::cerr << "Invalid MAIL FROM username. Skipping to end-of-message.\n";
-                    skipMode = true;
-                    continue;
-                }
-                else
-                {
-                    mailFromUsername = testUsername;
-                }
-
-                // Change modes
-                mailFromMode = false;
-                rcptToMode = true;
-                dataMode = false;
-            }
-            // MODE 2: RCPT TO:<username>
-            else if(rcptToMode && !mailFromMode && !dataMode && !skipMode)
-            {
-                // Reject newlines out of place
-                if (line.empty())
-                {
-                    std::cerr << "Empty line found in control lines. Skipping to end-of-message.\n";
-                    skipMode = true;
-                    continue;
-                }
-
-                // Check if this line is the DATA delimiter (if so, continue)
-                if(checkDataDelimiter(line))
-                {
-                    // Invalid if there are no valid rcptTo usernames (valid if at least one)
-                    if ( rcptToUsernames.empty() )
-                    {
-                        std::cerr << "No valid RCPT TO lines. Skipping to end-of-message.\n";
-                        skipMode = true;
-                        continue;
-                    }
-
-                    // Switch mode
-                    mailFromMode = false;
-                    rcptToMode = false;
-                    dataMode = true;
-                    continue;
-                }
+            jobs = std::atoi(argv[++i]);
+        }
+        else if (arg == "--stats")
+        {
+            stats = true;
+        }
+        else if (arg == "--spool" && i + 1 < argc && isNumeric(argv[i + 1]) && std::strlen(argv[i + 1]) <= 10)
+        {
+            spoolThreshold = std::atoll(argv[++i]);
+        }
+        else if (arg == "--sync" && i + 1 < argc && std::strcmp(argv[i + 1], "none") == 0)
+        {
+            sync.mode = SYNC_NONE;
+            i++;
+        }
+        else if (arg == "--sync" && i + 1 < argc && std::strcmp(argv[i + 1], "message") == 0)
+        {
+            sync.mode = SYNC_MESSAGE;
+            i++;
+        }
+        else if (arg == "--sync" && i + 1 < argc && std::strcmp(argv[i + 1], "group") == 0)
+        {
+            sync.mode = SYNC_GROUP;
+            i++;
+        }
+        else if (arg == "--dedup")
+        {
+            dedup = true;
+        }
+        else if (arg == "--compress" && i + 1 < argc && std::strlen(argv[i + 1]) == 1 && argv[i + 1][0] >= '1' && argv[i + 1][0] <= '9')
+        {
+            compressLevel = argv[++i][0] - '0';
+        }
+        else if (arg == "--sync-batch" && i + 1 < argc && isNumeric(argv[i + 1]) && std::strlen(argv[i + 1]) <= 6)
+        {
+            sync.batch = std::atoi(argv[++i]);
+        }
+        else if (arg == "--sync-window" && i + 1 < argc && isNumeric(argv[i + 1]) && std::strlen(argv[i + 1]) <= 6)
+        {
+            sync.windowMs = std::atoi(argv[++i]);
+        }
+        else if (arg == "--parse-threads" && i + 1 < argc && isNumeric(argv[i + 1]) && std::strlen(argv[i + 1]) <= 4)
+        {
+            parseThreads = std::atoi(argv[++i]);
+        }
+        else
+        {
+            std::cerr << "Usage: mail-in [-j jobs] [--stats] [--spool bytes] [--sync none|message|group]\n"
+                      << "               [--sync-batch messages] [--sync-window ms] [--dedup]\n"
+                      << "               [--compress level] [--parse-threads threads] < input\n";
+            return 1;
+        }
+    }
 
-                // Check correct RCPT TO format
-                if (!checkRcptTo(line))
-                {
-                    std::cerr << "RCPT TO control line invalid formatting. Skipping to end-of-message.\n";
-                    skipMode = true;
-                    continue;
-                }
+    // Declared first so it reports last, after every delivery has finished
+    StatsReport report(stats);
 
-                // Extract username from brackets
-                std::string testUsername = extractUsername(line);
-                if( !validMailboxChars(testUsername) )
-                {
-                    std::cerr << "Invalid RCPT TO username. Violates formatting." << std::endl;
-                }
-                else
-                {
-                    rcptToUsernames.push_back(testUsername);
-                }
-            }
-            // MODE 3: DATA
-            else if(dataMode && !mailFromMode && !rcptToMode && !skipMode)
-            {
-                // Empty lines just get added as newlines
-                if (line.empty())
-                {
-                    messageLines.push_back("\n");
-                    continue;
-                }
+    // mail-out may exit before reading its input (e.g. unknown mailbox); that must
+    // not take down the rest of the stream with it
+    signal(SIGPIPE, SIG_IGN);
 
-                // End of message check
-                if (line == ".")
-                {
-                    FullMessage newMessage;
-                    newMessage.mailFrom = mailFromUsername;
-                    std::sort( rcptToUsernames.begin(), rcptToUsernames.end() );
-                    rcptToUsernames.erase( std::unique( rcptToUsernames.begin(), rcptToUsernames.end() ), rcptToUsernames.end() );
-                    newMessage.rcptTo = rcptToUsernames;
-                    newMessage.data = messageLines;
-                    fullMessages.push_back(newMessage);
+    // Mailboxes are listed once, not looked up per MAIL FROM
+    MailboxRegistry mailboxes;
+    mailboxes.load();
 
-                    // Flush out the variables, ready for new message
-                    mailFromUsername.clear();
-                    rcptToUsernames.clear();
-                    messageLines.clear();
+    // Deliveries run in the background while parsing continues
+    DeliveryScheduler scheduler(jobs, sync, dedup, compressLevel);
 
-                    // Switch back to mailFrom mode
-                    mailFromMode = true;
-                    rcptToMode = false;
-                    dataMode = false;
-                }
-                // Actual content
-                else
-                {
-                    if (line[0] == '.')
-                    {
-                        line = line.substr(1);
-                    }
-                    
-                    messageLines.push_back(line);
-                }
-            }
-        }
-    }
-    catch (const std::bad_alloc& e)
+    // A file input can be parsed on several threads; a pipe is read as it comes
+    struct stat st;
+    ParseEnd end;
+    if (parseThreads > 1 && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
     {
-        std::cerr << "Memory allocation failed. Aborting mail-in file parsing. Nice try. \n"; 
-        return 1;
+        end = parseParallel(STDIN_FILENO, parseThreads, mailboxes, spoolThreshold, &scheduler);
     }
-
-    //std::cout << "Messages found: " << fullMessages.size() << std::endl;
-    for ( FullMessage const&  fullMessage : fullMessages)
+    else
     {
-        std::vector<std::string> writeList = ipcHelper(fullMessage);
-        for ( std::string sendTo : fullMessage.rcptTo)
+        LineReader reader(STDIN_FILENO);
+        if (sync.mode == SYNC_GROUP)
         {
-            // Open up mail-out for each message we want to mailbox to send to
-            int pipe_fd[2];
-            pid_t p;
-
-            if (pipe(pipe_fd) == -1) 
-            {
-                std::cerr << "Pipe failed." << std::endl;
-                return 1;
-            }
-
-            p = fork();    
-            if (p < 0) 
-            {
-                // Failed fork
-                std::cerr << "Fork failed." << std::endl;
-                return 1;
-            }
-            else if (p == 0)
-            {
-                // Child process
-                close(pipe_fd[1]);               // Close the writing end of the pipe
-                close(STDIN_FILENO);             // Close the current stdin 
-                dup2(pipe_fd[0], STDIN_FILENO);  // Replace stdin with the reading end of the pipe
-                execl("./bin/mail-out", "./bin/mail-out", sendTo.data(), NULL);
-            } 
-            else 
-            {
-                // Parent process
-                int status;
-                close(pipe_fd[0]); // Close the reading end of the pipe
-                for ( std::string writeStr : writeList )
-                {
-                    write(pipe_fd[1], writeStr.c_str(), strlen(writeStr.c_str()) + 1);
-                }
-                close(pipe_fd[1]);
-                p = wait(&status);
-                if (WEXITSTATUS(status) == 1)
-                {
-                    std::cerr << "mail-out invocation failed on message from " << fullMessage.mailFrom << std::endl;
-                }
-            }
+            reader.setInputWait(waitForInput, &scheduler); // Commits come due while a pipe is quiet
         }
+        ParseOutput output{&scheduler};
+        end = parseMessages(reader, PARSE_MAIL_FROM, 0, mailboxes, spoolThreshold, output).end;
     }
 
-    return 0;
-}
\ No newline at end of file
+    if (end == PARSE_END_TRUNCATED || inputTruncated())
+    {
+        std::cerr << "Input file was truncated while it was read. Aborting mail-in parsing.\n";
+        return 1;
+    }
+    if (end == PARSE_END_OVERSIZE)
+    {
+        std::cerr << "Maximum message size exceeded. Aborting mail-in parsing.\n";
+    }
+    else if (end == PARSE_END_NO_MEMORY)
+    {
+        std::cerr << "Memory allocation failed. Aborting mail-in file parsing. Nice try. \n";
+    }
+    return end == PARSE_END_INPUT ? 0 : 1;
+}
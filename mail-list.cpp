@@ -0,0 +1,146 @@
+#include <string>
+#include <iostream>
+#include <cstring>
+#include <ctime>
+#include <cstdio>
+#include <unistd.h>
+#include "mail_utils.h"
+#include "mail_registry.h"
+#include "mail_summary.h"
+
+// Listing output is written out in pieces of about this size
+#define LIST_BUFFER_SIZE (64 << 10)
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number, (SummaryEntry) Its entry.
+Output: (std::string) Its sender, read from the message itself when the entry only holds the start.
+*/
+static std::string fullSender(int mailbox_fd, uint64_t number, const SummaryEntry &entry)
+{
+    std::string sender;
+    SummaryEntry stored;
+    if ((entry.flags & SUMMARY_SENDER_CUT) && summarizeStored(mailbox_fd, number, stored, sender))
+    {
+        return sender;
+    }
+    return summarySender(entry);
+}
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number, (SummaryEntry) Its entry, (std::string) Sender wanted.
+Output: (bool) Whether the message is from that sender.
+Decided from the entry alone unless it holds a cut sender that starts the same way.
+*/
+static bool fromSender(int mailbox_fd, uint64_t number, const SummaryEntry &entry, const std::string &from)
+{
+    size_t kept = strnlen(entry.sender, sizeof(entry.sender));
+    if (!(entry.flags & SUMMARY_SENDER_CUT))
+    {
+        return kept == from.size() && memcmp(entry.sender, from.data(), kept) == 0;
+    }
+    return from.size() > kept && memcmp(entry.sender, from.data(), kept) == 0 && fullSender(mailbox_fd, number, entry) == from;
+}
+
+/*
+Input: (std::string) Output to append to, (uint64_t) Message number, (SummaryEntry) Its entry, (std::string) Its sender.
+Appends the message's line: number, delivery time (UTC), size, recipients and sender, tab separated.
+*/
+static void formatEntry(std::string &out, uint64_t number, const SummaryEntry &entry, const std::string &sender)
+{
+    time_t time = entry.time;
+    struct tm utc;
+    char when[32] = "-";
+    if (gmtime_r(&time, &utc) != NULL)
+    {
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    }
+
+    char line[128];
+    snprintf(line, sizeof(line), "%llu\t%s\t%llu\t%u\t", (unsigned long long)number, when, (unsigned long long)entry.size, entry.recipients);
+    out += line;
+    out += sender;
+    out += '\n';
+}
+
+int main(int argc, char* argv[])
+{
+    // Must be run from the tree dir, like mail-tool
+    std::string command = argc > 1 ? argv[1] : "";
+
+    // list / count MAILBOX [--from SENDER]: answered from the mailbox's summary alone
+    bool filter = argc == 5 && std::strcmp(argv[3], "--from") == 0;
+    if ((command == "list" || command == "count") && (argc == 3 || filter))
+    {
+        MailboxRegistry registry;
+        int dir_fd = registry.dirFd(argv[2]);
+
+        // First query of a mailbox (or one whose summary is damaged) builds it; deliveries
+        // keep it up to date from then on
+        bool usable;
+        {
+            SummaryMap probe(dir_fd);
+            usable = probe.valid();
+        }
+        if (!usable && dir_fd >= 0 && checkSummary(dir_fd, false) < 0)
+        {
+            dir_fd = -1;
+        }
+        SummaryMap summary(dir_fd);
+        if (!summary.valid())
+        {
+            std::cerr << "Cannot read the summary of " << argv[2] << ".\n";
+            return 1;
+        }
+
+        std::string from = filter ? argv[4] : "";
+        std::string out;
+        uint64_t matched = 0;
+        for (uint64_t number = 1; number < summary.end(); number++)
+        {
+            const SummaryEntry &entry = summary[number];
+            if (!(entry.flags & SUMMARY_PRESENT) || (filter && !fromSender(dir_fd, number, entry, from)))
+            {
+                continue;
+            }
+            matched++;
+
+            if (command == "list")
+            {
+                formatEntry(out, number, entry, filter ? from : fullSender(dir_fd, number, entry));
+                if (out.size() >= LIST_BUFFER_SIZE)
+                {
+                    if (!writeAll(STDOUT_FILENO, out.data(), out.size()))
+                    {
+                        return 1;
+                    }
+                    out.clear();
+                }
+            }
+        }
+
+        if (command == "count")
+        {
+            out = std::to_string(matched) + "\n";
+        }
+        return writeAll(STDOUT_FILENO, out.data(), out.size()) ? 0 : 1;
+    }
+
+    // check / rebuild MAILBOX: brings the summary in line with the stored messages
+    if ((command == "check" || command == "rebuild") && argc == 3)
+    {
+        MailboxRegistry registry;
+        int dir_fd = registry.dirFd(argv[2]);
+        long changed = dir_fd >= 0 ? checkSummary(dir_fd, command == "rebuild") : -1;
+        if (changed < 0)
+        {
+            std::cerr << "Cannot " << command << " the summary of " << argv[2] << ".\n";
+            return 1;
+        }
+        std::cout << "Updated " << changed << " entries.\n";
+        return 0;
+    }
+
+    std::cerr << "Usage: mail-list list|count <mailbox> [--from <sender>]\n"
+              << "       mail-list check|rebuild <mailbox>\n";
+    return 1;
+}
@@ -0,0 +1,768 @@
+#include <string>
+#include <vector>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <filesystem>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <cerrno>
+#include <csignal>
+#include <spawn.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+#include "mail_utils.h"
+#include "mail_store.h"
+#include "mail_registry.h"
+namespace fs = std::filesystem;
+
+// End-to-end load test: K mail-in processes at once, each fed a stream of
+// generated messages, in a scratch tree made by install-unpriv.sh (never
+// install-priv.sh, so no root is needed). Every stored copy is checked
+// against what was sent, and the time it appeared gives its delivery latency.
+//
+// Usage: mail-load [-t tree] [-k pipelines] [-m messages per pipeline] [-n mailboxes]
+//                  [--zipf s] [--sizes bytes:weight,...] [-r min:max] [--rate messages/s]
+//                  [--daemon] [--keep] [-s seed] [-- mail-in options]
+
+#define LOAD_MAIL_IN "./bin/mail-in"
+#define LOAD_MAIL_OUTD "./bin/mail-outd"
+
+// First body line of every generated message: "Load-Id: PIPELINE.INDEX SENT_NS"
+#define LOAD_ID_TAG "Load-Id: "
+
+// Bytes of a stored message read to find its Load-Id line
+#define LOAD_HEAD_MAX 4096
+
+// A message is linked into its mailbox under its final name (or renamed there)
+#define LOAD_WATCH_EVENTS (IN_CREATE | IN_MOVED_TO)
+
+// Width of the printed latency histogram's longest bar
+#define LOAD_BAR_WIDTH 40
+
+struct LoadConfig
+{
+    std::string tree = "load-tree";
+    int pipelines = 4;
+    long messages = 1000;  // Per pipeline
+    int mailboxes = 0;     // 0: those install-unpriv.sh makes
+    double zipf = 1.0;     // Recipient skew, 0 for uniform
+    std::vector<std::pair<long, double>> sizes{{1024, 80}, {16384, 18}, {262144, 2}};
+    int minRecipients = 1;
+    int maxRecipients = 3;
+    double rate = 0;       // Messages per second per pipeline, 0 for as fast as mail-in takes them
+    bool daemon = false;
+    bool keep = false;
+    unsigned seed = 1;
+    std::vector<std::string> mailInArgs;
+};
+
+// A message one pipeline sent: mailbox indexes it went to, and how many copies each holds
+struct SentMessage
+{
+    std::vector<int> recipients;
+    std::vector<int> found;
+};
+
+// A message file that appeared in a mailbox while the test ran
+struct Arrival
+{
+    int mailbox;
+    std::string name; // Relative to the mailbox, fanout directories included
+    long long ns;
+};
+
+/*
+Output: (long long) Wall clock time in nanoseconds (comparable with file times).
+*/
+static long long nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+Input: (std::string) "bytes:weight,..." list, (std::vector) Filled with its pairs.
+Output: (bool) Whether the list was well formed.
+*/
+static bool parseSizes(const std::string &text, std::vector<std::pair<long, double>> &sizes)
+{
+    sizes.clear();
+    size_t pos = 0;
+    while (pos < text.size())
+    {
+        size_t comma = text.find(',', pos);
+        std::string item = text.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t colon = item.find(':');
+        if (colon == std::string::npos || !isNumeric(item.substr(0, colon)) || colon > 10)
+        {
+            return false;
+        }
+        double weight = std::atof(item.c_str() + colon + 1);
+        if (weight <= 0)
+        {
+            return false;
+        }
+        sizes.push_back(std::make_pair(std::atol(item.c_str()), weight));
+        pos = comma == std::string::npos ? text.size() : comma + 1;
+    }
+    return !sizes.empty();
+}
+
+/*
+Input: (std::vector<double>) Weights.
+Output: (std::vector<double>) Their running totals, normalized to end at 1.
+*/
+static std::vector<double> cumulative(const std::vector<double> &weights)
+{
+    std::vector<double> cdf;
+    double total = 0;
+    for (double weight : weights)
+    {
+        total += weight;
+        cdf.push_back(total);
+    }
+    for (double &value : cdf)
+    {
+        value /= total;
+    }
+    return cdf;
+}
+
+/*
+Input: (std::vector<double>) From cumulative, (std::mt19937) Random source.
+Output: (int) Index drawn with the weights' probabilities.
+*/
+static int pick(const std::vector<double> &cdf, std::mt19937 &rng)
+{
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    return std::min((int)(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()), (int)cdf.size() - 1);
+}
+
+/*
+Input: (std::string) Message to append to, (size_t) Body bytes wanted.
+Appends text lines (never starting with '.') until the body has about that size.
+*/
+static void appendFiller(std::string &out, size_t bytes)
+{
+    static const std::string line = "the quick brown fox jumps over the lazy dog while the mail keeps on arriving\n";
+    for (size_t added = 0; added < bytes; added += line.size())
+    {
+        out += line;
+    }
+}
+
+/*
+Input: (std::string) Mailbox listing dir, (int) Mailboxes wanted, 0 for those there are.
+Output: (std::vector<std::string>) Mailbox names in listing order, made up to the count with load0, load1 ...
+*/
+static std::vector<std::string> loadMailboxes(const std::string &mailDir, int wanted)
+{
+    std::vector<std::string> names;
+    DIR *dir = opendir(mailDir.c_str());
+    if (dir != NULL)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (validMailboxChars(entry->d_name))
+            {
+                names.push_back(entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(names.begin(), names.end());
+
+    if (wanted > 0 && (int)names.size() > wanted)
+    {
+        names.resize(wanted);
+    }
+    for (int i = 0; (int)names.size() < wanted; i++)
+    {
+        std::string name = "load" + std::to_string(i);
+        if (mkdir((mailDir + "/" + name).c_str(), 0755) == 0)
+        {
+            names.push_back(name);
+        }
+        else if (errno != EEXIST)
+        {
+            break;
+        }
+    }
+    return names;
+}
+
+/*
+Input: (int) Pipeline number, (std::vector<std::string>) mail-in options, (pid_t) Set to the child,
+       (int) Set to the writing end of its input.
+Output: (bool) Whether mail-in was started, reading its input from a pipe, its stderr going to load.N.err.
+*/
+static bool spawnMailIn(int pipeline, const std::vector<std::string> &args, pid_t &pid, int &input_fd)
+{
+    int pipe_fd[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) == -1)
+    {
+        return false;
+    }
+
+    std::string errFile = "load." + std::to_string(pipeline) + ".err";
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fd[0], STDIN_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, errFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    std::vector<char *> argv;
+    argv.push_back((char *)LOAD_MAIL_IN);
+    for (const std::string &arg : args)
+    {
+        argv.push_back((char *)arg.c_str());
+    }
+    argv.push_back(NULL);
+
+    int err = posix_spawn(&pid, LOAD_MAIL_IN, &actions, NULL, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipe_fd[0]);
+    if (err != 0)
+    {
+        close(pipe_fd[1]);
+        return false;
+    }
+    input_fd = pipe_fd[1];
+    return true;
+}
+
+/*
+Input: (LoadConfig) Test settings, (int) Pipeline number, (std::vector<std::string>) Mailbox names,
+       (std::vector<double>) Recipient CDF, (std::vector<double>) Size CDF, (int) mail-in's input,
+       (std::vector<SentMessage>) Filled with what was sent.
+Writes the pipeline's messages to its mail-in, paced to the rate if there is one, then closes the input.
+Each message carries its pipeline, index and the time it was due (so time spent
+waiting for a busy mail-in counts as latency).
+*/
+static void feedPipeline(const LoadConfig &config, int pipeline, const std::vector<std::string> &names,
+                         const std::vector<double> &recipientCdf, const std::vector<double> &sizeCdf,
+                         int input_fd, std::vector<SentMessage> &sent)
+{
+    std::mt19937 rng(config.seed * 7919 + pipeline);
+    int most = std::min(config.maxRecipients, (int)names.size());
+    int least = std::min(config.minRecipients, most);
+    long long begin = nowNs();
+    std::string out;
+    sent.resize(config.messages);
+    for (long i = 0; i < config.messages; i++)
+    {
+        long long due = nowNs();
+        if (config.rate > 0)
+        {
+            due = begin + (long long)(i * 1e9 / config.rate);
+            long long wait = due - nowNs();
+            if (wait > 0)
+            {
+                struct timespec ts = {(time_t)(wait / 1000000000), (long)(wait % 1000000000)};
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        // Distinct recipients (mail-in would merge repeats anyway)
+        SentMessage &message = sent[i];
+        int count = std::uniform_int_distribution<int>(least, most)(rng);
+        while ((int)message.recipients.size() < count)
+        {
+            int mailbox = pick(recipientCdf, rng);
+            if (std::find(message.recipients.begin(), message.recipients.end(), mailbox) == message.recipients.end())
+            {
+                message.recipients.push_back(mailbox);
+            }
+        }
+        message.found.assign(count, 0);
+
+        out.clear();
+        out += "MAIL FROM:<" + names[rng() % names.size()] + ">\n";
+        for (int mailbox : message.recipients)
+        {
+            out += "RCPT TO:<" + names[mailbox] + ">\n";
+        }
+        out += "DATA\n";
+        out += LOAD_ID_TAG + std::to_string(pipeline) + "." + std::to_string(i) + " " + std::to_string(due) + "\n";
+        appendFiller(out, config.sizes[pick(sizeCdf, rng)].first);
+        out += ".\n";
+        if (!writeAll(input_fd, out.data(), out.size()))
+        {
+            sent.resize(i); // mail-in is gone; the rest was never sent
+            break;
+        }
+    }
+    close(input_fd);
+}
+
+/*
+Input: (int) inotify fd watching the mailboxes, (std::vector<std::string>) Mailbox names,
+       (std::unordered_map<int, std::pair<int, std::string>>) Watch to mailbox and directory prefix,
+       (std::atomic<bool>) Set once every mail-in has exited, (std::vector<Arrival>) Filled with
+       the message files that appeared, (long) Set to the number of times events were lost.
+Records when each message file appeared. Fanout directories are watched as they are made.
+*/
+static void watchArrivals(int inotify_fd, const std::vector<std::string> &names, std::unordered_map<int, std::pair<int, std::string>> &watches,
+                          std::atomic<bool> &done, std::vector<Arrival> &arrivals, long &overflows)
+{
+    std::vector<char> buffer(1 << 20);
+    while (true)
+    {
+        struct pollfd p = {inotify_fd, POLLIN, 0};
+        int ready = poll(&p, 1, 100);
+        if (ready <= 0)
+        {
+            if (done)
+            {
+                return; // Quiet after the last mail-in: nothing more is coming
+            }
+            continue;
+        }
+
+        ssize_t n = read(inotify_fd, buffer.data(), buffer.size());
+        long long ns = nowNs();
+        for (ssize_t pos = 0; pos < n;)
+        {
+            struct inotify_event *event = (struct inotify_event *)(buffer.data() + pos);
+            pos += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                overflows++;
+                continue;
+            }
+
+            auto watch = watches.find(event->wd);
+            if (watch == watches.end() || event->len == 0)
+            {
+                continue;
+            }
+            std::string name = watch->second.second + event->name;
+            if (event->mask & IN_ISDIR)
+            {
+                // A new fanout directory; a message linked into it before the watch is
+                // in place goes without an event and is timed by its file instead
+                std::string path = std::string(MAIL_DIR) + "/" + names[watch->second.first] + "/" + name;
+                int wd = inotify_add_watch(inotify_fd, path.c_str(), LOAD_WATCH_EVENTS);
+                if (wd >= 0)
+                {
+                    watches[wd] = std::make_pair(watch->second.first, name + "/");
+                }
+                continue;
+            }
+            if (event->name[0] != '.' && messageNumber(name) > 0)
+            {
+                arrivals.push_back(Arrival{watch->second.first, name, ns});
+            }
+        }
+    }
+}
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Message name.
+Output: (std::string) The start of its body (from its body link when its body is in blobs/), "" if unreadable.
+*/
+static std::string readBodyStart(int mailbox_fd, const std::string &name)
+{
+    std::string head;
+    int fd = openat(mailbox_fd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return "";
+    }
+    bool ok = readStoredHead(fd, 0, -1, LOAD_HEAD_MAX, head) >= 0;
+    close(fd);
+
+    // Stored as From and To lines, a blank line, then the body
+    size_t blank = head.find("\n\n");
+    if (!ok || blank == std::string::npos)
+    {
+        return "";
+    }
+    if (blank + 2 < head.size())
+    {
+        return head.substr(blank + 2);
+    }
+
+    fd = openat(mailbox_fd, bodyLinkName(name).c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return "";
+    }
+    std::string body(LOAD_HEAD_MAX, '\0');
+    ssize_t n = pread(fd, &body[0], body.size(), 0);
+    close(fd);
+    body.resize(n > 0 ? n : 0);
+    return body;
+}
+
+/*
+Input: (std::vector<long long>) Latencies in nanoseconds, sorted, (double) Fraction, e.g. 0.99.
+Output: (double) The nearest-rank percentile, in microseconds.
+*/
+static double percentile(const std::vector<long long> &sorted, double fraction)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t rank = (size_t)(fraction * sorted.size() + 0.999999);
+    return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1] / 1e3;
+}
+
+/*
+Input: (std::vector<long long>) Latencies in nanoseconds, sorted.
+Prints how many fall in each power-of-two range of microseconds.
+*/
+static void printHistogram(const std::vector<long long> &sorted)
+{
+    std::vector<long> buckets(64, 0);
+    for (long long ns : sorted)
+    {
+        long long us = ns / 1000;
+        int bucket = 0;
+        while (bucket < 63 && (1LL << bucket) < us)
+        {
+            bucket++;
+        }
+        buckets[bucket]++;
+    }
+
+    long most = *std::max_element(buckets.begin(), buckets.end());
+    int first = 0;
+    int last = 63;
+    while (first < 63 && buckets[first] == 0)
+    {
+        first++;
+    }
+    while (last > first && buckets[last] == 0)
+    {
+        last--;
+    }
+    for (int bucket = first; bucket <= last && most > 0; bucket++)
+    {
+        char line[64];
+        snprintf(line, sizeof(line), "  <= %12lld us %10ld  ", 1LL << bucket, buckets[bucket]);
+        std::cout << line << std::string((buckets[bucket] * LOAD_BAR_WIDTH + most - 1) / most, '#') << "\n";
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    LoadConfig config;
+    bool usage = false;
+    for (int i = 1; i < argc && !usage; i++)
+    {
+        std::string arg = argv[i];
+        bool value = i + 1 < argc;
+        if (arg == "--")
+        {
+            config.mailInArgs.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else if (arg == "-t" && value)
+        {
+            config.tree = argv[++i];
+        }
+        else if (arg == "-k" && value && isNumeric(argv[i + 1]) && std::strlen(argv[i + 1]) <= 4)
+        {
+            config.pipelines = std::atoi(argv[++i]);
+        }
+        else if (arg == "-m" && value && isNumeric(argv[i + 1]) && std::strlen(argv[i + 1]) <= 9)
+        {
+            config.messages = std::atol(argv[++i]);
+        }
+        else if (arg == "-n" && value && isNumeric(argv[i + 1]) && std::strlen(argv[i + 1]) <= 6)
+        {
+            config.mailboxes = std::atoi(argv[++i]);
+        }
+        else if (arg == "--zipf" && value)
+        {
+            config.zipf = std::atof(argv[++i]);
+        }
+        else if (arg == "--sizes" && value)
+        {
+            usage = !parseSizes(argv[++i], config.sizes);
+        }
+        else if (arg == "-r" && value && std::sscanf(argv[i + 1], "%d:%d", &config.minRecipients, &config.maxRecipients) == 2)
+        {
+            i++;
+        }
+        else if (arg == "--rate" && value)
+        {
+            config.rate = std::atof(argv[++i]);
+        }
+        else if (arg == "--daemon")
+        {
+            config.daemon = true;
+        }
+        else if (arg == "--keep")
+        {
+            config.keep = true;
+        }
+        else if (arg == "-s" && value && isNumeric(argv[i + 1]) && std::strlen(argv[i + 1]) <= 9)
+        {
+            config.seed = std::atoi(argv[++i]);
+        }
+        else
+        {
+            usage = true;
+        }
+    }
+    if (usage || config.pipelines < 1 || config.minRecipients < 1 || config.maxRecipients < config.minRecipients || config.zipf < 0)
+    {
+        std::cerr << "Usage: mail-load [-t tree] [-k pipelines] [-m messages per pipeline] [-n mailboxes]\n"
+                  << "                 [--zipf s] [--sizes bytes:weight,...] [-r min:max] [--rate messages/s]\n"
+                  << "                 [--daemon] [--keep] [-s seed] [-- mail-in options]\n";
+        return 1;
+    }
+
+    // A scratch tree like any other (run from the base dir, after make), removed at the end by its absolute path
+    std::string install = "./install-unpriv.sh '" + config.tree + "' > /dev/null && cp mail-in mail-out mail-outd '" + config.tree + "/bin/'";
+    std::error_code error;
+    fs::path root;
+    if (config.tree.find('\'') != std::string::npos || system(install.c_str()) != 0 ||
+        (root = fs::canonical(config.tree, error)).empty() || chdir(root.c_str()) != 0)
+    {
+        std::cerr << "Cannot create the tree " << config.tree << " (it must not exist yet).\n";
+        return 1;
+    }
+
+    std::vector<std::string> names = loadMailboxes(MAIL_DIR, config.mailboxes);
+    if (names.empty())
+    {
+        std::cerr << "No mailboxes.\n";
+        return 1;
+    }
+
+    // Mailbox i is drawn with weight 1 / (i + 1)^s (Zipf), sizes with their own weights
+    std::vector<double> weights;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        weights.push_back(1.0 / std::pow(i + 1.0, config.zipf));
+    }
+    std::vector<double> recipientCdf = cumulative(weights);
+    weights.clear();
+    for (const std::pair<long, double> &size : config.sizes)
+    {
+        weights.push_back(size.second);
+    }
+    std::vector<double> sizeCdf = cumulative(weights);
+
+    // Arrivals are timed as the names appear
+    std::unordered_map<int, std::pair<int, std::string>> watches;
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    for (size_t i = 0; i < names.size() && inotify_fd >= 0; i++)
+    {
+        int wd = inotify_add_watch(inotify_fd, (std::string(MAIL_DIR) + "/" + names[i]).c_str(), LOAD_WATCH_EVENTS);
+        if (wd >= 0)
+        {
+            watches[wd] = std::make_pair((int)i, std::string());
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    pid_t daemon = -1;
+    if (config.daemon)
+    {
+        char *daemonArgv[] = {(char *)LOAD_MAIL_OUTD, NULL};
+        struct stat st;
+        if (posix_spawn(&daemon, LOAD_MAIL_OUTD, NULL, NULL, daemonArgv, environ) != 0)
+        {
+            std::cerr << "Cannot start mail-outd.\n";
+            return 1;
+        }
+        for (int tries = 0; tries < 200 && stat(MAIL_OUTD_SOCKET, &st) != 0; tries++)
+        {
+            usleep(10000);
+        }
+    }
+
+    // Every mail-in is running before the first message goes out
+    std::vector<pid_t> pids(config.pipelines, -1);
+    std::vector<int> inputs(config.pipelines, -1);
+    for (int k = 0; k < config.pipelines; k++)
+    {
+        if (!spawnMailIn(k, config.mailInArgs, pids[k], inputs[k]))
+        {
+            std::cerr << "Cannot start mail-in.\n";
+            return 1;
+        }
+    }
+
+    std::atomic<bool> finished(false);
+    std::vector<Arrival> arrivals;
+    long overflows = 0;
+    std::thread watcher;
+    if (inotify_fd >= 0)
+    {
+        watcher = std::thread(watchArrivals, inotify_fd, std::cref(names), std::ref(watches), std::ref(finished), std::ref(arrivals), std::ref(overflows));
+    }
+
+    long long begin = nowNs();
+    std::vector<std::vector<SentMessage>> sent(config.pipelines);
+    std::vector<std::thread> feeders;
+    for (int k = 0; k < config.pipelines; k++)
+    {
+        feeders.emplace_back(feedPipeline, std::cref(config), k, std::cref(names), std::cref(recipientCdf),
+                             std::cref(sizeCdf), inputs[k], std::ref(sent[k]));
+    }
+    for (std::thread &feeder : feeders)
+    {
+        feeder.join();
+    }
+
+    // mail-in exits once its last delivery is done
+    int failedPipelines = 0;
+    for (pid_t pid : pids)
+    {
+        int status;
+        if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            failedPipelines++;
+        }
+    }
+    double seconds = (nowNs() - begin) / 1e9;
+    finished = true;
+    if (watcher.joinable())
+    {
+        watcher.join();
+    }
+    if (daemon > 0)
+    {
+        kill(daemon, SIGTERM);
+        waitpid(daemon, NULL, 0);
+    }
+
+    std::unordered_map<std::string, long long> appeared;
+    for (const Arrival &arrival : arrivals)
+    {
+        appeared.emplace(std::to_string(arrival.mailbox) + "/" + arrival.name, arrival.ns);
+    }
+
+    // Every stored copy: which message it is, and how long it took to get there
+    std::vector<long long> latencies;
+    long unexpected = 0;
+    long timedByFile = 0;
+    long numberingErrors = 0;
+    long gaps = 0;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        int dir_fd = open((std::string(MAIL_DIR) + "/" + names[i]).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        std::vector<std::pair<uint64_t, std::string>> messages = listMessages(dir_fd);
+        for (const std::pair<uint64_t, std::string> &message : messages)
+        {
+            std::string body = readBodyStart(dir_fd, message.second);
+            int pipeline = -1;
+            long index = -1;
+            long long due = 0;
+            if (body.compare(0, strlen(LOAD_ID_TAG), LOAD_ID_TAG) != 0 ||
+                std::sscanf(body.c_str() + strlen(LOAD_ID_TAG), "%d.%ld %lld", &pipeline, &index, &due) != 3 ||
+                pipeline < 0 || pipeline >= config.pipelines || index < 0 || index >= (long)sent[pipeline].size())
+            {
+                unexpected++;
+                continue;
+            }
+
+            SentMessage &sentMessage = sent[pipeline][index];
+            auto slot = std::find(sentMessage.recipients.begin(), sentMessage.recipients.end(), (int)i);
+            if (slot == sentMessage.recipients.end())
+            {
+                unexpected++; // Landed in a mailbox it was not sent to
+                continue;
+            }
+            sentMessage.found[slot - sentMessage.recipients.begin()]++;
+
+            long long stored;
+            auto event = appeared.find(std::to_string(i) + "/" + message.second);
+            struct stat st;
+            if (event != appeared.end())
+            {
+                stored = event->second;
+            }
+            else if (fstatat(dir_fd, message.second.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0)
+            {
+                stored = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+                timedByFile++;
+            }
+            else
+            {
+                continue;
+            }
+            latencies.push_back(std::max(stored - due, 0LL));
+        }
+
+        // Numbers come from .seq: none may be past it, and each one handed out should be used
+        char seq[32] = "";
+        int seq_fd = openat(dir_fd, MAILBOX_SEQ_FILE, O_RDONLY | O_CLOEXEC);
+        ssize_t n = seq_fd >= 0 ? pread(seq_fd, seq, sizeof(seq) - 1, 0) : 0;
+        seq[n > 0 ? n : 0] = '\0';
+        long long last = std::atoll(seq);
+        if (seq_fd >= 0)
+        {
+            close(seq_fd);
+        }
+        if (!messages.empty() && (long long)messages.back().first > last)
+        {
+            numberingErrors++;
+        }
+        gaps += std::max(last - (long long)messages.size(), 0LL);
+        close(dir_fd);
+    }
+
+    long sentMessages = 0;
+    long copies = 0;
+    long lost = 0;
+    long duplicated = 0;
+    for (const std::vector<SentMessage> &pipeline : sent)
+    {
+        sentMessages += pipeline.size();
+        for (const SentMessage &message : pipeline)
+        {
+            for (int found : message.found)
+            {
+                copies += found > 0;
+                lost += found == 0;
+                duplicated += found > 1 ? found - 1 : 0;
+            }
+        }
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    char line[256];
+    snprintf(line, sizeof(line), "%d pipelines, %zu mailboxes (zipf %.2f): %ld messages, %ld copies stored in %.2f s: %.0f messages/s, %.0f copies/s\n",
+             config.pipelines, names.size(), config.zipf, sentMessages, copies, seconds, sentMessages / seconds, copies / seconds);
+    std::cout << line;
+    snprintf(line, sizeof(line), "delivery latency: p50 %.0f us, p99 %.0f us, p999 %.0f us, max %.0f us (%ld timed by file mtime)\n",
+             percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+             latencies.empty() ? 0.0 : latencies.back() / 1e3, timedByFile);
+    std::cout << line;
+    printHistogram(latencies);
+    snprintf(line, sizeof(line), "lost %ld, duplicated %ld, unexpected %ld, numbers past .seq %ld, unused numbers %ld, failed mail-in %d, event overflows %ld\n",
+             lost, duplicated, unexpected, numberingErrors, gaps, failedPipelines, overflows);
+    std::cout << line;
+
+    bool clean = lost == 0 && duplicated == 0 && unexpected == 0 && numberingErrors == 0 && failedPipelines == 0;
+    if (!clean || config.keep)
+    {
+        std::cout << "Tree kept in " << config.tree << " (mail-in diagnostics in load.N.err).\n";
+    }
+    else if (fs::remove_all(root, error) == (std::uintmax_t)-1)
+    {
+        std::cerr << "Cannot remove the tree " << root.string() << ": " << error.message() << "\n";
+        return 1;
+    }
+    return clean ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
+#include <iostream>
+#include "mail_utils.h"
+#include "mail_store.h"
+
+/**** CONSTANTS ****/
+#define MAIL_IN_PATH "./bin/mail-in"
+#define MAIL_OUTD_MAX_CLIENTS 256
+
+// Listening socket, and whether a stop was asked for (see shutdownDaemon)
+static int listenFd = -1;
+static volatile sig_atomic_t stopping = 0;
+
+// Connections being served, capped at MAIL_OUTD_MAX_CLIENTS
+static std::mutex clientsLock;
+static std::condition_variable clientDone;
+static int clients = 0;
+
+/*
+Input: (int) Signal number.
+Removes the socket so mail-in falls back to mail-out and stops accepting; main
+exits once the deliveries in progress are done, so they finish and clean up
+after themselves. A second signal exits at once. Whatever a daemon killed
+outright leaves staged is swept at the next start (see sweepStaged).
+*/
+static void shutdownDaemon(int)
+{
+    if (stopping)
+    {
+        _exit(0);
+    }
+    stopping = 1;
+    unlink(MAIL_OUTD_SOCKET);
+    shutdown(listenFd, SHUT_RDWR); // Wakes accept
+}
+
+/*
+Input: (int) Connected socket.
+Output: (bool) Whether the peer connected with our effective uid, as the kernel recorded it (SO_PEERCRED).
+mail-in is set-uid, so only it (or root) can present the daemon's uid. The
+credentials are taken at connect time and cannot be swapped afterwards, unlike
+anything looked up later by the peer's pid.
+*/
+static bool trustedPeer(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && len == sizeof(cred) && cred.uid == geteuid();
+}
+
+/*
+Input: (int) Connected socket.
+Serves one delivery: a frame of '\n' separated recipients, then the message
+frame. The reply is one status byte per recipient, then the socket is closed.
+*/
+static void serveClient(int fd)
+{
+    std::string recipients;
+    if (trustedPeer(fd) && receiveFrame(fd, recipients))
+    {
+        std::vector<std::string> mailboxes;
+        size_t start = 0;
+        while (start < recipients.size())
+        {
+            size_t end = recipients.find('\n', start);
+            if (end == std::string::npos)
+            {
+                end = recipients.size();
+            }
+            mailboxes.push_back(recipients.substr(start, end - start));
+            start = end + 1;
+        }
+
+        if (!mailboxes.empty())
+        {
+            std::string statuses = deliverMessage(fd, mailboxes);
+            writeAll(fd, statuses.data(), statuses.size());
+        }
+    }
+    close(fd);
+
+    std::lock_guard<std::mutex> guard(clientsLock);
+    clients--;
+    clientDone.notify_one();
+}
+
+int main()
+{
+    // Must be run from the tree dir, like mail-in
+    if (access(MAIL_IN_PATH, F_OK) != 0)
+    {
+        std::cerr << "mail-outd must be started from the tree dir (" << MAIL_IN_PATH << " not found).\n";
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, shutdownDaemon);
+    signal(SIGINT, shutdownDaemon);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        std::cerr << "Socket failed.\n";
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, MAIL_OUTD_SOCKET, sizeof(addr.sun_path) - 1);
+
+    // A socket that still accepts belongs to a running daemon; a dead one is replaced
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        std::cerr << "mail-outd is already running.\n";
+        return 1;
+    }
+    close(sock);
+    unlink(MAIL_OUTD_SOCKET);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t old_mask = umask(077); // Socket only usable by our uid
+    int bound = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound != 0 || listen(sock, SOMAXCONN) != 0)
+    {
+        std::cerr << "Cannot listen on " << MAIL_OUTD_SOCKET << ": " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    listenFd = sock;
+
+    // Only one daemon gets this far: clear what an earlier one, killed mid-delivery, left staged
+    sweepStaged();
+
+    while (!stopping)
+    {
+        {
+            std::unique_lock<std::mutex> guard(clientsLock);
+            clientDone.wait(guard, [] { return clients < MAIL_OUTD_MAX_CLIENTS; });
+        }
+
+        int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            continue; // EINTR, the client gave up, or a stop
+        }
+
+        std::lock_guard<std::mutex> guard(clientsLock);
+        try
+        {
+            std::thread(serveClient, fd).detach();
+            clients++;
+        }
+        catch (const std::system_error &e)
+        {
+            close(fd); // Out of threads, mail-in reports the delivery as failed
+        }
+    }
+
+    std::unique_lock<std::mutex> guard(clientsLock);
+    clientDone.wait(guard, [] { return clients == 0; });
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mail_utils.h"
+#include "mail_store.h"
+#include "mail_registry.h"
+#include "mail_packed.h"
+#include "mail_summary.h"
+
+/*
+Input: (int) Directory fd, (std::string) File name, (bool) Whether a missing file is fine,
+       (bool) Whether it is a stored message (which may be compressed) rather than a blob.
+Output: (bool) Whether the file was copied to stdout (or is missing and that is fine).
+*/
+static bool catFile(int dir_fd, const std::string &name, bool optional, bool stored)
+{
+    int fd = openMessage(dir_fd, name, O_RDONLY);
+    if (fd < 0)
+    {
+        return optional && errno == ENOENT;
+    }
+
+    // A blob is the body exactly as received, even if it happens to start like a StoredHeader
+    if (stored)
+    {
+        bool ok = copyStored(fd, STDOUT_FILENO);
+        close(fd);
+        return ok;
+    }
+
+    std::vector<char> buffer(STAGE_BUFFER_SIZE);
+    bool ok = true;
+    while (ok)
+    {
+        ssize_t n = read(fd, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            ok = n == 0;
+            break;
+        }
+        ok = writeAll(STDOUT_FILENO, buffer.data(), n);
+    }
+    close(fd);
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    // Must be run from the tree dir, like mail-in
+    std::string command = argc > 1 ? argv[1] : "";
+
+    // cat MAILBOX MESSAGE: a stored message as mail-out received it, in any layout, compressed or not
+    if (command == "cat" && argc == 4)
+    {
+        MailboxRegistry registry;
+        std::string message = argv[3];
+        int dir_fd = registry.dirFd(argv[2]);
+        bool packed = dir_fd >= 0 && isPacked(dir_fd);
+        if (dir_fd < 0 || message.empty() || message.length() > 19 || !isNumeric(message))
+        {
+            std::cerr << "No such mailbox or message.\n";
+            return 1;
+        }
+
+        bool ok;
+        if (packed)
+        {
+            PackedEntry entry;
+            int segment_fd = openPacked(dir_fd, std::strtoull(message.c_str(), NULL, 10), entry);
+            ok = segment_fd >= 0 && copyStored(segment_fd, STDOUT_FILENO, entry.offset, entry.length);
+            if (segment_fd >= 0)
+            {
+                close(segment_fd);
+            }
+        }
+        else
+        {
+            // Flat or fanout, whichever holds it (both while a mailbox migrates)
+            std::string name = findMessage(dir_fd, std::strtoull(message.c_str(), NULL, 10));
+            ok = !name.empty() && catFile(dir_fd, name, false, true) && catFile(dir_fd, bodyLinkName(name), true, false);
+        }
+        if (!ok)
+        {
+            std::cerr << "Cannot read " << argv[2] << "/" << message << ".\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    // rm MAILBOX MESSAGE: deletes a message and its summary entry (a packed one keeps its bytes until compact)
+    if (command == "rm" && argc == 4)
+    {
+        MailboxRegistry registry;
+        std::string message = argv[3];
+        int dir_fd = registry.dirFd(argv[2]);
+        bool removed = false;
+        if (dir_fd >= 0 && !message.empty() && message.length() <= 19 && isNumeric(message))
+        {
+            if (isPacked(dir_fd))
+            {
+                removed = deletePacked(dir_fd, std::strtoull(message.c_str(), NULL, 10));
+            }
+            else
+            {
+                std::string name = findMessage(dir_fd, std::strtoull(message.c_str(), NULL, 10));
+                removed = !name.empty() && unlinkMessage(dir_fd, name, 0) == 0;
+                if (removed)
+                {
+                    unlinkMessage(dir_fd, bodyLinkName(name), 0);
+                }
+            }
+        }
+        if (!removed)
+        {
+            std::cerr << "No such mailbox or message.\n";
+            return 1;
+        }
+        clearSummary(dir_fd, std::strtoull(message.c_str(), NULL, 10));
+        return 0;
+    }
+
+    // compact MAILBOX: rewrites a packed mailbox's segments without its deleted messages
+    if (command == "compact" && argc == 3)
+    {
+        MailboxRegistry registry;
+        int dir_fd = registry.dirFd(argv[2]);
+        long long reclaimed = dir_fd >= 0 && isPacked(dir_fd) ? compactPacked(dir_fd) : -1;
+        if (reclaimed < 0)
+        {
+            std::cerr << "Cannot compact " << argv[2] << ".\n";
+            return 1;
+        }
+        std::cout << "Reclaimed " << reclaimed << " bytes.\n";
+        return 0;
+    }
+
+    // pack / unpack MAILBOX: converts between one file per message and packed segments
+    if ((command == "pack" || command == "unpack") && argc == 3)
+    {
+        MailboxRegistry registry;
+        int dir_fd = registry.dirFd(argv[2]);
+        long converted = -1;
+        if (dir_fd >= 0)
+        {
+            converted = command == "pack" ? packMailbox(dir_fd) : unpackMailbox(dir_fd);
+        }
+        if (converted < 0)
+        {
+            std::cerr << "Cannot " << command << " " << argv[2] << ".\n";
+            return 1;
+        }
+        std::cout << "Converted " << converted << " messages.\n";
+        return 0;
+    }
+
+    // fanout MAILBOX: moves a flat mailbox to the fanout layout while mail keeps arriving
+    if (command == "fanout" && argc == 3)
+    {
+        MailboxRegistry registry;
+        int dir_fd = registry.dirFd(argv[2]);
+        long moved = dir_fd >= 0 && !isPacked(dir_fd) ? migrateFanout(dir_fd) : -1;
+        if (moved < 0)
+        {
+            std::cerr << "Cannot move " << argv[2] << " to the fanout layout.\n";
+            return 1;
+        }
+        std::cout << "Moved " << moved << " messages.\n";
+        return 0;
+    }
+
+    // sweep: removes the blobs no message refers to any more
+    if (command == "sweep" && argc == 2)
+    {
+        long removed = sweepBlobs();
+        if (removed < 0)
+        {
+            std::cerr << "Cannot list " << MAIL_BLOB_DIR << ".\n";
+            return 1;
+        }
+        std::cout << "Removed " << removed << " unreferenced blobs.\n";
+        return 0;
+    }
+
+    std::cerr << "Usage: mail-tool cat <mailbox> <message>\n"
+              << "       mail-tool rm <mailbox> <message>\n"
+              << "       mail-tool pack|unpack|compact|fanout <mailbox>\n"
+              << "       mail-tool sweep\n";
+    return 1;
+}
@@ -0,0 +1,492 @@
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "mail_delivery.h"
+#include "mail_stats.h"
+
+extern char **environ;
+
+/*
+Input: (int) Maximum number of mail-out processes running at once (at least 1),
+       (SyncPolicy) How deliveries are made durable, (bool) Whether bodies go to the single-instance store,
+           (int) zlib level mail-out stores messages at, 0 to store them raw.
+*/
+DeliveryScheduler::DeliveryScheduler(int maxInFlight, const SyncPolicy &sync, bool dedup, int compressLevel) : maxInFlight(maxInFlight < 1 ? 1 : maxInFlight), sync(sync), dedup(dedup), compressLevel(compressLevel)
+{
+}
+
+/*
+Waits for every delivery still in flight.
+*/
+DeliveryScheduler::~DeliveryScheduler()
+{
+    drain();
+}
+
+/*
+Input: (FullMessage) A fully parsed message.
+Output: (bool) False if the delivery could not be started (pipe/spawn failure).
+Starts mail-out (or hands the message to mail-outd) for all recipients, waiting
+for a free slot and for earlier deliveries to the same mailboxes as needed.
+*/
+bool DeliveryScheduler::submit(const FullMessage &fullMessage)
+{
+    // Keep per-mailbox order: the previous message to these mailboxes must land first
+    while ((int)inFlight.size() >= maxInFlight || anyBusy(fullMessage.rcptTo))
+    {
+        StageTimer timer(TIME_DELIVERY_WAIT);
+        reapOne(-1);
+    }
+    maybeCommit();
+
+    return spawn(fullMessage);
+}
+
+/*
+Waits for every delivery still in flight, reporting failed ones, and commits
+the last group.
+*/
+void DeliveryScheduler::drain()
+{
+    while (!inFlight.empty())
+    {
+        StageTimer timer(TIME_DELIVERY_WAIT);
+        reapOne(-1);
+    }
+    commitGroup();
+}
+
+/*
+Input: (int) Input fd about to be read.
+Returns once the input is readable (or at its end), reaping finished deliveries
+meanwhile and committing the waiting group when its window runs out, so a
+quiet pipe does not hold delivered mail back from the disk.
+*/
+void DeliveryScheduler::waitForInput(int fd)
+{
+    while (!reapOne(fd))
+    {
+    }
+}
+
+/*
+Input: (std::vector<std::string>) Mailbox names.
+Output: (bool) Whether any of them has a delivery in flight.
+*/
+bool DeliveryScheduler::anyBusy(const std::vector<std::string> &mailboxes) const
+{
+    for (const std::string &mailbox : mailboxes)
+    {
+        if (busyMailboxes.count(mailbox))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+Output: (int) Socket connected to mail-outd, -1 if it is not running.
+Only a daemon with our effective uid is used (the socket lives in the tree's tmp/,
+which only that uid can write after install-priv.sh).
+*/
+static int connectDaemon()
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, MAIL_OUTD_SOCKET, sizeof(addr.sun_path) - 1);
+
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.uid != geteuid())
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+Input: (FullMessage) The message.
+Output: (uint64_t) BodyHash digest of its body, spooled part included.
+*/
+static uint64_t hashBody(const FullMessage &fullMessage)
+{
+    BodyHash hash;
+    std::vector<char> buffer(fullMessage.spooled > 0 ? SPOOL_READ_BLOCK : 0);
+    for (long long offset = 0; offset < fullMessage.spooled;)
+    {
+        ssize_t n = pread(fullMessage.spoolFd, buffer.data(), std::min((long long)buffer.size(), fullMessage.spooled - offset), offset);
+        if (n <= 0)
+        {
+            break; // Only costs the deduplication: mail-out compares before reusing a blob
+        }
+        hash.update(buffer.data(), n);
+        offset += n;
+    }
+    hash.update(fullMessage.body.data(), fullMessage.body.size());
+    return hash.digest();
+}
+
+/*
+Input: (int) Pipe or socket, (FullMessage) The message, (uint32_t) FRAME_* flags.
+Output: (bool) Whether the whole frame (both frames with FRAME_DEDUP) was written.
+A spooled body is sent from its file, the rest from memory.
+*/
+static bool sendMessage(int fd, const FullMessage &fullMessage, uint32_t flags)
+{
+    if (flags & FRAME_DEDUP)
+    {
+        // Headers alone, then the body's hash and the body as a frame of their own
+        uint64_t hash = hashBody(fullMessage);
+        std::string prefix((const char *)&hash, sizeof(hash));
+        if (!sendFrame(fd, ipcHelper(fullMessage), "", flags))
+        {
+            return false;
+        }
+        if (fullMessage.spooled > 0)
+        {
+            return sendSpooledFrame(fd, prefix, fullMessage.spoolFd, fullMessage.spooled, fullMessage.body, 0);
+        }
+        return sendFrame(fd, prefix, fullMessage.body, 0);
+    }
+    if (fullMessage.spooled > 0)
+    {
+        return sendSpooledFrame(fd, ipcHelper(fullMessage), fullMessage.spoolFd, fullMessage.spooled, fullMessage.body, flags);
+    }
+    return sendFrame(fd, ipcHelper(fullMessage), fullMessage.body, flags);
+}
+
+/*
+Input: (FullMessage) The message.
+Output: (bool) False if the delivery could not be handed to mail-outd or mail-out.
+Hands the message to mail-outd when it is running. The reply comes back on the same
+socket, so it is reaped like a mail-out status pipe.
+*/
+bool DeliveryScheduler::spawn(const FullMessage &fullMessage)
+{
+    // mail-out / mail-outd report their own numbers back when we are recording
+    uint32_t flags = activeStats != NULL ? FRAME_WANT_STATS : 0;
+    if (sync.mode == SYNC_MESSAGE)
+    {
+        flags |= FRAME_SYNC;
+    }
+    if (dedup)
+    {
+        flags |= FRAME_DEDUP;
+    }
+    flags |= ((uint32_t)compressLevel << FRAME_COMPRESS_SHIFT) & FRAME_COMPRESS_MASK;
+
+    int sock;
+    {
+        StageTimer timer(TIME_SPAWN);
+        sock = connectDaemon();
+    }
+    if (sock >= 0)
+    {
+        countStat(STAT_DELIVERIES_DAEMON);
+        std::string recipients;
+        for (const std::string &sendTo : fullMessage.rcptTo)
+        {
+            recipients += sendTo;
+            recipients += '\n';
+        }
+
+        inFlight.push_back(Delivery{-1, sock, fullMessage.rcptTo, fullMessage.mailFrom, ""});
+        busyMailboxes.insert(fullMessage.rcptTo.begin(), fullMessage.rcptTo.end());
+
+        // A failed send shows up as missing statuses
+        StageTimer timer(TIME_PIPE_WRITE);
+        if (sendFrame(sock, recipients, ""))
+        {
+            sendMessage(sock, fullMessage, flags);
+        }
+        shutdown(sock, SHUT_WR);
+        return true;
+    }
+
+    return spawnMailOut(fullMessage, flags);
+}
+
+/*
+Input: (FullMessage) The message, (uint32_t) FRAME_* flags to send it with.
+Output: (bool) False if the pipes or the mail-out process could not be created.
+Starts mail-out for every recipient and feeds it the message over a pipe.
+*/
+bool DeliveryScheduler::spawnMailOut(const FullMessage &fullMessage, uint32_t flags)
+{
+    // Close-on-exec so other children never hold a writing end open
+    int pipe_fd[2];
+    int status_fd[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) == -1)
+    {
+        std::cerr << "Pipe failed." << std::endl;
+        return false;
+    }
+    if (pipe2(status_fd, O_CLOEXEC) == -1)
+    {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        std::cerr << "Pipe failed." << std::endl;
+        return false;
+    }
+
+    // posix_spawn uses vfork semantics, so there is no page table copy per message
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fd[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, status_fd[1], MAIL_OUT_STATUS_FD);
+
+    std::vector<char *> argv;
+    argv.push_back((char *)MAIL_OUT_PATH);
+    for (const std::string &sendTo : fullMessage.rcptTo)
+    {
+        argv.push_back((char *)sendTo.c_str());
+    }
+    argv.push_back(NULL);
+
+    pid_t p;
+    int err;
+    {
+        StageTimer timer(TIME_SPAWN);
+        err = posix_spawn(&p, MAIL_OUT_PATH, &actions, NULL, argv.data(), environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipe_fd[0]);   // Close the reading end of the pipe
+    close(status_fd[1]); // Only the child writes statuses
+    if (err != 0)
+    {
+        close(pipe_fd[1]);
+        close(status_fd[0]);
+        std::cerr << "Fork failed." << std::endl;
+        return false;
+    }
+
+    inFlight.push_back(Delivery{p, status_fd[0], fullMessage.rcptTo, fullMessage.mailFrom, ""});
+    busyMailboxes.insert(fullMessage.rcptTo.begin(), fullMessage.rcptTo.end());
+    countStat(STAT_DELIVERIES_EXEC);
+
+    // A short write means mail-out stopped reading; its status says why
+    StageTimer timer(TIME_PIPE_WRITE);
+    sendMessage(pipe_fd[1], fullMessage, flags);
+    close(pipe_fd[1]);
+
+    return true;
+}
+
+/*
+Input: (int) Input fd to wait on as well, -1 for none.
+Output: (bool) Whether that input is readable (or at its end).
+Waits until at least one mail-out has finished (or the input is readable) and
+reports its failures. Status pipes are drained while waiting so a child never
+blocks on them. Returns early when the group commit window runs out, to commit.
+*/
+bool DeliveryScheduler::reapOne(int inputFd)
+{
+    std::vector<struct pollfd> fds(inFlight.size() + 1);
+    for (size_t i = 0; i < inFlight.size(); i++)
+    {
+        fds[i].fd = inFlight[i].statusFd;
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
+    fds.back() = pollfd{inputFd, POLLIN, 0}; // Ignored by poll when -1
+
+    int ready = poll(fds.data(), fds.size(), commitTimeout());
+    if (ready <= 0)
+    {
+        maybeCommit();
+        return false; // Window over, or EINTR: the caller loops
+    }
+
+    // Walk backwards so finished deliveries can be removed in place
+    for (size_t i = inFlight.size(); i-- > 0;)
+    {
+        if (fds[i].revents == 0)
+        {
+            continue;
+        }
+
+        char buf[4096];
+        ssize_t n = read(inFlight[i].statusFd, buf, sizeof(buf));
+        if (n > 0)
+        {
+            inFlight[i].statuses.append(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        // End of the status stream: the child has exited or is about to
+        finish(inFlight[i]);
+        inFlight.erase(inFlight.begin() + i);
+    }
+    maybeCommit();
+    return fds.back().revents != 0;
+}
+
+/*
+Input: (Delivery) A delivery whose status pipe (or mail-outd socket) reached end of file.
+Collects the mail-out exit status and reports every recipient that failed.
+*/
+void DeliveryScheduler::finish(Delivery &delivery)
+{
+    close(delivery.statusFd);
+
+    // mail-out's own numbers follow the statuses when it was asked for them
+    if (activeStats != NULL && delivery.statuses.size() == delivery.mailboxes.size() + sizeof(MailStats))
+    {
+        MailStats outStats;
+        memcpy(&outStats, delivery.statuses.data() + delivery.mailboxes.size(), sizeof(outStats));
+        activeStats->add(outStats);
+    }
+
+    // mail-outd has no exit status, a recipient without a status byte failed
+    bool exitedFailed = true;
+    if (delivery.pid > 0)
+    {
+        int status = 0;
+        while (waitpid(delivery.pid, &status, 0) < 0 && errno == EINTR)
+        {
+        }
+        exitedFailed = WIFEXITED(status) && WEXITSTATUS(status) == 1;
+    }
+
+    Uncommitted delivered{delivery.mailFrom, {}};
+    for (size_t i = 0; i < delivery.mailboxes.size(); i++)
+    {
+        // Fall back to the exit code if mail-out died before reporting
+        bool failed = i < delivery.statuses.size() ? delivery.statuses[i] != MAIL_OUT_DELIVERED : exitedFailed;
+        if (failed)
+        {
+            std::cerr << "mail-out invocation failed on message from " << delivery.mailFrom << std::endl;
+            countStat(STAT_RECIPIENTS_FAILED);
+        }
+        else if (sync.mode == SYNC_GROUP)
+        {
+            delivered.mailboxes.push_back(delivery.mailboxes[i]);
+        }
+        busyMailboxes.erase(delivery.mailboxes[i]);
+    }
+
+    if (!delivered.mailboxes.empty())
+    {
+        if (uncommitted.empty())
+        {
+            groupBegin = std::chrono::steady_clock::now();
+        }
+        uncommitted.push_back(delivered);
+    }
+}
+
+/*
+Output: (int) poll timeout in milliseconds: what is left of the group commit
+window, -1 (none) when nothing is waiting to be committed.
+*/
+int DeliveryScheduler::commitTimeout() const
+{
+    if (uncommitted.empty())
+    {
+        return -1;
+    }
+
+    long long waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - groupBegin).count();
+    return waited >= sync.windowMs ? 0 : (int)(sync.windowMs - waited);
+}
+
+/*
+Commits the waiting group once it is full or its window is over.
+*/
+void DeliveryScheduler::maybeCommit()
+{
+    if (!uncommitted.empty() && ((int)uncommitted.size() >= sync.batch || commitTimeout() == 0))
+    {
+        commitGroup();
+    }
+}
+
+/*
+Makes every waiting delivery durable at once: one syncfs writes back all of their
+messages (and whatever else is dirty on the filesystem) in a single journal
+commit, then each touched mailbox directory is fsynced so the new names are too.
+Mailboxes are opened one at a time for it and closed again, so no number of
+them can use up the fd limit. If any step fails, every message of the group is
+reported as possibly lost.
+*/
+void DeliveryScheduler::commitGroup()
+{
+    if (uncommitted.empty())
+    {
+        return;
+    }
+
+    StageTimer timer(TIME_COMMIT);
+    countStat(STAT_GROUP_COMMITS);
+
+    std::unordered_set<std::string> mailboxes;
+    for (const Uncommitted &message : uncommitted)
+    {
+        mailboxes.insert(message.mailboxes.begin(), message.mailboxes.end());
+    }
+
+    // The first mailbox opened also stands for the filesystem
+    bool committed = true;
+    bool synced = false;
+    for (const std::string &mailbox : mailboxes)
+    {
+        int fd = registry.openDir(mailbox);
+        if (fd >= 0 && !synced)
+        {
+            synced = syncfs(fd) == 0;
+            committed = synced && committed;
+        }
+        committed = fd >= 0 && fsync(fd) == 0 && committed;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    committed = committed && synced;
+
+    if (!committed)
+    {
+        for (const Uncommitted &message : uncommitted)
+        {
+            std::cerr << "Could not commit message from " << message.mailFrom << " to disk" << std::endl;
+            countStat(STAT_RECIPIENTS_FAILED, message.mailboxes.size());
+        }
+    }
+    uncommitted.clear();
+}
+
+/*
+Output: (int) Default number of concurrent deliveries (online core count).
+*/
+int defaultDeliveryJobs()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores < 1 ? 1 : (int)cores;
+}
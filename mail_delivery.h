@@ -0,0 +1,129 @@
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <chrono>
+#include "mail_utils.h"
+#include "mail_registry.h"
+#ifndef MAIL_DELIVERY
+#define MAIL_DELIVERY
+
+/**** CONSTANTS ****/
+#define MAIL_OUT_PATH "./bin/mail-out"
+
+// A spooled body is read back this much at a time to hash it (--dedup)
+#define SPOOL_READ_BLOCK (1 << 20)
+
+// --sync group defaults: commit once this many messages are waiting, or the oldest has waited this long
+#define SYNC_GROUP_BATCH 64
+#define SYNC_GROUP_WINDOW_MS 20
+
+/**** ENUMS ****/
+
+// When a delivered message is known to be on disk
+enum SyncMode
+{
+    SYNC_NONE,    // Whenever the kernel writes it back: a crash can lose delivered mail
+    SYNC_MESSAGE, // mail-out flushes each message and its mailboxes before reporting (FRAME_SYNC)
+    SYNC_GROUP    // mail-in flushes the filesystem once for a whole group of deliveries
+};
+
+/**** STRUCTS ****/
+struct SyncPolicy
+{
+    SyncMode mode;
+    int batch;    // SYNC_GROUP: messages per commit
+    int windowMs; // SYNC_GROUP: longest a delivered message waits for its commit
+};
+
+/**** CLASSES ****/
+
+/*
+Runs mail-out deliveries for mail-in with up to maxInFlight children at once.
+Each message goes to a single mail-out with the whole recipient list, or to
+mail-outd over its socket when the daemon is running. A mailbox
+only ever has one delivery in flight, so messages land in each mailbox in the
+order they were submitted. With SYNC_GROUP, finished deliveries are committed
+to disk together (see commitGroup) and reported if that fails.
+*/
+class DeliveryScheduler
+{
+public:
+    /*
+    Input: (int) Maximum number of mail-out processes running at once (at least 1),
+           (SyncPolicy) How deliveries are made durable, (bool) Whether bodies go to the single-instance store,
+           (int) zlib level mail-out stores messages at, 0 to store them raw.
+    */
+    DeliveryScheduler(int maxInFlight, const SyncPolicy &sync, bool dedup, int compressLevel);
+
+    /*
+    Waits for every delivery still in flight.
+    */
+    ~DeliveryScheduler();
+
+    /*
+    Input: (FullMessage) A fully parsed message.
+    Output: (bool) False if the delivery could not be started (pipe/spawn failure).
+    Starts mail-out (or hands the message to mail-outd) for all recipients, waiting
+    for a free slot and for earlier deliveries to the same mailboxes as needed.
+    */
+    bool submit(const FullMessage &fullMessage);
+
+    /*
+    Waits for every delivery still in flight, reporting failed ones, and commits
+    the last group.
+    */
+    void drain();
+
+    /*
+    Input: (int) Input fd about to be read.
+    Returns once the input is readable (or at its end), reaping finished deliveries
+    meanwhile and committing the waiting group when its window runs out, so a
+    quiet pipe does not hold delivered mail back from the disk.
+    */
+    void waitForInput(int fd);
+
+private:
+    struct Delivery
+    {
+        pid_t pid;    // -1 for a mail-outd delivery
+        int statusFd; // Status pipe, or the mail-outd socket
+        std::vector<std::string> mailboxes;
+        std::string mailFrom;
+        std::string statuses;
+    };
+
+    // Delivered, but not yet known to be on disk (SYNC_GROUP)
+    struct Uncommitted
+    {
+        std::string mailFrom;
+        std::vector<std::string> mailboxes;
+    };
+
+    bool anyBusy(const std::vector<std::string> &mailboxes) const;
+    bool spawn(const FullMessage &fullMessage);
+    bool spawnMailOut(const FullMessage &fullMessage, uint32_t flags);
+    bool reapOne(int inputFd);
+    void finish(Delivery &delivery);
+    int commitTimeout() const;
+    void maybeCommit();
+    void commitGroup();
+
+    int maxInFlight;
+    std::vector<Delivery> inFlight;
+    std::unordered_set<std::string> busyMailboxes;
+
+    SyncPolicy sync;
+    bool dedup;
+    int compressLevel;
+    MailboxRegistry registry; // Opens the mailboxes committed to
+    std::vector<Uncommitted> uncommitted;
+    std::chrono::steady_clock::time_point groupBegin;
+};
+
+/*
+Output: (int) Default number of concurrent deliveries (online core count).
+*/
+int defaultDeliveryJobs();
+
+#endif
@@ -0,0 +1,385 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <linux/io_uring.h>
+#include "mail_io.h"
+
+/*
+One io_uring with its rings mapped, used through the raw system calls
+(liburing is not a dependency). Each thread gets its own.
+*/
+class Ring
+{
+public:
+    Ring();
+    ~Ring();
+
+    bool ok() const { return fd >= 0; }
+
+    int fd;
+    unsigned entries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+
+private:
+    void unmap();
+
+    void *sqRing;
+    size_t sqRingLen;
+    void *cqRing;
+    size_t cqRingLen;
+    size_t sqesLen;
+};
+
+Ring::Ring() : fd(-1), sqes((struct io_uring_sqe *)MAP_FAILED), sqRing(MAP_FAILED), sqRingLen(0), cqRing(MAP_FAILED), cqRingLen(0), sqesLen(0)
+{
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int ring_fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+    if (ring_fd < 0)
+    {
+        return; // ENOSYS, or disabled by kernel.io_uring_disabled / seccomp
+    }
+
+    sqRingLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sqRingLen = cqRingLen = std::max(sqRingLen, cqRingLen);
+    }
+    sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqRing = mmap(NULL, sqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? sqRing :
+             mmap(NULL, cqRingLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+    // Every operation IoBatch uses must be known to this kernel (LINKAT needs 5.15)
+    std::vector<char> probe_buf(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe *probe = (struct io_uring_probe *)probe_buf.data();
+    bool usable = sqRing != MAP_FAILED && cqRing != MAP_FAILED && sqes != MAP_FAILED &&
+                  syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    const int needed[] = {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_LINKAT, IORING_OP_CLOSE};
+    for (int op : needed)
+    {
+        usable = usable && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    if (!usable)
+    {
+        unmap();
+        ::close(ring_fd);
+        return;
+    }
+
+    char *sq = (char *)sqRing;
+    char *cq = (char *)cqRing;
+    entries = params.sq_entries;
+    sqHead = (unsigned *)(sq + params.sq_off.head);
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    fd = ring_fd;
+}
+
+Ring::~Ring()
+{
+    unmap();
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+/*
+Unmaps whatever part of the rings is mapped.
+*/
+void Ring::unmap()
+{
+    if (sqes != MAP_FAILED)
+    {
+        munmap(sqes, sqesLen);
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+    {
+        munmap(cqRing, cqRingLen);
+    }
+    if (sqRing != MAP_FAILED)
+    {
+        munmap(sqRing, sqRingLen);
+    }
+    sqes = (struct io_uring_sqe *)MAP_FAILED;
+    sqRing = cqRing = MAP_FAILED;
+}
+
+/*
+Output: (IoBackend) Backend named by MAIL_IO_BACKEND, io_uring if unset or unknown.
+A set-uid process ignores the variable: its caller's environment chooses nothing.
+*/
+static IoBackend configuredIoBackend()
+{
+    const char *name = getuid() == geteuid() ? getenv(MAIL_IO_BACKEND_ENV) : NULL;
+    if (name != NULL && std::strcmp(name, "posix") == 0)
+    {
+        return IO_POSIX;
+    }
+    return IO_URING;
+}
+
+static std::atomic<IoBackend> ioBackend(configuredIoBackend());
+
+/*
+Output: (Ring*) This thread's ring, NULL if the kernel refuses io_uring.
+*/
+static Ring *threadRing()
+{
+    static thread_local Ring ring;
+    return ring.ok() ? &ring : NULL;
+}
+
+void IoBatch::openat(int dir_fd, const char *path, int flags, mode_t mode)
+{
+    ops.push_back(Op{OP_OPENAT, dir_fd, -1, path, NULL, flags, mode, NULL, 0, 0, 0});
+}
+
+void IoBatch::write(int fd, const void *buf, size_t len, off_t offset)
+{
+    ops.push_back(Op{OP_WRITE, fd, -1, NULL, NULL, 0, 0, buf, len, offset, 0});
+}
+
+void IoBatch::linkat(int old_dir_fd, const char *old_path, int new_dir_fd, const char *new_path, int flags)
+{
+    ops.push_back(Op{OP_LINKAT, old_dir_fd, new_dir_fd, old_path, new_path, flags, 0, NULL, 0, 0, 0});
+}
+
+void IoBatch::close(int fd)
+{
+    ops.push_back(Op{OP_CLOSE, fd, -1, NULL, NULL, 0, 0, NULL, 0, 0, 0});
+}
+
+/*
+Runs every queued operation and waits for all of them.
+*/
+void IoBatch::submit()
+{
+    if (ops.empty())
+    {
+        return;
+    }
+    size_t done = ioBackend == IO_URING && ops.size() >= IO_URING_MIN_BATCH ? runUring() : 0;
+    for (size_t i = done; i < ops.size(); i++)
+    {
+        runPosix(ops[i]);
+    }
+}
+
+/*
+Input: (size_t) Operation index, in queueing order.
+Output: (long) Its system call result, or -errno on failure.
+*/
+long IoBatch::result(size_t i) const
+{
+    return ops[i].result;
+}
+
+/*
+Output: (size_t) Number of queued operations.
+*/
+size_t IoBatch::size() const
+{
+    return ops.size();
+}
+
+/*
+Drops all operations and results.
+*/
+void IoBatch::clear()
+{
+    ops.clear();
+}
+
+/*
+Input: (Op) An operation.
+Runs it with the plain system call.
+*/
+void IoBatch::runPosix(Op &op)
+{
+    long r = -1;
+    switch (op.code)
+    {
+        case OP_OPENAT:
+            r = ::openat(op.fd, op.path, op.flags, op.mode);
+            break;
+        case OP_WRITE:
+            r = ::pwrite(op.fd, op.buf, op.len, op.offset);
+            break;
+        case OP_LINKAT:
+            r = ::linkat(op.fd, op.path, op.fd2, op.path2, op.flags);
+            break;
+        case OP_CLOSE:
+            r = ::close(op.fd);
+            break;
+    }
+    op.result = r < 0 ? -errno : r;
+}
+
+/*
+Output: (size_t) Number of operations run, from the start (the rest are left to runPosix).
+Fills the submission queue with up to a ring's worth of operations at a time and
+waits for all of their completions with the same io_uring_enter.
+*/
+size_t IoBatch::runUring()
+{
+    Ring *ring = threadRing();
+    if (ring == NULL)
+    {
+        return 0;
+    }
+
+    for (size_t first = 0; first < ops.size(); first += ring->entries)
+    {
+        size_t count = std::min((size_t)ring->entries, ops.size() - first);
+
+        unsigned tail = *ring->sqTail;
+        for (size_t i = 0; i < count; i++)
+        {
+            const Op &op = ops[first + i];
+            unsigned index = tail & *ring->sqMask;
+            struct io_uring_sqe *sqe = &ring->sqes[index];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->fd = op.fd;
+            sqe->user_data = first + i;
+            switch (op.code)
+            {
+                case OP_OPENAT:
+                    sqe->opcode = IORING_OP_OPENAT;
+                    sqe->addr = (unsigned long)op.path;
+                    sqe->len = op.mode;
+                    sqe->open_flags = op.flags;
+                    break;
+                case OP_WRITE:
+                    sqe->opcode = IORING_OP_WRITE;
+                    sqe->addr = (unsigned long)op.buf;
+                    sqe->len = op.len;
+                    sqe->off = op.offset;
+                    break;
+                case OP_LINKAT:
+                    sqe->opcode = IORING_OP_LINKAT;
+                    sqe->addr = (unsigned long)op.path;
+                    sqe->len = op.fd2;
+                    sqe->addr2 = (unsigned long)op.path2;
+                    sqe->hardlink_flags = op.flags;
+                    break;
+                case OP_CLOSE:
+                    sqe->opcode = IORING_OP_CLOSE;
+                    break;
+            }
+            ring->sqArray[index] = index;
+            tail++;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+        // Submit everything and wait for every completion; a signal can cut the wait short
+        size_t done = 0;
+        size_t to_submit = count;
+        while (done < count)
+        {
+            int r = syscall(__NR_io_uring_enter, ring->fd, to_submit, count - done, IORING_ENTER_GETEVENTS, NULL, 0);
+            bool interrupted = r < 0 && errno == EINTR;
+            if (r > 0)
+            {
+                to_submit -= std::min((size_t)r, to_submit);
+            }
+
+            size_t reaped = 0;
+            unsigned head = *ring->cqHead;
+            unsigned cq_tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+            while (head != cq_tail)
+            {
+                struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+                ops[cqe->user_data].result = cqe->res;
+                head++;
+                reaped++;
+            }
+            __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+            done += reaped;
+
+            if (r > 0 || reaped > 0 || interrupted || done == count)
+            {
+                continue;
+            }
+
+            // No progress: retrying at once would spin. The kernel takes submissions
+            // in order, so the last to_submit are still ours to take back
+            if (to_submit == count)
+            {
+                // It took none of them: the caller runs them
+                __atomic_store_n(ring->sqTail, tail - count, __ATOMIC_RELEASE);
+                return first;
+            }
+            if (to_submit > 0)
+            {
+                __atomic_store_n(ring->sqTail, tail - to_submit, __ATOMIC_RELEASE);
+                for (size_t i = count - to_submit; i < count; i++)
+                {
+                    runPosix(ops[first + i]);
+                }
+                done += to_submit;
+                to_submit = 0;
+                continue;
+            }
+
+            // Only completions are left and the kernel owns those operations: sleep
+            // until the completion ring has something instead of calling again
+            struct pollfd ready = {ring->fd, POLLIN, 0};
+            poll(&ready, 1, -1);
+        }
+    }
+
+    return ops.size();
+}
+
+/*
+Output: (IoBackend) Backend IoBatch uses: MAIL_IO_BACKEND if set (and not set-uid),
+io_uring otherwise, and POSIX whenever the kernel refuses io_uring.
+*/
+IoBackend activeIoBackend()
+{
+    return ioBackend == IO_URING && threadRing() != NULL ? IO_URING : IO_POSIX;
+}
+
+/*
+Input: (IoBackend) Backend to use from now on.
+Output: (bool) False if this kernel cannot run it (nothing changes).
+*/
+bool useIoBackend(IoBackend backend)
+{
+    if (backend == IO_URING && threadRing() == NULL)
+    {
+        return false;
+    }
+
+    ioBackend = backend;
+    return true;
+}
@@ -0,0 +1,106 @@
+#include <sys/types.h>
+#include <cstddef>
+#include <vector>
+#ifndef MAIL_IO
+#define MAIL_IO
+
+/**** CONSTANTS ****/
+
+// Environment variable choosing the backend: "posix" or "uring"; ignored when set-uid
+#define MAIL_IO_BACKEND_ENV "MAIL_IO_BACKEND"
+#define IO_URING_ENTRIES 64
+
+// Smaller batches run as plain system calls: LINKAT/OPENAT are handed to kernel
+// worker threads, which costs more than it saves for a handful of operations
+#define IO_URING_MIN_BATCH 8
+
+/**** ENUMS ****/
+enum IoBackend
+{
+    IO_POSIX, // One system call per operation
+    IO_URING  // Whole batch submitted to an io_uring at once
+};
+
+/**** CLASSES ****/
+
+/*
+A list of file operations run together by submit(). With the io_uring backend a
+batch of at least IO_URING_MIN_BATCH costs a single io_uring_enter (per
+IO_URING_ENTRIES operations); otherwise each operation is its own system call, in order.
+Operations in one batch must not depend on each other: they may run in any order.
+Paths and buffers must stay valid until submit() returns.
+*/
+class IoBatch
+{
+public:
+    void openat(int dir_fd, const char *path, int flags, mode_t mode);
+    void write(int fd, const void *buf, size_t len, off_t offset);
+    void linkat(int old_dir_fd, const char *old_path, int new_dir_fd, const char *new_path, int flags);
+    void close(int fd);
+
+    /*
+    Runs every queued operation and waits for all of them.
+    */
+    void submit();
+
+    /*
+    Input: (size_t) Operation index, in queueing order.
+    Output: (long) Its system call result, or -errno on failure.
+    */
+    long result(size_t i) const;
+
+    /*
+    Output: (size_t) Number of queued operations.
+    */
+    size_t size() const;
+
+    /*
+    Drops all operations and results.
+    */
+    void clear();
+
+private:
+    enum OpCode
+    {
+        OP_OPENAT,
+        OP_WRITE,
+        OP_LINKAT,
+        OP_CLOSE
+    };
+
+    struct Op
+    {
+        OpCode code;
+        int fd;
+        int fd2;
+        const char *path;
+        const char *path2;
+        int flags;
+        mode_t mode;
+        const void *buf;
+        size_t len;
+        off_t offset;
+        long result;
+    };
+
+    void runPosix(Op &op);
+    size_t runUring();
+
+    std::vector<Op> ops;
+};
+
+/**** FUNCTIONS ****/
+
+/*
+Output: (IoBackend) Backend IoBatch uses: MAIL_IO_BACKEND if set (and not set-uid),
+io_uring otherwise, and POSIX whenever the kernel refuses io_uring.
+*/
+IoBackend activeIoBackend();
+
+/*
+Input: (IoBackend) Backend to use from now on.
+Output: (bool) False if this kernel cannot run it (nothing changes).
+*/
+bool useIoBackend(IoBackend backend);
+
+#endif
@@ -0,0 +1,658 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "mail_utils.h"
+#include "mail_store.h"
+#include "mail_packed.h"
+#include "mail_stats.h"
+
+/*
+Input: (int) Mailbox directory fd, (int) LOCK_SH or LOCK_EX.
+Output: (int) The mailbox's index, open and locked, -1 if it has none.
+The lock is released when the descriptor is closed.
+*/
+static int lockIndex(int mailbox_fd, int operation)
+{
+    // Never a link, or a file planted by the mailbox owner; readers only need it read-only
+    int fd = openMailboxFile(mailbox_fd, PACKED_INDEX_FILE, operation == LOCK_EX ? O_RDWR : O_RDONLY, PACKED_FILE_MODE);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    while (flock(fd, operation) != 0)
+    {
+        if (errno != EINTR)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/*
+Input: (int) Open index, (PackedHeader) Filled with its header.
+Output: (bool) Whether the index starts with a valid header.
+*/
+static bool readHeader(int index_fd, PackedHeader &header)
+{
+    return pread(index_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+           memcmp(header.magic, PACKED_INDEX_MAGIC, sizeof(header.magic)) == 0;
+}
+
+/*
+Input: (int) Open index, (std::vector<PackedEntry>) Filled with every slot, the header's included.
+Output: (bool) Whether the whole index was read.
+*/
+static bool readEntries(int index_fd, std::vector<PackedEntry> &entries)
+{
+    struct stat st;
+    if (fstat(index_fd, &st) != 0)
+    {
+        return false;
+    }
+
+    entries.resize(st.st_size / sizeof(PackedEntry));
+    size_t bytes = entries.size() * sizeof(PackedEntry);
+    return bytes == 0 || pread(index_fd, entries.data(), bytes, 0) == (ssize_t)bytes;
+}
+
+/*
+Input: (uint32_t) Segment number.
+Output: (std::string) Its file name in the mailbox.
+*/
+static std::string segmentName(uint32_t segment)
+{
+    char name[32];
+    snprintf(name, sizeof(name), PACKED_SEGMENT_PREFIX "%06u", segment);
+    return name;
+}
+
+/*
+Input: (int) Mailbox directory fd, (uint32_t) Segment number, (int) Extra open flags (O_CREAT, O_EXCL).
+Output: (int) The segment, open for reading (and writing, when created), -1 on failure.
+A new segment gets PACKED_FILE_MODE.
+*/
+static int openSegment(int mailbox_fd, uint32_t segment, int flags)
+{
+    int mode = (flags & O_CREAT) ? O_RDWR : O_RDONLY;
+    return openMailboxFile(mailbox_fd, segmentName(segment).c_str(), mode | flags, PACKED_FILE_MODE);
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (std::vector<std::string>) Names of everything in the mailbox, "." and ".." aside.
+*/
+static std::vector<std::string> listMailbox(int mailbox_fd)
+{
+    std::vector<std::string> names;
+
+    // fdopendir owns the descriptor it is given
+    int fd = dup(mailbox_fd);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return names;
+    }
+    rewinddir(dir);
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+        {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    return names;
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (std::vector<uint32_t>) Numbers of the segment files in the mailbox, referenced or not.
+*/
+static std::vector<uint32_t> listSegments(int mailbox_fd)
+{
+    std::vector<uint32_t> segments;
+    size_t prefix = strlen(PACKED_SEGMENT_PREFIX);
+    for (const std::string &name : listMailbox(mailbox_fd))
+    {
+        if (name.compare(0, prefix, PACKED_SEGMENT_PREFIX) == 0 && name.length() > prefix && name.length() <= prefix + 9 &&
+            isNumeric(name.substr(prefix)))
+        {
+            segments.push_back(std::stoul(name.substr(prefix)));
+        }
+    }
+    return segments;
+}
+
+/*
+Input: (int) Source fd, (off_t) Where to start reading, (int) Destination fd, (off_t) Where to start writing, (long long) Bytes.
+Output: (bool) Whether every byte was copied.
+Copied inside the kernel (a single call for most messages), through a buffer where
+copy_file_range is not supported.
+*/
+static bool copyRange(int in_fd, off_t in_offset, int out_fd, off_t out_offset, long long length)
+{
+    long long copied = 0;
+    while (copied < length)
+    {
+        ssize_t n = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, length - copied, 0);
+        if (n > 0)
+        {
+            copied += n;
+        }
+        else if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+            break;
+        }
+        else
+        {
+            return false; // Source shorter than it should be, or a write error
+        }
+    }
+
+    std::vector<char> buffer(copied < length ? std::min((long long)STAGE_BUFFER_SIZE, length - copied) : 0);
+    while (copied < length)
+    {
+        ssize_t n = pread(in_fd, buffer.data(), std::min((long long)buffer.size(), length - copied), in_offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0 || pwrite(out_fd, buffer.data(), n, out_offset) != n)
+        {
+            return false;
+        }
+        copied += n;
+        in_offset += n;
+        out_offset += n;
+    }
+    return true;
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (bool) Whether the mailbox uses the packed layout.
+*/
+bool isPacked(int mailbox_fd)
+{
+    return faccessat(mailbox_fd, PACKED_INDEX_FILE, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+/*
+Input: (int) Mailbox directory fd, (StagedMessage) Staged message, (std::string) Full message, only used if nothing is staged.
+Output: (uint64_t) Number the message was stored under, 0 on failure.
+Appends the message to the active segment (rolling over to a new one when it is
+full) and then records it in the index, all under the index's exclusive lock. A
+message is only visible once its index slot is written, so a delivery cut short
+leaves at most unreferenced bytes in the segment. A durable message is flushed,
+data first, before its number is returned.
+*/
+uint64_t appendPacked(int mailbox_fd, const StagedMessage &staged, const std::string &message)
+{
+    StageTimer timer(TIME_OUT_PUBLISH);
+    countStat(STAT_OUT_PACKED_APPENDS);
+
+    int index_fd = lockIndex(mailbox_fd, LOCK_EX);
+    if (index_fd < 0)
+    {
+        return 0;
+    }
+
+    // Next number: the slot after the last one, a torn last slot included
+    PackedHeader header;
+    struct stat st;
+    uint64_t number = 0;
+    int segment_fd = -1;
+    if (readHeader(index_fd, header) && fstat(index_fd, &st) == 0)
+    {
+        number = std::max((uint64_t)1, (uint64_t)(st.st_size + sizeof(PackedEntry) - 1) / sizeof(PackedEntry));
+        segment_fd = openSegment(mailbox_fd, header.segment, O_CREAT);
+    }
+
+    long long length = staged.fd >= 0 ? staged.size : (long long)message.size();
+    bool stored = segment_fd >= 0 && fstat(segment_fd, &st) == 0;
+    if (stored && st.st_size > 0 && st.st_size + length > PACKED_SEGMENT_MAX)
+    {
+        close(segment_fd);
+        header.segment++;
+        segment_fd = openSegment(mailbox_fd, header.segment, O_CREAT);
+        stored = segment_fd >= 0 && fstat(segment_fd, &st) == 0 &&
+                 pwrite(index_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+    }
+
+    // The message goes in with one copy (or one pwrite from memory), then its slot
+    PackedEntry entry{stored ? (uint64_t)st.st_size : 0, (uint64_t)length, header.segment, PACKED_PRESENT};
+    if (stored && staged.fd >= 0)
+    {
+        stored = copyRange(staged.fd, 0, segment_fd, entry.offset, length);
+    }
+    else if (stored)
+    {
+        stored = pwrite(segment_fd, message.data(), length, entry.offset) == length;
+    }
+    stored = stored && (!staged.durable || fdatasync(segment_fd) == 0) &&
+             pwrite(index_fd, &entry, sizeof(entry), number * sizeof(entry)) == (ssize_t)sizeof(entry) &&
+             (!staged.durable || fdatasync(index_fd) == 0);
+    if (stored)
+    {
+        countStat(STAT_OUT_BYTES_WRITTEN, length);
+    }
+
+    if (segment_fd >= 0)
+    {
+        close(segment_fd);
+    }
+    close(index_fd);
+    return stored ? number : 0;
+}
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number, (PackedEntry) Set to its index slot.
+Output: (int) The message's segment opened for reading, -1 if there is no such message.
+The caller closes it; it stays readable even if a compaction removes the segment.
+*/
+int openPacked(int mailbox_fd, uint64_t number, PackedEntry &entry)
+{
+    int index_fd = lockIndex(mailbox_fd, LOCK_SH);
+    if (index_fd < 0)
+    {
+        return -1;
+    }
+
+    int segment_fd = -1;
+    if (number > 0 && pread(index_fd, &entry, sizeof(entry), number * sizeof(entry)) == (ssize_t)sizeof(entry) &&
+        (entry.flags & (PACKED_PRESENT | PACKED_DELETED)) == PACKED_PRESENT)
+    {
+        segment_fd = openSegment(mailbox_fd, entry.segment, 0);
+    }
+    close(index_fd);
+    return segment_fd;
+}
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number.
+Output: (bool) Whether the message existed and is now marked deleted.
+*/
+bool deletePacked(int mailbox_fd, uint64_t number)
+{
+    int index_fd = lockIndex(mailbox_fd, LOCK_EX);
+    if (index_fd < 0)
+    {
+        return false;
+    }
+
+    PackedEntry entry;
+    off_t at = number * sizeof(entry);
+    bool deleted = number > 0 && pread(index_fd, &entry, sizeof(entry), at) == (ssize_t)sizeof(entry) &&
+                   (entry.flags & (PACKED_PRESENT | PACKED_DELETED)) == PACKED_PRESENT;
+    entry.flags |= PACKED_DELETED;
+    deleted = deleted && pwrite(index_fd, &entry, sizeof(entry), at) == (ssize_t)sizeof(entry);
+    close(index_fd);
+    return deleted;
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (std::vector<uint64_t>) Numbers of the messages in the index, deleted ones aside, in order.
+*/
+std::vector<uint64_t> listPacked(int mailbox_fd)
+{
+    std::vector<uint64_t> numbers;
+    std::vector<PackedEntry> entries;
+    int index_fd = lockIndex(mailbox_fd, LOCK_SH);
+    if (index_fd >= 0 && readEntries(index_fd, entries))
+    {
+        for (size_t number = 1; number < entries.size(); number++)
+        {
+            if ((entries[number].flags & (PACKED_PRESENT | PACKED_DELETED)) == PACKED_PRESENT)
+            {
+                numbers.push_back(number);
+            }
+        }
+    }
+    if (index_fd >= 0)
+    {
+        close(index_fd);
+    }
+    return numbers;
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (long long) Segment bytes reclaimed, -1 on failure (the mailbox is left as it was).
+Copies the live messages into fresh segments, in number order, points the index at
+them and only then removes the old segments, so every index slot refers to valid
+data at all times. Message numbers do not change. Deliveries wait for it.
+*/
+long long compactPacked(int mailbox_fd)
+{
+    int index_fd = lockIndex(mailbox_fd, LOCK_EX);
+    PackedHeader header;
+    std::vector<PackedEntry> entries;
+    if (index_fd < 0 || !readHeader(index_fd, header) || !readEntries(index_fd, entries))
+    {
+        if (index_fd >= 0)
+        {
+            close(index_fd);
+        }
+        return -1;
+    }
+
+    // New segments are numbered past every existing file, orphans of a cut short compaction included
+    std::vector<uint32_t> old_segments = listSegments(mailbox_fd);
+    long long before = 0;
+    uint32_t first = header.segment + 1;
+    for (uint32_t segment : old_segments)
+    {
+        struct stat st;
+        if (fstatat(mailbox_fd, segmentName(segment).c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            before += st.st_size;
+        }
+        first = std::max(first, segment + 1);
+    }
+
+    std::map<uint32_t, int> sources;
+    uint32_t next = first;
+    int out_fd = -1;
+    long long out_size = 0;
+    long long after = 0;
+    bool copied = true;
+    for (size_t n = 1; n < entries.size() && copied; n++)
+    {
+        PackedEntry &entry = entries[n];
+        if (!(entry.flags & PACKED_PRESENT))
+        {
+            continue;
+        }
+        if (entry.flags & PACKED_DELETED)
+        {
+            entry = PackedEntry{0, 0, 0, PACKED_PRESENT | PACKED_DELETED};
+            continue;
+        }
+
+        if (out_fd < 0 || (out_size > 0 && out_size + (long long)entry.length > PACKED_SEGMENT_MAX))
+        {
+            copied = out_fd < 0 || (fdatasync(out_fd) == 0 && close(out_fd) == 0);
+            out_fd = openSegment(mailbox_fd, next++, O_CREAT | O_EXCL);
+            out_size = 0;
+            copied = copied && out_fd >= 0;
+        }
+
+        if (sources.find(entry.segment) == sources.end())
+        {
+            sources[entry.segment] = openSegment(mailbox_fd, entry.segment, 0);
+        }
+        int source_fd = sources[entry.segment];
+        copied = copied && source_fd >= 0 && copyRange(source_fd, entry.offset, out_fd, out_size, entry.length);
+        entry.segment = next - 1;
+        entry.offset = out_size;
+        out_size += entry.length;
+        after += entry.length;
+    }
+    copied = copied && (out_fd < 0 || fdatasync(out_fd) == 0);
+    if (out_fd >= 0)
+    {
+        close(out_fd);
+    }
+    for (const auto &source : sources)
+    {
+        if (source.second >= 0)
+        {
+            close(source.second);
+        }
+    }
+
+    // The new segments' names are on disk before the index refers to them
+    copied = copied && fsync(mailbox_fd) == 0;
+    if (!copied)
+    {
+        for (uint32_t segment = first; segment < next; segment++)
+        {
+            unlinkat(mailbox_fd, segmentName(segment).c_str(), 0);
+        }
+        close(index_fd);
+        return -1;
+    }
+
+    // Appends continue in the last new segment (or a fresh one if nothing is left)
+    header.segment = next > first ? next - 1 : first;
+    memcpy(&entries[0], &header, sizeof(header));
+    size_t bytes = entries.size() * sizeof(PackedEntry);
+    bool indexed = pwrite(index_fd, entries.data(), bytes, 0) == (ssize_t)bytes && fdatasync(index_fd) == 0;
+    close(index_fd);
+    if (!indexed)
+    {
+        return -1; // Slots point into old and new segments alike, both are kept
+    }
+
+    for (uint32_t segment : old_segments)
+    {
+        unlinkat(mailbox_fd, segmentName(segment).c_str(), 0);
+    }
+    return before - after;
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (long) Number of messages converted, -1 on failure.
+Converts a file-per-message mailbox (flat, fanout or both) to the packed layout,
+keeping every message number. A single-instance message (N plus .N.body) is
+packed whole. The message files are only removed once the index is in place.
+Nothing may deliver to the mailbox meanwhile.
+*/
+long packMailbox(int mailbox_fd)
+{
+    if (isPacked(mailbox_fd))
+    {
+        return -1;
+    }
+
+    // Message files of either layout, in number order; leftovers of a conversion cut short are dropped
+    std::vector<std::pair<uint64_t, std::string>> messages = listMessages(mailbox_fd);
+    for (uint32_t segment : listSegments(mailbox_fd))
+    {
+        unlinkat(mailbox_fd, segmentName(segment).c_str(), 0);
+    }
+
+    std::string new_index = std::string(PACKED_INDEX_FILE) + ".new";
+    unlinkat(mailbox_fd, new_index.c_str(), 0);
+    int index_fd = openMailboxFile(mailbox_fd, new_index.c_str(), O_RDWR | O_CREAT | O_EXCL, PACKED_FILE_MODE);
+    PackedHeader header;
+    memcpy(header.magic, PACKED_INDEX_MAGIC, sizeof(header.magic));
+    header.segment = 1;
+    header.reserved[0] = header.reserved[1] = 0;
+    bool packed = index_fd >= 0 && pwrite(index_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+
+    int out_fd = packed ? openSegment(mailbox_fd, header.segment, O_CREAT | O_EXCL) : -1;
+    long long out_size = 0;
+    packed = packed && out_fd >= 0;
+    for (size_t i = 0; i < messages.size() && packed; i++)
+    {
+        int parts[2] = {openMessage(mailbox_fd, messages[i].second, O_RDONLY),
+                        openMessage(mailbox_fd, bodyLinkName(messages[i].second), O_RDONLY)};
+        long long sizes[2] = {0, 0};
+        for (int k = 0; k < 2; k++)
+        {
+            struct stat st;
+            if (parts[k] >= 0 && fstat(parts[k], &st) == 0)
+            {
+                sizes[k] = st.st_size;
+            }
+        }
+        packed = parts[0] >= 0;
+
+        PackedEntry entry{0, (uint64_t)(sizes[0] + sizes[1]), header.segment, PACKED_PRESENT};
+        if (packed && out_size > 0 && out_size + (long long)entry.length > PACKED_SEGMENT_MAX)
+        {
+            packed = fdatasync(out_fd) == 0 && close(out_fd) == 0;
+            entry.segment = ++header.segment;
+            out_fd = openSegment(mailbox_fd, header.segment, O_CREAT | O_EXCL);
+            out_size = 0;
+            packed = packed && out_fd >= 0;
+        }
+        entry.offset = out_size;
+        packed = packed && copyRange(parts[0], 0, out_fd, out_size, sizes[0]) &&
+                 (parts[1] < 0 || copyRange(parts[1], 0, out_fd, out_size + sizes[0], sizes[1])) &&
+                 pwrite(index_fd, &entry, sizeof(entry), messages[i].first * sizeof(entry)) == (ssize_t)sizeof(entry);
+        out_size += entry.length;
+
+        for (int k = 0; k < 2; k++)
+        {
+            if (parts[k] >= 0)
+            {
+                close(parts[k]);
+            }
+        }
+    }
+
+    // Everything on disk before the index makes the mailbox packed
+    packed = packed && pwrite(index_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+             fdatasync(out_fd) == 0 && fdatasync(index_fd) == 0 && fsync(mailbox_fd) == 0 &&
+             renameat(mailbox_fd, new_index.c_str(), mailbox_fd, PACKED_INDEX_FILE) == 0 && fsync(mailbox_fd) == 0;
+    if (out_fd >= 0)
+    {
+        close(out_fd);
+    }
+    if (index_fd >= 0)
+    {
+        close(index_fd);
+    }
+    if (!packed)
+    {
+        unlinkat(mailbox_fd, new_index.c_str(), 0);
+        for (uint32_t segment : listSegments(mailbox_fd))
+        {
+            unlinkat(mailbox_fd, segmentName(segment).c_str(), 0);
+        }
+        return -1;
+    }
+
+    for (const auto &message : messages)
+    {
+        unlinkMessage(mailbox_fd, message.second, 0);
+        unlinkMessage(mailbox_fd, bodyLinkName(message.second), 0);
+
+        // Fanout directories go once empty (the mailbox keeps the layout for unpack)
+        for (size_t slash = message.second.rfind('/'); slash != std::string::npos && slash > 0; slash = message.second.rfind('/', slash - 1))
+        {
+            unlinkMessage(mailbox_fd, message.second.substr(0, slash), AT_REMOVEDIR);
+        }
+    }
+    unlinkat(mailbox_fd, MAILBOX_SEQ_FILE, 0);
+    return messages.size();
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (long) Number of messages converted, -1 on failure.
+Converts a packed mailbox back to one file per message under the same numbers,
+in the fanout layout if the mailbox has it (otherwise they must fit 5-digit
+names). The index and segments are only removed once every message has its file. Nothing may deliver to the mailbox meanwhile.
+*/
+long unpackMailbox(int mailbox_fd)
+{
+    int index_fd = lockIndex(mailbox_fd, LOCK_EX);
+    PackedHeader header;
+    std::vector<PackedEntry> entries;
+    if (index_fd < 0 || !readHeader(index_fd, header) || !readEntries(index_fd, entries))
+    {
+        if (index_fd >= 0)
+        {
+            close(index_fd);
+        }
+        return -1;
+    }
+
+    // Each message is written under a dot name and linked, so it never replaces a file
+    bool fanout = isFanout(mailbox_fd);
+    std::vector<std::string> created;
+    std::map<uint32_t, int> sources;
+    bool unpacked = true;
+    for (size_t n = 1; n < entries.size() && unpacked; n++)
+    {
+        const PackedEntry &entry = entries[n];
+        if ((entry.flags & (PACKED_PRESENT | PACKED_DELETED)) != PACKED_PRESENT)
+        {
+            continue;
+        }
+
+        std::string name = messageName(n, fanout);
+        std::string temp = ".unpack." + std::to_string(n);
+        if (sources.find(entry.segment) == sources.end())
+        {
+            sources[entry.segment] = openSegment(mailbox_fd, entry.segment, 0);
+        }
+        bool placed = fanout ? makeFanoutDirs(mailbox_fd, name) : n <= FLAT_NUMBER_MAX;
+        if (placed)
+        {
+            unlinkat(mailbox_fd, temp.c_str(), 0); // Left by an unpack cut short
+        }
+        int out_fd = placed ? openMailboxFile(mailbox_fd, temp.c_str(), O_RDWR | O_CREAT | O_EXCL, STAGED_MODE) : -1;
+        unpacked = out_fd >= 0 && sources[entry.segment] >= 0 &&
+                   copyRange(sources[entry.segment], entry.offset, out_fd, 0, entry.length) &&
+                   linkMessage(mailbox_fd, temp, mailbox_fd, name, 0) == 0;
+        if (unpacked)
+        {
+            created.push_back(name);
+        }
+        if (out_fd >= 0)
+        {
+            close(out_fd);
+            unlinkat(mailbox_fd, temp.c_str(), 0);
+        }
+    }
+    for (const auto &source : sources)
+    {
+        if (source.second >= 0)
+        {
+            close(source.second);
+        }
+    }
+
+    // The files are on disk before the index they replace goes
+    unpacked = unpacked && syncfs(mailbox_fd) == 0;
+    if (!unpacked)
+    {
+        for (const std::string &name : created)
+        {
+            unlinkMessage(mailbox_fd, name, 0);
+        }
+        close(index_fd);
+        return -1;
+    }
+
+    unlinkat(mailbox_fd, PACKED_INDEX_FILE, 0);
+    close(index_fd);
+    for (uint32_t segment : listSegments(mailbox_fd))
+    {
+        unlinkat(mailbox_fd, segmentName(segment).c_str(), 0);
+    }
+
+    // Rebuilt from the files by the next delivery
+    unlinkat(mailbox_fd, MAILBOX_SEQ_FILE, 0);
+    return created.size();
+}
@@ -0,0 +1,114 @@
+#include <string>
+#include <cstdint>
+#include <vector>
+#include "mail_store.h"
+#ifndef MAIL_PACKED
+#define MAIL_PACKED
+
+/**** CONSTANTS ****/
+
+// A mailbox holding this file is packed: its messages are appended to segment files
+// (.seg.NNNNNN) and found through the index, one PackedEntry per message number
+#define PACKED_INDEX_FILE ".index"
+#define PACKED_INDEX_MAGIC "SMX1"
+#define PACKED_SEGMENT_PREFIX ".seg."
+
+// Index and segments are owned by whoever delivers and readable by the mailbox owner
+#define PACKED_FILE_MODE 0644
+
+// Segments roll over once the next message would take them past this size
+#define PACKED_SEGMENT_MAX (64 << 20)
+
+// A message up to this size for packed mailboxes only is appended from memory, not staged in tmp/
+#define PACKED_INLINE_MAX (1 << 20)
+
+// PackedEntry flags
+#define PACKED_PRESENT 0x1 // Slot holds a delivered message (unset: number never used)
+#define PACKED_DELETED 0x2 // Removed; its bytes are reclaimed by compactPacked
+
+/**** STRUCTS ****/
+
+// First slot of the index
+struct PackedHeader
+{
+    char magic[4];      // PACKED_INDEX_MAGIC, without the terminator
+    uint32_t segment;   // Segment new messages are appended to
+    uint64_t reserved[2];
+};
+
+// Slot N of the index (at N * sizeof(PackedEntry)) is message number N
+struct PackedEntry
+{
+    uint64_t offset;    // Where the message starts in its segment
+    uint64_t length;    // Bytes, as stored (possibly compressed, see StoredHeader)
+    uint32_t segment;
+    uint32_t flags;     // PACKED_* bits
+};
+
+/**** FUNCTIONS ****/
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (bool) Whether the mailbox uses the packed layout.
+*/
+bool isPacked(int mailbox_fd);
+
+/*
+Input: (int) Mailbox directory fd, (StagedMessage) Staged message, (std::string) Full message, only used if nothing is staged.
+Output: (uint64_t) Number the message was stored under, 0 on failure.
+Appends the message to the active segment (rolling over to a new one when it is
+full) and then records it in the index, all under the index's exclusive lock. A
+message is only visible once its index slot is written, so a delivery cut short
+leaves at most unreferenced bytes in the segment. A durable message is flushed,
+data first, before its number is returned.
+*/
+uint64_t appendPacked(int mailbox_fd, const StagedMessage &staged, const std::string &message);
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number, (PackedEntry) Set to its index slot.
+Output: (int) The message's segment opened for reading, -1 if there is no such message.
+The caller closes it; it stays readable even if a compaction removes the segment.
+*/
+int openPacked(int mailbox_fd, uint64_t number, PackedEntry &entry);
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number.
+Output: (bool) Whether the message existed and is now marked deleted.
+*/
+bool deletePacked(int mailbox_fd, uint64_t number);
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (std::vector<uint64_t>) Numbers of the messages in the index, deleted ones aside, in order.
+*/
+std::vector<uint64_t> listPacked(int mailbox_fd);
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (long long) Segment bytes reclaimed, -1 on failure (the mailbox is left as it was).
+Copies the live messages into fresh segments, in number order, points the index at
+them and only then removes the old segments, so every index slot refers to valid
+data at all times. Message numbers do not change. Deliveries wait for it.
+*/
+long long compactPacked(int mailbox_fd);
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (long) Number of messages converted, -1 on failure.
+Converts a file-per-message mailbox (flat, fanout or both) to the packed layout,
+keeping every message number. A single-instance message (N plus .N.body) is
+packed whole. The message files are only removed once the index is in place.
+Nothing may deliver to the mailbox meanwhile.
+*/
+long packMailbox(int mailbox_fd);
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (long) Number of messages converted, -1 on failure.
+Converts a packed mailbox back to one file per message under the same numbers,
+in the fanout layout if the mailbox has it (otherwise they must fit 5-digit
+names). The index and segments are only removed once every message has its file. Nothing may deliver to the mailbox meanwhile.
+*/
+long unpackMailbox(int mailbox_fd);
+
+#endif
@@ -0,0 +1,505 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "mail_parser.h"
+
+/*
+Input: (ParseOutput) Where outcomes go, (long long) Bytes counted so far, (StatCounter) Counter, (const char*) Diagnostic or NULL.
+Prints and counts a diagnostic (or end of input inside a message), or records it.
+*/
+static void report(ParseOutput &output, long long bytes, StatCounter stat, const char *text)
+{
+    if (output.scheduler == NULL)
+    {
+        output.events.push_back(ParseEvent{bytes, stat, text, -1});
+        return;
+    }
+
+    if (text != NULL)
+    {
+        std::cerr << text << '\n';
+    }
+    countStat(stat);
+}
+
+/*
+Input: (ParseOutput) Where outcomes go, (long long) Bytes counted so far, (FullMessage) A fully parsed message.
+Output: (bool) False if its delivery could not be started.
+Delivered at once, or kept with its spool file (the parser starts a new one for the next message).
+*/
+static bool deliver(ParseOutput &output, long long bytes, FullMessage &message)
+{
+    if (output.scheduler == NULL)
+    {
+        output.messages.push_back(std::move(message));
+        message.spoolFd = -1;
+        output.events.push_back(ParseEvent{bytes, STAT_MESSAGES_PARSED, NULL, (long)output.messages.size() - 1});
+        return true;
+    }
+
+    // Deliver right away rather than holding the whole input in memory
+    countStat(STAT_MESSAGES_PARSED);
+    return output.scheduler->submit(message);
+}
+
+/*
+Input: (LineReader) Input, (ParseState) State at its start, (long long) Bytes counted before it,
+       (MailboxRegistry) Loaded mailboxes, (long long) Spool threshold, (ParseOutput) Where outcomes go.
+Output: (ParseResult) State and byte count at the end, and why it stopped.
+mail-in's state machine. Oversize or truncated input stops it without a diagnostic;
+the caller prints that one. Safe to run on several threads when output records.
+*/
+ParseResult parseMessages(LineReader &reader, ParseState state, long long bytes, const MailboxRegistry &mailboxes, long long spoolThreshold, ParseOutput &output)
+{
+    // Set flags for parsing input
+    bool mailFromMode = state == PARSE_MAIL_FROM;
+    bool rcptToMode = state == PARSE_RCPT_TO;
+    bool dataMode = state == PARSE_DATA;
+    bool skipMode = state == PARSE_SKIP;
+    long long bytesRead = bytes;
+    ParseEnd end = PARSE_END_INPUT;
+    std::string_view line;
+
+    // Store read data while reading
+    // (one message object whose buffers are reused, so steady state parsing does not allocate)
+    FullMessage message;
+
+    try
+    {
+        while (true)
+        {
+            // SKIP MODE -- get to end of line '.'
+            // MODE 3: DATA
+            // Both consume whole body sections at once rather than line by line
+            if (skipMode || dataMode)
+            {
+                // A body is held in memory up to the spool threshold at a time
+                long long bodyBytes;
+                long long budget = MAX_MSG_SIZE - bytesRead;
+                if (dataMode)
+                {
+                    budget = std::min(budget, spoolThreshold);
+                }
+                bool terminated = reader.readBody(dataMode ? &message.body : NULL, budget, bodyBytes);
+                if (bytesRead + bodyBytes > MAX_MSG_SIZE)
+                {
+                    end = PARSE_END_OVERSIZE;
+                    bytesRead += bodyBytes;
+                    break;
+                }
+                bytesRead += bodyBytes;
+
+                if (!terminated && bodyBytes > budget)
+                {
+                    // Over the threshold, not the input's end: move what we have to the
+                    // spool file and read on (it stays in memory if tmp/ is unusable)
+                    spoolBody(message);
+                    continue;
+                }
+
+                if (!terminated)
+                {
+                    report(output, bytesRead, STAT_MESSAGES_TRUNCATED, NULL);
+                    break; // End of input inside a message
+                }
+
+                // End of message
+                if (dataMode)
+                {
+                    std::sort( message.rcptTo.begin(), message.rcptTo.end() );
+                    message.rcptTo.erase( std::unique( message.rcptTo.begin(), message.rcptTo.end() ), message.rcptTo.end() );
+
+                    // A body that may hold zeros from a file that shrank is not mail
+                    if (inputTruncated())
+                    {
+                        end = PARSE_END_TRUNCATED;
+                        break;
+                    }
+                    if (!deliver(output, bytesRead, message))
+                    {
+                        end = PARSE_END_FAILED;
+                        break;
+                    }
+                }
+
+                // Flush out the variables, ready for new message
+                message.clear();
+
+                // Switch back to mailFrom mode
+                skipMode = false;
+                mailFromMode = true;
+                rcptToMode = false;
+                dataMode = false;
+                continue;
+            }
+
+            if (!reader.nextLine(line))
+            {
+                break;
+            }
+
+            bytesRead += line.empty() ? 1 : line.size();
+            if (bytesRead > MAX_MSG_SIZE)
+            {
+                end = PARSE_END_OVERSIZE;
+                break;
+            }
+
+            // MODE 1: MAIL FROM:<username>
+            if(mailFromMode && !rcptToMode && !dataMode && !skipMode)
+            {
+                // Reject newlines out of place
+                if (line.empty())
+                {
+                    report(output, bytesRead, STAT_REJECT_EMPTY_CONTROL_LINE, "Empty line found in control lines. Skipping to end-of-message.");
+                    skipMode = true;
+                    continue;
+                }
+
+                // Check correct MAIL FROM format (mailbox is the username in brackets)
+                std::string_view mailbox;
+                if (classifyControlLine(line, mailbox) != CONTROL_MAIL_FROM)
+                {
+                    report(output, bytesRead, STAT_REJECT_MAIL_FROM_FORMAT, "MAIL FROM control line invalid formatting. Skipping to end-of-message.");
+                    skipMode = true;
+                    continue;
+                }
+
+                if ( !validMailboxChars(mailbox) || !mailboxes.contains(mailbox) )
+                {
+                    report(output, bytesRead, STAT_REJECT_MAIL_FROM_MAILBOX, "Invalid MAIL FROM username. Skipping to end-of-message.");
+                    skipMode = true;
+                    continue;
+                }
+                message.mailFrom = mailbox;
+
+                // Change modes
+                mailFromMode = false;
+                rcptToMode = true;
+                dataMode = false;
+            }
+            // MODE 2: RCPT TO:<username>
+            else if(rcptToMode && !mailFromMode && !dataMode && !skipMode)
+            {
+                // Reject newlines out of place
+                if (line.empty())
+                {
+                    report(output, bytesRead, STAT_REJECT_EMPTY_CONTROL_LINE, "Empty line found in control lines. Skipping to end-of-message.");
+                    skipMode = true;
+                    continue;
+                }
+
+                // Check if this line is the DATA delimiter (if so, continue)
+                std::string_view mailbox;
+                ControlLine control = classifyControlLine(line, mailbox);
+                if(control == CONTROL_DATA)
+                {
+                    // Invalid if there are no valid rcptTo usernames (valid if at least one)
+                    if ( message.rcptTo.empty() )
+                    {
+                        report(output, bytesRead, STAT_REJECT_NO_RECIPIENTS, "No valid RCPT TO lines. Skipping to end-of-message.");
+                        skipMode = true;
+                        continue;
+                    }
+
+                    // Switch mode
+                    mailFromMode = false;
+                    rcptToMode = false;
+                    dataMode = true;
+                    continue;
+                }
+
+                // Check correct RCPT TO format
+                if (control != CONTROL_RCPT_TO)
+                {
+                    report(output, bytesRead, STAT_REJECT_RCPT_TO_FORMAT, "RCPT TO control line invalid formatting. Skipping to end-of-message.");
+                    skipMode = true;
+                    continue;
+                }
+
+                // Username from brackets
+                if( !validMailboxChars(mailbox) )
+                {
+                    report(output, bytesRead, STAT_RECIPIENTS_DROPPED, "Invalid RCPT TO username. Violates formatting.");
+                }
+                else
+                {
+                    message.rcptTo.emplace_back(mailbox);
+                }
+            }
+        }
+    }
+    catch (const std::bad_alloc& e)
+    {
+        end = PARSE_END_NO_MEMORY;
+    }
+
+    // Messages kept for later have their own spool files; this one is no longer needed
+    if (message.spoolFd >= 0)
+    {
+        close(message.spoolFd);
+    }
+
+    // A rejected control line sets skipMode without clearing the mode it was read in
+    ParseState last = PARSE_MAIL_FROM;
+    if (skipMode)
+    {
+        last = PARSE_SKIP;
+    }
+    else if (dataMode)
+    {
+        last = PARSE_DATA;
+    }
+    else if (rcptToMode)
+    {
+        last = PARSE_RCPT_TO;
+    }
+    return ParseResult{last, bytesRead, end};
+}
+
+// A stretch of a parallel parse's input and what parsing it recorded
+struct ParseShard
+{
+    size_t begin;
+    size_t end;
+    ParseOutput output;
+    ParseResult result;
+    bool done = false;
+};
+
+/*
+Input: (const char*) Input, (size_t) Its length, (size_t) Where to start looking, (size_t) Bound.
+Output: (size_t) First position at or after from that follows a "\n.\n" (starts the line after a
+        "." line), if it is below limit; -1 (as size_t) otherwise.
+*/
+static size_t shardBoundary(const char *input, size_t length, size_t from, size_t limit)
+{
+    size_t scanFrom = from >= 3 ? from - 3 : 0;
+    size_t scanEnd = std::min(length, limit - 1);
+    if (scanEnd <= scanFrom)
+    {
+        return (size_t)-1;
+    }
+
+    const char *hit = (const char *)memmem(input + scanFrom, scanEnd - scanFrom, "\n.\n", 3);
+    return hit != NULL ? (size_t)(hit - input) + 3 : (size_t)-1;
+}
+
+/*
+Input: (ParseShard) A shard whose outcomes will not be acted on (any more).
+Closes the spool files of its messages and frees them.
+*/
+static void discardShard(ParseShard &shard)
+{
+    for (FullMessage &message : shard.output.messages)
+    {
+        if (message.spoolFd >= 0)
+        {
+            close(message.spoolFd);
+        }
+    }
+    std::vector<FullMessage>().swap(shard.output.messages);
+    std::vector<ParseEvent>().swap(shard.output.events);
+}
+
+/*
+Input: (ParseShard) A parsed shard, (long long) Bytes counted before it, (bool) Whether it ends the input,
+       (DeliveryScheduler*) Where messages go, NULL for nowhere.
+Output: (ParseEnd) PARSE_END_INPUT if every outcome was acted on and the size limit holds after it.
+Acts on the recorded outcomes in order, as parseMessages would have done at once.
+*/
+static ParseEnd replayShard(ParseShard &shard, long long base, bool last, DeliveryScheduler *scheduler)
+{
+    for (const ParseEvent &event : shard.output.events)
+    {
+        if (base + event.bytes > MAX_MSG_SIZE)
+        {
+            return PARSE_END_OVERSIZE;
+        }
+        if (event.stat == STAT_MESSAGES_TRUNCATED && !last)
+        {
+            continue; // Not the end of the input: the message being skipped goes on in the next shard
+        }
+        if (event.text != NULL)
+        {
+            std::cerr << event.text << '\n';
+        }
+        countStat(event.stat);
+        if (event.message >= 0)
+        {
+            if (inputTruncated())
+            {
+                return PARSE_END_TRUNCATED;
+            }
+            FullMessage &message = shard.output.messages[event.message];
+            bool started = scheduler == NULL || scheduler->submit(message);
+            if (message.spoolFd >= 0)
+            {
+                close(message.spoolFd);
+                message.spoolFd = -1;
+            }
+            if (!started)
+            {
+                return PARSE_END_FAILED;
+            }
+        }
+    }
+
+    if (shard.result.end == PARSE_END_OVERSIZE || base + shard.result.bytes > MAX_MSG_SIZE)
+    {
+        return PARSE_END_OVERSIZE;
+    }
+    return shard.result.end;
+}
+
+/*
+Input: (int) Input fd, a regular file, (int) Parser threads, (MailboxRegistry) Loaded mailboxes,
+       (long long) Spool threshold, (DeliveryScheduler*) Where messages go, NULL to only parse them.
+Output: (ParseEnd) Why parsing stopped, PARSE_END_FAILED also if the input cannot be mapped.
+The input is mapped from the fd's offset, as LineReader does.
+Parses shards of the input (see PARSE_SHARD_SIZE) on several threads, each
+assuming it starts at a MAIL FROM line, and acts on their outcomes in input
+order: diagnostics, stats, deliveries and the size limit come out exactly as
+from one parseMessages over the whole input. A shard that turns out to start
+inside a skipped message is parsed again, in order.
+*/
+ParseEnd parseParallel(int fd, int threads, const MailboxRegistry &mailboxes, long long spoolThreshold, DeliveryScheduler *scheduler)
+{
+    struct stat st;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || offset < 0)
+    {
+        return PARSE_END_FAILED;
+    }
+    if (st.st_size <= offset)
+    {
+        return PARSE_END_INPUT;
+    }
+    MappedInput mapped = mapInput(fd);
+    if (mapped.data == NULL)
+    {
+        return PARSE_END_FAILED;
+    }
+    const char *input = mapped.data;
+    size_t length = mapped.length;
+    countStat(STAT_BYTES_READ, length);
+
+    // Shard i covers the whole messages that start in [i, i + 1) * PARSE_SHARD_SIZE.
+    // Both ends are found by the thread that parses it; one holding no message start is empty.
+    size_t count = (length + PARSE_SHARD_SIZE - 1) / PARSE_SHARD_SIZE;
+    std::vector<ParseShard> shards(count);
+    std::mutex lock;
+    std::condition_variable changed;
+    size_t next = 0;   // First shard nobody has taken
+    size_t merged = 0; // Shards acted on so far
+    bool stopping = false;
+
+    // Each thread takes the next shard as soon as it is free, up to a window past the merge
+    size_t window = (size_t)threads * PARSE_SHARDS_AHEAD;
+    auto work = [&]()
+    {
+        while (true)
+        {
+            size_t i;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]() { return stopping || next >= count || next < merged + window; });
+                if (stopping || next >= count)
+                {
+                    return;
+                }
+                i = next++;
+            }
+
+            ParseShard &shard = shards[i];
+            size_t low = i * (size_t)PARSE_SHARD_SIZE;
+            size_t high = low + PARSE_SHARD_SIZE;
+            shard.begin = i == 0 ? 0 : shardBoundary(input, length, low, high);
+            shard.end = shard.begin;
+            shard.output.scheduler = NULL;
+            shard.result = ParseResult{PARSE_MAIL_FROM, 0, PARSE_END_INPUT};
+            if (shard.begin != (size_t)-1)
+            {
+                shard.end = high >= length ? length : shardBoundary(input, length, high, length + 1);
+                shard.end = shard.end == (size_t)-1 ? length : shard.end;
+                LineReader reader(input + shard.begin, shard.end - shard.begin);
+                shard.result = parseMessages(reader, PARSE_MAIL_FROM, 0, mailboxes, spoolThreshold, shard.output);
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                shard.done = true;
+            }
+            changed.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads && (size_t)t < count; t++)
+    {
+        workers.emplace_back(work);
+    }
+
+    // Outcomes are acted on here, in input order: stats and deliveries belong to this thread
+    ParseState state = PARSE_MAIL_FROM;
+    long long bytes = 0;
+    ParseEnd end = PARSE_END_INPUT;
+    for (size_t i = 0; i < count && end == PARSE_END_INPUT; i++)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&]() { return shards[i].done; });
+        }
+
+        // An empty shard leaves the state as it is
+        ParseShard &shard = shards[i];
+        if (shard.begin != (size_t)-1)
+        {
+            // Guessed wrong: the previous shard ended in a message being skipped
+            if (state != PARSE_MAIL_FROM)
+            {
+                discardShard(shard);
+                LineReader reader(input + shard.begin, shard.end - shard.begin);
+                shard.result = parseMessages(reader, state, 0, mailboxes, spoolThreshold, shard.output);
+            }
+
+            end = replayShard(shard, bytes, shard.end == length, scheduler);
+            state = shard.result.state;
+            bytes += shard.result.bytes;
+            discardShard(shard);
+
+            // Nothing before this shard's end is read again
+            releaseInput(mapped, shard.end);
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            merged = i + 1;
+        }
+        changed.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    for (ParseShard &shard : shards)
+    {
+        discardShard(shard);
+    }
+    unmapInput(mapped);
+    return end;
+}
@@ -0,0 +1,95 @@
+#include <string>
+#include <vector>
+#include "mail_utils.h"
+#include "mail_reader.h"
+#include "mail_registry.h"
+#include "mail_delivery.h"
+#include "mail_stats.h"
+#ifndef MAIL_PARSER
+#define MAIL_PARSER
+
+/**** CONSTANTS ****/
+
+// --parse-threads: the input is cut into shards of about this size, each ending
+// just after a "." line
+#define PARSE_SHARD_SIZE (4 << 20)
+
+// Shards each parser thread may have finished ahead of the one being delivered
+// (bounds the memory held by parsed, undelivered messages)
+#define PARSE_SHARDS_AHEAD 2
+
+/**** ENUMS ****/
+
+// Where mail-in's state machine is in the input
+enum ParseState
+{
+    PARSE_MAIL_FROM, // Expecting a MAIL FROM line
+    PARSE_RCPT_TO,   // Expecting RCPT TO lines, then DATA
+    PARSE_DATA,      // Reading a body up to its "." line
+    PARSE_SKIP       // Discarding a rejected message up to its "." line
+};
+
+// Why parsing stopped
+enum ParseEnd
+{
+    PARSE_END_INPUT,     // End of the input reached
+    PARSE_END_OVERSIZE,  // More than MAX_MSG_SIZE read (mail-in's accounting)
+    PARSE_END_FAILED,    // A delivery could not be started
+    PARSE_END_NO_MEMORY, // An allocation failed
+    PARSE_END_TRUNCATED  // The input file shrank while it was mapped (see inputTruncated)
+};
+
+/**** STRUCTS ****/
+
+// One outcome of parsing, recorded to be acted on later in input order
+struct ParseEvent
+{
+    long long bytes;  // Input counted once the line behind it was read, from the start of the stretch
+    StatCounter stat; // Counter it adds one to
+    const char *text; // Diagnostic line for stderr (without its newline), NULL for none
+    long message;     // Index of a parsed message in ParseOutput::messages, -1 for none
+};
+
+// Where the parser's outcomes go
+struct ParseOutput
+{
+    // Set: diagnostics are printed, stats counted and messages delivered at once.
+    // NULL: all of it is recorded below instead (a shard parsed by another thread).
+    DeliveryScheduler *scheduler;
+    std::vector<ParseEvent> events;
+    std::vector<FullMessage> messages; // Each with its own spool file, if any
+};
+
+// How a stretch of input ended
+struct ParseResult
+{
+    ParseState state; // State after its last line
+    long long bytes;  // Input counted, including what was counted before it
+    ParseEnd end;
+};
+
+/**** FUNCTIONS ****/
+
+/*
+Input: (LineReader) Input, (ParseState) State at its start, (long long) Bytes counted before it,
+       (MailboxRegistry) Loaded mailboxes, (long long) Spool threshold, (ParseOutput) Where outcomes go.
+Output: (ParseResult) State and byte count at the end, and why it stopped.
+mail-in's state machine. Oversize or truncated input stops it without a diagnostic;
+the caller prints that one. Safe to run on several threads when output records.
+*/
+ParseResult parseMessages(LineReader &reader, ParseState state, long long bytes, const MailboxRegistry &mailboxes, long long spoolThreshold, ParseOutput &output);
+
+/*
+Input: (int) Input fd, a regular file, (int) Parser threads, (MailboxRegistry) Loaded mailboxes,
+       (long long) Spool threshold, (DeliveryScheduler*) Where messages go, NULL to only parse them.
+Output: (ParseEnd) Why parsing stopped, PARSE_END_FAILED also if the input cannot be mapped.
+The input is mapped from the fd's offset, as LineReader does.
+Parses shards of the input (see PARSE_SHARD_SIZE) on several threads, each
+assuming it starts at a MAIL FROM line, and acts on their outcomes in input
+order: diagnostics, stats, deliveries and the size limit come out exactly as
+from one parseMessages over the whole input. A shard that turns out to start
+inside a skipped message is parsed again, in order.
+*/
+ParseEnd parseParallel(int fd, int threads, const MailboxRegistry &mailboxes, long long spoolThreshold, DeliveryScheduler *scheduler);
+
+#endif
@@ -0,0 +1,632 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <csignal>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+#include "mail_reader.h"
+#include "mail_stats.h"
+
+// The input mapped by mapInput, watched for faults past the end of a file that shrank
+static std::atomic<char *> guardBase(NULL);
+static std::atomic<size_t> guardLength(0);
+static std::atomic<bool> truncatedInput(false);
+static size_t guardPage = 4096; // sysconf is not safe to call in a signal handler
+
+/*
+Input: (int) Signal, (siginfo_t*) Where the fault was, (void*) Unused.
+A fault inside the mapped input means the file shrank: the rest of the mapping is
+replaced with zero pages so the read goes on, and inputTruncated reports it. Any
+other fault restores the default action, so it happens again and kills the process.
+*/
+static void onInputFault(int, siginfo_t *info, void *)
+{
+    char *base = guardBase.load();
+    char *addr = (char *)info->si_addr;
+    if (base != NULL && addr >= base && addr < base + guardLength.load())
+    {
+        char *page = (char *)((uintptr_t)addr & ~(uintptr_t)(guardPage - 1));
+        size_t rest = base + guardLength.load() - page;
+        if (mmap(page, rest, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+        {
+            truncatedInput = true;
+            return;
+        }
+    }
+    signal(SIGBUS, SIG_DFL);
+}
+
+/*
+Input: (int) Fd of a regular file.
+Output: (MappedInput) The file from the fd's offset to its end, data NULL if that is empty or
+        cannot be mapped (or another input is mapped); the fd's offset then stays where it was.
+Moves the fd's offset to the end, as reading the input would. Should the file shrink
+while it is mapped, the pages past its new end read as zeros instead of raising
+SIGBUS, and inputTruncated says so from then on.
+*/
+MappedInput mapInput(int fd)
+{
+    MappedInput input{NULL, 0, NULL, 0, 0};
+    struct stat st;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= offset || guardBase.load() != NULL)
+    {
+        return input;
+    }
+
+    // Mappings start on a page; the bytes before the offset are mapped but never read
+    off_t aligned = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t mapLength = st.st_size - aligned;
+    void *p = mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE, fd, aligned);
+    if (p == MAP_FAILED)
+    {
+        return input;
+    }
+
+    struct sigaction action = {};
+    guardPage = sysconf(_SC_PAGESIZE);
+    action.sa_sigaction = onInputFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    guardLength = mapLength;
+    guardBase = (char *)p;
+    sigaction(SIGBUS, &action, NULL);
+
+    lseek(fd, st.st_size, SEEK_SET);
+    madvise(p, mapLength, MADV_SEQUENTIAL);
+    input.base = (char *)p;
+    input.mapLength = mapLength;
+    input.data = input.base + (offset - aligned);
+    input.length = st.st_size - offset;
+    return input;
+}
+
+/*
+Input: (MappedInput) From mapInput, (size_t) Bytes of it that will not be read again.
+Drops them from memory, RELEASE_BLOCK_SIZE at a time. The mapping is private and never
+written, so pages are simply read from the file again should they be needed.
+*/
+void releaseInput(MappedInput &input, size_t consumed)
+{
+    size_t upTo = (input.data - input.base + consumed) & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+    if (input.data == NULL || upTo < input.released + RELEASE_BLOCK_SIZE)
+    {
+        return;
+    }
+
+    madvise(input.base + input.released, upTo - input.released, MADV_DONTNEED);
+    input.released = upTo;
+}
+
+/*
+Input: (MappedInput) From mapInput.
+Unmaps it.
+*/
+void unmapInput(MappedInput &input)
+{
+    if (input.data == NULL)
+    {
+        return;
+    }
+
+    munmap(input.base, input.mapLength);
+    guardBase = NULL;
+    input.data = NULL;
+}
+
+/*
+Output: (bool) Whether a mapped input shrank while it was read: some bytes it was
+        read as were zeros, not the file's.
+*/
+bool inputTruncated()
+{
+    return truncatedInput.load();
+}
+
+/*
+Input: (int) File descriptor to read (not closed by the reader).
+*/
+LineReader::LineReader(int fd) : fd(fd), eof(false), inputWait(NULL), inputWaitContext(NULL), data(NULL), start(0), end(0)
+{
+    mapped = mapInput(fd);
+    if (mapped.data != NULL)
+    {
+        countStat(STAT_BYTES_READ, mapped.length);
+        data = mapped.data;
+        end = mapped.length;
+        eof = true; // Everything is already in view
+        return;
+    }
+
+    buffer.resize(READ_BLOCK_SIZE);
+    data = buffer.data();
+}
+
+/*
+Input: (const char*) Input already in memory, (size_t) Its length (kept by the caller, not released).
+*/
+LineReader::LineReader(const char *input, size_t length) : fd(-1), eof(true), inputWait(NULL), inputWaitContext(NULL), mapped{NULL, 0, NULL, 0, 0},
+                                                             data(input), start(0), end(length)
+{
+}
+
+LineReader::~LineReader()
+{
+    unmapInput(mapped);
+}
+
+/*
+Output: (bool) Whether more bytes were read.
+Moves the unread tail to the front of the buffer (growing it if the tail fills
+it) and reads another block after it.
+*/
+bool LineReader::refill()
+{
+    if (eof)
+    {
+        return false;
+    }
+
+    size_t tail = end - start;
+    if (start > 0)
+    {
+        memmove(buffer.data(), buffer.data() + start, tail);
+        start = 0;
+        end = tail;
+    }
+    if (end == buffer.size())
+    {
+        buffer.resize(buffer.size() * 2); // A single line longer than the buffer
+    }
+    data = buffer.data();
+
+    while (true)
+    {
+        if (inputWait != NULL)
+        {
+            inputWait(inputWaitContext, fd);
+        }
+        ssize_t n = read(fd, buffer.data() + end, buffer.size() - end);
+        if (n > 0)
+        {
+            end += n;
+            countStat(STAT_BYTES_READ, n);
+            return true;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        eof = true;
+        return false;
+    }
+}
+
+/*
+Input: (InputWaitFn) Called before every read of a pipe or terminal, NULL for none, (void*) Passed to it.
+Lets mail-in keep its deliveries going while the input is quiet.
+*/
+void LineReader::setInputWait(InputWaitFn wait, void *context)
+{
+    inputWait = wait;
+    inputWaitContext = context;
+}
+
+/*
+Drops the consumed part of a mapped input from memory (see releaseInput).
+*/
+void LineReader::releaseConsumed()
+{
+    releaseInput(mapped, start);
+}
+
+/*
+Output: (bool) Whether the input is a mapped file that shrank, which then ends where
+        reading has got to: what follows may be zeros.
+*/
+bool LineReader::stopIfTruncated()
+{
+    if (mapped.data == NULL || !inputTruncated())
+    {
+        return false;
+    }
+    end = start;
+    return true;
+}
+
+/*
+Input: (std::string_view) Set to the next line, without its '\n'.
+Output: (bool) False once the input is exhausted.
+The view stays valid until the next call.
+*/
+bool LineReader::nextLine(std::string_view &line)
+{
+    // Bytes after start already known to hold no newline
+    size_t checked = 0;
+    while (true)
+    {
+        const char *nl = (const char *)memchr(data + start + checked, '\n', end - start - checked);
+        if (stopIfTruncated()) // Checked after the search, which may have run into zeros
+        {
+            return false;
+        }
+        if (nl != NULL)
+        {
+            size_t len = nl - (data + start);
+            line = std::string_view(data + start, len);
+            start += len + 1;
+            return true;
+        }
+
+        // Only search the newly read bytes next time around
+        checked = end - start;
+        if (!refill())
+        {
+            break;
+        }
+    }
+
+    // Last line without a trailing newline, like std::getline
+    if (start == end)
+    {
+        return false;
+    }
+    line = std::string_view(data + start, end - start);
+    start = end;
+    return true;
+}
+
+/*
+Input: (std::string*) Body to append to, NULL to discard, (long long) Byte budget, (long long) Set to bytes used.
+Output: (bool) Whether the terminating "." line was reached.
+Consumes a DATA section (or a section being skipped) in bulk, appending the
+un-stuffed body as whole ranges. Stops early once more than budget bytes
+have been used; the caller tells that apart from end of input by bytes.
+*/
+bool LineReader::readBody(std::string *body, long long budget, long long &bytes)
+{
+    bytes = 0;
+    while (bytes <= budget)
+    {
+        stopIfTruncated();
+
+        // Whole lines only, about one chunk at a time so the budget is checked as we go
+        size_t avail = end - start;
+        size_t len = avail < SCAN_CHUNK_SIZE ? avail : SCAN_CHUNK_SIZE;
+        const char *nl = len > 0 ? (const char *)memrchr(data + start, '\n', len) : NULL;
+        if (nl == NULL && len < avail)
+        {
+            nl = (const char *)memchr(data + start + len, '\n', avail - len); // Line longer than a chunk
+        }
+
+        bool atEof = false;
+        if (nl != NULL)
+        {
+            len = nl - (data + start) + 1;
+        }
+        else if (refill())
+        {
+            continue; // Partial line, read the rest of it
+        }
+        else
+        {
+            len = end - start;
+            atEof = true;
+            if (len == 0)
+            {
+                return false;
+            }
+        }
+
+        BodyScan scan = scanBody(data + start, len, atEof, body);
+        start += scan.consumed;
+        bytes += scan.bytes;
+        releaseConsumed();
+        if (scan.terminated)
+        {
+            return true;
+        }
+        if (atEof)
+        {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+/*
+Kernels: find the first position in p[from, n) that starts a line and holds '.',
+n if there is none. p[0] always starts a line. Newlines before the returned
+position are added to newlines, and those that make up a whole (empty) line
+to empty.
+*/
+typedef size_t (*DotScanFn)(const char *p, size_t from, size_t n, size_t &newlines, size_t &empty);
+
+static size_t findDotLineScalar(const char *p, size_t from, size_t n, size_t &newlines, size_t &empty)
+{
+    size_t i = from;
+    bool lineStart = (i == 0) || p[i - 1] == '\n';
+    while (i < n)
+    {
+        if (lineStart && p[i] == '.')
+        {
+            return i;
+        }
+
+        // Line by line from here on
+        const char *nl = (const char *)memchr(p + i, '\n', n - i);
+        if (nl == NULL)
+        {
+            break;
+        }
+        size_t j = nl - p;
+        newlines++;
+        empty += (lineStart && j == i);
+        i = j + 1;
+        lineStart = true;
+    }
+
+    return n;
+}
+
+#ifdef SCAN_X86
+/*
+Input: (__m128i) Per-byte counters.
+Output: (size_t) Their sum.
+*/
+static inline size_t sumBytes(__m128i counts)
+{
+    __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+    return (size_t)_mm_cvtsi128_si64(sums) + (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+}
+
+static size_t findDotLineSse2(const char *p, size_t from, size_t n, size_t &newlines, size_t &empty)
+{
+    // Position 0 has no byte before it to load
+    size_t i = from;
+    if (i == 0 && n > 0)
+    {
+        if (p[0] == '.')
+        {
+            return 0;
+        }
+        newlines += (p[0] == '\n');
+        empty += (p[0] == '\n');
+        i = 1;
+    }
+
+    // Newlines are counted in per-byte lanes (a compare yields -1) and summed
+    // before a lane can overflow; masks are only looked at when a dot starts a line
+    const __m128i nlByte = _mm_set1_epi8('\n');
+    const __m128i dotByte = _mm_set1_epi8('.');
+    __m128i nlCount = _mm_setzero_si128();
+    __m128i emptyCount = _mm_setzero_si128();
+    int rounds = 0;
+    bool found = false;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i cur = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i lineStart = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i - 1)), nlByte);
+        __m128i nl = _mm_cmpeq_epi8(cur, nlByte);
+        unsigned dot = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(cur, dotByte), lineStart));
+        if (dot != 0)
+        {
+            unsigned before = (1u << __builtin_ctz(dot)) - 1;
+            unsigned nlMask = _mm_movemask_epi8(nl) & before;
+            newlines += __builtin_popcount(nlMask);
+            empty += __builtin_popcount(nlMask & _mm_movemask_epi8(lineStart));
+            i += __builtin_ctz(dot);
+            found = true;
+            break;
+        }
+
+        nlCount = _mm_sub_epi8(nlCount, nl);
+        emptyCount = _mm_sub_epi8(emptyCount, _mm_and_si128(nl, lineStart));
+        if (++rounds == 255)
+        {
+            newlines += sumBytes(nlCount);
+            empty += sumBytes(emptyCount);
+            nlCount = _mm_setzero_si128();
+            emptyCount = _mm_setzero_si128();
+            rounds = 0;
+        }
+    }
+    newlines += sumBytes(nlCount);
+    empty += sumBytes(emptyCount);
+
+    return found ? i : findDotLineScalar(p, i, n, newlines, empty);
+}
+
+/*
+Input: (__m256i) Per-byte counters.
+Output: (size_t) Their sum.
+*/
+__attribute__((target("avx2")))
+static inline size_t sumBytes256(__m256i counts)
+{
+    __m256i sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+    return (size_t)_mm256_extract_epi64(sums, 0) + (size_t)_mm256_extract_epi64(sums, 1) +
+           (size_t)_mm256_extract_epi64(sums, 2) + (size_t)_mm256_extract_epi64(sums, 3);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t findDotLineAvx2(const char *p, size_t from, size_t n, size_t &newlines, size_t &empty)
+{
+    // Position 0 has no byte before it to load
+    size_t i = from;
+    if (i == 0 && n > 0)
+    {
+        if (p[0] == '.')
+        {
+            return 0;
+        }
+        newlines += (p[0] == '\n');
+        empty += (p[0] == '\n');
+        i = 1;
+    }
+
+    // Same scheme as the SSE2 kernel, 32 bytes per step
+    const __m256i nlByte = _mm256_set1_epi8('\n');
+    const __m256i dotByte = _mm256_set1_epi8('.');
+    __m256i nlCount = _mm256_setzero_si256();
+    __m256i emptyCount = _mm256_setzero_si256();
+    int rounds = 0;
+    bool found = false;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i cur = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i lineStart = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i - 1)), nlByte);
+        __m256i nl = _mm256_cmpeq_epi8(cur, nlByte);
+        unsigned dot = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(cur, dotByte), lineStart));
+        if (dot != 0)
+        {
+            unsigned bit = __builtin_ctz(dot);
+            unsigned before = bit == 0 ? 0 : (0xffffffffu >> (32 - bit));
+            unsigned nlMask = (unsigned)_mm256_movemask_epi8(nl) & before;
+            newlines += __builtin_popcount(nlMask);
+            empty += __builtin_popcount(nlMask & (unsigned)_mm256_movemask_epi8(lineStart));
+            i += bit;
+            found = true;
+            break;
+        }
+
+        nlCount = _mm256_sub_epi8(nlCount, nl);
+        emptyCount = _mm256_sub_epi8(emptyCount, _mm256_and_si256(nl, lineStart));
+        if (++rounds == 255)
+        {
+            newlines += sumBytes256(nlCount);
+            empty += sumBytes256(emptyCount);
+            nlCount = _mm256_setzero_si256();
+            emptyCount = _mm256_setzero_si256();
+            rounds = 0;
+        }
+    }
+    newlines += sumBytes256(nlCount);
+    empty += sumBytes256(emptyCount);
+
+    return found ? i : findDotLineScalar(p, i, n, newlines, empty);
+}
+#endif
+
+/*
+Output: (ScanKernel) Best kernel for this CPU.
+*/
+static ScanKernel detectScanKernel()
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init(); // May run before libgcc's own constructor
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SCAN_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return SCAN_SSE2;
+    }
+#endif
+    return SCAN_SCALAR;
+}
+
+static ScanKernel scanKernel = detectScanKernel();
+
+/*
+Input: (ScanKernel) A kernel.
+Output: (DotScanFn) Its implementation.
+*/
+static DotScanFn scanFunction(ScanKernel kernel)
+{
+    switch (kernel)
+    {
+#ifdef SCAN_X86
+        case SCAN_AVX2:
+            return findDotLineAvx2;
+        case SCAN_SSE2:
+            return findDotLineSse2;
+#endif
+        default:
+            return findDotLineScalar;
+    }
+}
+
+/*
+Output: (ScanKernel) Kernel scanBody uses: AVX2 or SSE2 when the CPU has it, scalar otherwise.
+*/
+ScanKernel activeScanKernel()
+{
+    return scanKernel;
+}
+
+/*
+Input: (ScanKernel) Kernel to use from now on.
+Output: (bool) False if this CPU or build cannot run it (nothing changes).
+Lets benchmarks compare the kernels.
+*/
+bool useScanKernel(ScanKernel kernel)
+{
+    if (kernel > detectScanKernel())
+    {
+        return false;
+    }
+
+    scanKernel = kernel;
+    return true;
+}
+
+/*
+Input: (const char*) Input starting at a line start, (size_t) Length, (bool) Whether the input ends there, (std::string*) Body or NULL.
+Output: (BodyScan) How far the DATA section got.
+Scans for the "." terminator line and for stuffed ".x" lines with the active
+kernel and appends the un-stuffed body between them as ranges. Unless atEof,
+the input must end with a newline.
+*/
+BodyScan scanBody(const char *p, size_t n, bool atEof, std::string *body)
+{
+    DotScanFn findDotLine = scanFunction(scanKernel);
+    BodyScan scan = {n, false, 0};
+    size_t newlines = 0;
+    size_t empty = 0;
+    size_t pos = 0;
+
+    while (true)
+    {
+        size_t dot = findDotLine(p, pos, n, newlines, empty);
+        if (body != NULL)
+        {
+            body->append(p + pos, dot - pos);
+        }
+        if (dot == n)
+        {
+            break;
+        }
+
+        // A line that is just "." ends the section
+        bool lineEnds = dot + 1 < n ? p[dot + 1] == '\n' : atEof;
+        if (lineEnds)
+        {
+            scan.terminated = true;
+            scan.consumed = dot + 1;
+            if (dot + 1 < n)
+            {
+                scan.consumed++;
+                newlines++;
+            }
+            break;
+        }
+
+        // Stuffed line: leave out the leading '.'
+        pos = dot + 1;
+    }
+
+    // Every byte but newlines counts, plus one for each empty line
+    scan.bytes = (long long)(scan.consumed - newlines + empty);
+    return scan;
+}
@@ -0,0 +1,167 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#ifndef MAIL_READER
+#define MAIL_READER
+
+/**** CONSTANTS ****/
+#define READ_BLOCK_SIZE (1 << 20)
+#define SCAN_CHUNK_SIZE (1 << 20)
+
+// A mapped input gives back the pages behind it every this many bytes
+#define RELEASE_BLOCK_SIZE (16 << 20)
+
+/**** ENUMS ****/
+
+// Implementations of the DATA section scanner, picked at runtime
+enum ScanKernel
+{
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2
+};
+
+/**** TYPES ****/
+
+// Waits until the fd has input, doing the caller's other work meanwhile (see LineReader::setInputWait)
+typedef void (*InputWaitFn)(void *context, int fd);
+
+/**** STRUCTS ****/
+
+// A regular file input mapped from its read offset (see mapInput)
+struct MappedInput
+{
+    const char *data; // The bytes read() would have returned next, NULL if nothing is mapped
+    size_t length;
+    char *base;       // Page aligned start of the mapping, a little before data
+    size_t mapLength;
+    size_t released;  // Bytes from base handed back (see releaseInput)
+};
+
+struct BodyScan
+{
+    size_t consumed;  // Bytes of input used, including the terminator line
+    bool terminated;  // Whether the "." line was reached
+    long long bytes;  // Input size in mail-in's accounting (line lengths, 1 per empty line)
+};
+/**** CLASSES ****/
+
+/*
+Serves the lines of an input as views into one large buffer, with the same
+results as std::getline. Regular files are mapped whole from their offset
+(consumed parts are dropped from memory as reading goes on, so a huge input
+does not stay resident); pipes and terminals
+are read in READ_BLOCK_SIZE blocks, carrying a line that straddles two blocks
+over to the next one.
+*/
+class LineReader
+{
+public:
+    /*
+    Input: (int) File descriptor to read (not closed by the reader).
+    */
+    explicit LineReader(int fd);
+
+    /*
+    Input: (const char*) Input already in memory, (size_t) Its length (kept by the caller, not released).
+    */
+    LineReader(const char *input, size_t length);
+
+    ~LineReader();
+
+    /*
+    Input: (std::string_view) Set to the next line, without its '\n'.
+    Output: (bool) False once the input is exhausted.
+    The view stays valid until the next call.
+    */
+    bool nextLine(std::string_view &line);
+
+    /*
+    Input: (std::string*) Body to append to, NULL to discard, (long long) Byte budget, (long long) Set to bytes used.
+    Output: (bool) Whether the terminating "." line was reached.
+    Consumes a DATA section (or a section being skipped) in bulk, appending the
+    un-stuffed body as whole ranges. Stops early once more than budget bytes
+    have been used; the caller tells that apart from end of input by bytes.
+    */
+    bool readBody(std::string *body, long long budget, long long &bytes);
+
+    /*
+    Input: (InputWaitFn) Called before every read of a pipe or terminal, NULL for none, (void*) Passed to it.
+    Lets mail-in keep its deliveries going while the input is quiet.
+    */
+    void setInputWait(InputWaitFn wait, void *context);
+
+private:
+    bool refill();
+    void releaseConsumed();
+    bool stopIfTruncated();
+
+    int fd;
+    bool eof;
+    InputWaitFn inputWait;
+    void *inputWaitContext;
+
+    // Mapped file, when the input is a regular file
+    MappedInput mapped;
+
+    // Block buffer otherwise, unread bytes are [start, end)
+    std::vector<char> buffer;
+
+    const char *data;
+    size_t start;
+    size_t end;
+};
+
+/**** FUNCTIONS ****/
+
+/*
+Input: (const char*) Input starting at a line start, (size_t) Length, (bool) Whether the input ends there, (std::string*) Body or NULL.
+Output: (BodyScan) How far the DATA section got.
+Scans for the "." terminator line and for stuffed ".x" lines with the active
+kernel and appends the un-stuffed body between them as ranges. Unless atEof,
+the input must end with a newline.
+*/
+BodyScan scanBody(const char *p, size_t n, bool atEof, std::string *body);
+
+/*
+Input: (int) Fd of a regular file.
+Output: (MappedInput) The file from the fd's offset to its end, data NULL if that is empty or
+        cannot be mapped (or another input is mapped); the fd's offset then stays where it was.
+Moves the fd's offset to the end, as reading the input would. Should the file shrink
+while it is mapped, the pages past its new end read as zeros instead of raising
+SIGBUS, and inputTruncated says so from then on.
+*/
+MappedInput mapInput(int fd);
+
+/*
+Input: (MappedInput) From mapInput, (size_t) Bytes of it that will not be read again.
+Drops them from memory, RELEASE_BLOCK_SIZE at a time. The mapping is private and never
+written, so pages are simply read from the file again should they be needed.
+*/
+void releaseInput(MappedInput &input, size_t consumed);
+
+/*
+Input: (MappedInput) From mapInput.
+Unmaps it.
+*/
+void unmapInput(MappedInput &input);
+
+/*
+Output: (bool) Whether a mapped input shrank while it was read: some bytes it was
+        read as were zeros, not the file's.
+*/
+bool inputTruncated();
+
+/*
+Output: (ScanKernel) Kernel scanBody uses: AVX2 or SSE2 when the CPU has it, scalar otherwise.
+*/
+ScanKernel activeScanKernel();
+
+/*
+Input: (ScanKernel) Kernel to use from now on.
+Output: (bool) False if this CPU or build cannot run it (nothing changes).
+Lets benchmarks compare the kernels.
+*/
+bool useScanKernel(ScanKernel kernel);
+
+#endif
@@ -0,0 +1,126 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string>
+#include "mail_utils.h"
+#include "mail_registry.h"
+
+MailboxRegistry::MailboxRegistry()
+{
+    mailFd = open(MAIL_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+Closes every cached directory fd.
+*/
+MailboxRegistry::~MailboxRegistry()
+{
+    for (auto &entry : dirFds)
+    {
+        if (entry.second >= 0)
+        {
+            close(entry.second);
+        }
+    }
+    if (mailFd >= 0)
+    {
+        close(mailFd);
+    }
+}
+
+/*
+Output: (bool) Whether ./mail could be listed.
+Records every mailbox directory for contains().
+*/
+bool MailboxRegistry::load()
+{
+    if (mailFd < 0)
+    {
+        return false;
+    }
+
+    // fdopendir takes ownership, give it its own descriptor
+    int fd = dup(mailFd);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        std::string_view name = entry->d_name;
+        if (!validMailboxChars(name) || name.length() > MAILBOX_NAME_MAX)
+        {
+            continue; // Also skips "." and ".."
+        }
+
+        bool isDir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            isDir = fstatat(mailFd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (isDir)
+        {
+            names.emplace_back(name);
+            known.insert(names.back());
+        }
+    }
+    closedir(dir);
+
+    return true;
+}
+
+/*
+Input: (std::string_view) Mailbox name.
+Output: (bool) Whether load() found a mailbox with that name.
+*/
+bool MailboxRegistry::contains(std::string_view name) const
+{
+    return known.count(name) != 0;
+}
+
+/*
+Input: (std::string) Mailbox name.
+Output: (int) Directory fd of the mailbox, -1 if it is not a valid, existing mailbox.
+Opened on first use and cached; the registry owns the fd.
+*/
+int MailboxRegistry::dirFd(const std::string &name)
+{
+    auto it = dirFds.find(name);
+    if (it != dirFds.end())
+    {
+        return it->second;
+    }
+
+    int fd = openDir(name);
+    if (fd >= 0)
+    {
+        dirFds[name] = fd; // Misses are not cached, the mailbox may be created later
+    }
+
+    return fd;
+}
+
+/*
+Input: (std::string) Mailbox name.
+Output: (int) A new directory fd of the mailbox, -1 if it is not a valid, existing mailbox.
+Not cached: the caller closes it. For a process that touches any number of mailboxes.
+*/
+int MailboxRegistry::openDir(const std::string &name) const
+{
+    // Must check valid mailbox characters first (no "..", no "/")
+    if (mailFd < 0 || !validMailboxChars(name) || name.length() > MAILBOX_NAME_MAX)
+    {
+        return -1;
+    }
+    return openat(mailFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
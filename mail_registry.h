@@ -0,0 +1,65 @@
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_set>
+#include <unordered_map>
+#ifndef MAIL_REGISTRY
+#define MAIL_REGISTRY
+
+/**** CONSTANTS ****/
+#define MAIL_DIR "./mail"
+
+/**** CLASSES ****/
+
+/*
+The mailboxes of the tree, looked up once instead of re-resolving
+"./mail/<name>" for every check. load() lists ./mail a single time for fast
+existence checks (mail-in). dirFd() keeps an open directory fd for every
+mailbox actually used, so scans and file creation inside it go through
+openat/fstatat relative to that fd and the mailbox that was checked is the
+one written to.
+*/
+class MailboxRegistry
+{
+public:
+    MailboxRegistry();
+
+    /*
+    Closes every cached directory fd.
+    */
+    ~MailboxRegistry();
+
+    /*
+    Output: (bool) Whether ./mail could be listed.
+    Records every mailbox directory for contains().
+    */
+    bool load();
+
+    /*
+    Input: (std::string_view) Mailbox name.
+    Output: (bool) Whether load() found a mailbox with that name.
+    */
+    bool contains(std::string_view name) const;
+
+    /*
+    Input: (std::string) Mailbox name.
+    Output: (int) Directory fd of the mailbox, -1 if it is not a valid, existing mailbox.
+    Opened on first use and cached; the registry owns the fd.
+    */
+    int dirFd(const std::string &name);
+
+    /*
+    Input: (std::string) Mailbox name.
+    Output: (int) A new directory fd of the mailbox, -1 if it is not a valid, existing mailbox.
+    Not cached: the caller closes it. For a process that touches any number of mailboxes.
+    */
+    int openDir(const std::string &name) const;
+
+private:
+    int mailFd;
+    std::deque<std::string> names;              // Stable storage for the views below
+    std::unordered_set<std::string_view> known;
+    std::unordered_map<std::string, int> dirFds;
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include <cstdint>
+#include <string>
+#include <iostream>
+#include "mail_stats.h"
+
+thread_local MailStats *activeStats = NULL;
+
+// Report names, in enum order
+static const char *COUNTER_NAMES[STAT_COUNTER_COUNT] = {
+    "bytes_read",
+    "messages_parsed",
+    "messages_truncated",
+    "rejected_empty_control_line",
+    "rejected_mail_from_format",
+    "rejected_mail_from_mailbox",
+    "rejected_rcpt_to_format",
+    "rejected_no_recipients",
+    "recipients_dropped",
+    "deliveries_exec",
+    "deliveries_daemon",
+    "recipients_failed",
+    "group_commits",
+    "out_messages",
+    "out_bytes_written",
+    "out_next_number_calls",
+    "out_sequence_rebuilds",
+    "out_links",
+    "out_copies",
+    "out_blob_stores",
+    "out_blob_hits",
+    "out_compressed",
+    "out_compressed_raw_bytes",
+    "out_packed_appends",
+    "out_dir_syncs",
+};
+
+static const char *TIMER_NAMES[STAT_TIMER_COUNT] = {
+    "total_ns",
+    "spawn_ns",
+    "pipe_write_ns",
+    "delivery_wait_ns",
+    "commit_ns",
+    "out_receive_ns",
+    "out_next_number_ns",
+    "out_file_write_ns",
+    "out_publish_ns",
+    "out_close_ns",
+    "out_sync_ns",
+    "out_compress_ns",
+    "out_summary_ns",
+};
+
+/*
+Input: (MailStats) Numbers to add to these.
+*/
+void MailStats::add(const MailStats &other)
+{
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++)
+    {
+        counters[i] += other.counters[i];
+    }
+    for (int i = 0; i < STAT_TIMER_COUNT; i++)
+    {
+        nanos[i] += other.nanos[i];
+    }
+}
+
+/*
+Output: (std::string) One JSON object, every counter and timer by name.
+*/
+std::string MailStats::json() const
+{
+    std::string out = "{";
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++)
+    {
+        out += std::string(i > 0 ? "," : "") + "\"" + COUNTER_NAMES[i] + "\":" + std::to_string(counters[i]);
+    }
+    for (int i = 0; i < STAT_TIMER_COUNT; i++)
+    {
+        out += std::string(",\"") + TIMER_NAMES[i] + "\":" + std::to_string(nanos[i]);
+    }
+    out += "}";
+    return out;
+}
+
+/*
+Input: (bool) Whether to record at all.
+*/
+StatsReport::StatsReport(bool enabled) : enabled(enabled), stats(), begin(std::chrono::steady_clock::now())
+{
+    if (enabled)
+    {
+        activeStats = &stats;
+    }
+}
+
+/*
+Prints the record, with TIME_TOTAL set to the object's lifetime.
+*/
+StatsReport::~StatsReport()
+{
+    if (!enabled)
+    {
+        return;
+    }
+
+    activeStats = NULL;
+    stats.nanos[TIME_TOTAL] = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+    std::cerr << stats.json() << std::endl;
+}
@@ -0,0 +1,163 @@
+#include <cstdint>
+#include <string>
+#include <chrono>
+#ifndef MAIL_STATS
+#define MAIL_STATS
+
+/**** CONSTANTS ****/
+
+// Set (to anything) to turn statistics on, same as mail-in --stats
+#define MAIL_STATS_ENV "MAIL_STATS"
+
+/**** ENUMS ****/
+
+// Counts; see COUNTER_NAMES in mail_stats.cpp for what each one is called in the report
+enum StatCounter
+{
+    // mail-in
+    STAT_BYTES_READ,
+    STAT_MESSAGES_PARSED,
+    STAT_MESSAGES_TRUNCATED,
+    STAT_REJECT_EMPTY_CONTROL_LINE,
+    STAT_REJECT_MAIL_FROM_FORMAT,
+    STAT_REJECT_MAIL_FROM_MAILBOX,
+    STAT_REJECT_RCPT_TO_FORMAT,
+    STAT_REJECT_NO_RECIPIENTS,
+    STAT_RECIPIENTS_DROPPED,
+    STAT_DELIVERIES_EXEC,
+    STAT_DELIVERIES_DAEMON,
+    STAT_RECIPIENTS_FAILED,
+    STAT_GROUP_COMMITS,
+
+    // mail-out (reported back to mail-in and added up there)
+    STAT_OUT_MESSAGES,
+    STAT_OUT_BYTES_WRITTEN,
+    STAT_OUT_NEXT_NUMBER_CALLS,
+    STAT_OUT_SEQUENCE_REBUILDS,
+    STAT_OUT_LINKS,
+    STAT_OUT_COPIES,
+    STAT_OUT_BLOB_STORES,
+    STAT_OUT_BLOB_HITS,
+    STAT_OUT_COMPRESSED,
+    STAT_OUT_COMPRESSED_RAW_BYTES,
+    STAT_OUT_PACKED_APPENDS,
+    STAT_OUT_DIR_SYNCS, // Directories fsynced for FRAME_SYNC, the mailboxes included
+
+    STAT_COUNTER_COUNT
+};
+
+// Wall time, in nanoseconds
+enum StatTimer
+{
+    // mail-in
+    TIME_TOTAL,
+    TIME_SPAWN,         // posix_spawn of mail-out, or connecting to mail-outd
+    TIME_PIPE_WRITE,    // Sending frames to mail-out / mail-outd
+    TIME_DELIVERY_WAIT, // Blocked waiting for a delivery slot or for the end
+    TIME_COMMIT,        // Group commits (--sync group)
+
+    // mail-out
+    TIME_OUT_RECEIVE,
+    TIME_OUT_NEXT_NUMBER,
+    TIME_OUT_FILE_WRITE,
+    TIME_OUT_PUBLISH,
+    TIME_OUT_CLOSE,
+    TIME_OUT_SYNC,      // fdatasync/fsync for FRAME_SYNC
+    TIME_OUT_COMPRESS,  // Receiving and compressing a message (instead of out_file_write)
+    TIME_OUT_SUMMARY,   // Recording delivered messages in mailbox summaries
+
+    STAT_TIMER_COUNT
+};
+
+/**** STRUCTS ****/
+
+// Plain numbers only: mail-out sends it to mail-in as raw bytes after its statuses
+struct MailStats
+{
+    uint64_t counters[STAT_COUNTER_COUNT];
+    uint64_t nanos[STAT_TIMER_COUNT];
+
+    /*
+    Input: (MailStats) Numbers to add to these.
+    */
+    void add(const MailStats &other);
+
+    /*
+    Output: (std::string) One JSON object, every counter and timer by name.
+    */
+    std::string json() const;
+};
+
+/**** GLOBALS ****/
+
+// Where this thread records, NULL when statistics are off (every hook is then one branch)
+extern thread_local MailStats *activeStats;
+
+/**** FUNCTIONS ****/
+
+/*
+Input: (StatCounter) Counter, (uint64_t) Amount.
+*/
+inline void countStat(StatCounter counter, uint64_t amount = 1)
+{
+    if (activeStats != NULL)
+    {
+        activeStats->counters[counter] += amount;
+    }
+}
+
+/**** CLASSES ****/
+
+/*
+Adds the wall time between construction and destruction to a timer.
+Does not read the clock when statistics are off.
+*/
+class StageTimer
+{
+public:
+    explicit StageTimer(StatTimer timer) : timer(timer), stats(activeStats)
+    {
+        if (stats != NULL)
+        {
+            begin = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~StageTimer()
+    {
+        if (stats != NULL)
+        {
+            stats->nanos[timer] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+        }
+    }
+
+private:
+    StatTimer timer;
+    MailStats *stats;
+    std::chrono::steady_clock::time_point begin;
+};
+
+/*
+Records for the whole life of the object when enabled: points activeStats at
+its own MailStats and, when destroyed, prints them as one JSON line to stderr.
+*/
+class StatsReport
+{
+public:
+    /*
+    Input: (bool) Whether to record at all.
+    */
+    explicit StatsReport(bool enabled);
+
+    /*
+    Prints the record, with TIME_TOTAL set to the object's lifetime.
+    */
+    ~StatsReport();
+
+private:
+    bool enabled;
+    MailStats stats;
+    std::chrono::steady_clock::time_point begin;
+};
+
+#endif
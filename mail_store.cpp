@@ -0,0 +1,1391 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "mail_utils.h"
+#include "mail_store.h"
+#include "mail_packed.h"
+#include "mail_summary.h"
+#include "mail_registry.h"
+#include "mail_io.h"
+#include "mail_stats.h"
+
+/*
+Input: (int) Directory fd, (std::string) Name prefix for the file.
+Output: (StagedMessage) A new, uniquely named, empty file with STAGED_MODE, fd -1 on failure.
+O_EXCL makes the name ours; a name that is taken is retried with another one.
+*/
+static StagedMessage createNamed(int dir_fd, const std::string &prefix)
+{
+    static std::atomic<unsigned> counter(0); // mail-outd stages from several threads
+    for (int attempt = 0; attempt < MAX_PUBLISH_ATTEMPTS; attempt++)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        std::string name = prefix + std::to_string(getpid()) + "." + std::to_string(counter++) + "." + std::to_string(now.tv_nsec);
+
+        int fd = openat(dir_fd, name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, STAGED_MODE);
+        if (fd >= 0 && fchmod(fd, STAGED_MODE) != 0)
+        {
+            unlinkat(dir_fd, name.c_str(), 0);
+            close(fd);
+            break;
+        }
+        if (fd >= 0)
+        {
+            return StagedMessage{fd, dir_fd, name, 0, false};
+        }
+        if (errno != EEXIST)
+        {
+            break;
+        }
+    }
+
+    return StagedMessage{-1, AT_FDCWD, "", 0, false};
+}
+
+/*
+Output: (StagedMessage) An empty file in the tree's tmp/ with STAGED_MODE, fd -1 if tmp/ is unusable.
+Uses an unnamed O_TMPFILE, or a uniquely named file where that is unsupported.
+*/
+StagedMessage openStaged()
+{
+    StagedMessage staged{open(MAIL_TMP_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, STAGED_MODE), AT_FDCWD, "", 0, false};
+    if (staged.fd >= 0 && fchmod(staged.fd, STAGED_MODE) != 0)
+    {
+        close(staged.fd);
+        return StagedMessage{-1, AT_FDCWD, "", 0, false};
+    }
+    if (staged.fd < 0)
+    {
+        staged = createNamed(AT_FDCWD, std::string(MAIL_TMP_DIR) + "/" + STAGED_TMP_PREFIX);
+    }
+
+    return staged;
+}
+
+/*
+Input: (StagedMessage) From openStaged, (int) File descriptor to read from, (long long) Bytes to read.
+Output: (bool) Whether all of them were written to the staged file.
+Writes the message once so it can be linked into every recipient mailbox, moving it
+from the pipe or socket to the file without holding it in memory.
+*/
+bool stageFrom(StagedMessage &staged, int in_fd, long long length)
+{
+    StageTimer timer(TIME_OUT_FILE_WRITE);
+
+    // From a pipe (mail-out's stdin) the kernel moves the pages itself
+    bool can_splice = true;
+    while (can_splice && staged.size < length)
+    {
+        ssize_t n = splice(in_fd, NULL, staged.fd, NULL, length - staged.size, SPLICE_F_MOVE);
+        if (n > 0)
+        {
+            staged.size += n;
+        }
+        else if (n == 0)
+        {
+            return false; // Sender went away mid-message
+        }
+        else if (errno != EINTR)
+        {
+            can_splice = false; // A socket (mail-outd): copy through a buffer instead
+        }
+    }
+
+    std::vector<char> buffer(std::min((long long)STAGE_BUFFER_SIZE, length - staged.size));
+    while (staged.size < length)
+    {
+        size_t want = std::min((long long)buffer.size(), length - staged.size);
+        ssize_t n = read(in_fd, buffer.data(), want);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0 || !writeAll(staged.fd, buffer.data(), n))
+        {
+            return false;
+        }
+        staged.size += n;
+    }
+
+    countStat(STAT_OUT_BYTES_WRITTEN, staged.size);
+    return true;
+}
+
+/*
+Input: (StagedMessage) From openStaged, (int) File descriptor to read from, (long long) Bytes to read, (int) zlib level 1-9.
+Output: (bool) Whether all of them were compressed into the staged file.
+Like stageFrom, but the staged file is a StoredHeader and the zlib compressed message.
+Only a block at a time is held in memory.
+*/
+bool stageCompressed(StagedMessage &staged, int in_fd, long long length, int level)
+{
+    StageTimer timer(TIME_OUT_COMPRESS);
+
+    StoredHeader header;
+    memcpy(header.magic, STORED_MAGIC, sizeof(header.magic));
+    header.codec = STORED_CODEC_ZLIB;
+    header.length = length;
+    if (!writeAll(staged.fd, (const char *)&header, sizeof(header)))
+    {
+        return false;
+    }
+    staged.size = sizeof(header);
+
+    z_stream stream = z_stream();
+    if (deflateInit(&stream, std::min(std::max(level, Z_BEST_SPEED), Z_BEST_COMPRESSION)) != Z_OK)
+    {
+        return false;
+    }
+
+    std::vector<char> in(std::min((long long)COMPRESS_BLOCK, length));
+    std::vector<char> out(COMPRESS_BLOCK);
+    long long received = 0;
+    int status = Z_OK;
+    bool written = true;
+    while (written && status != Z_STREAM_END)
+    {
+        // Only read more once zlib has taken everything it was given
+        if (stream.avail_in == 0 && received < length)
+        {
+            ssize_t n = read(in_fd, in.data(), std::min((long long)in.size(), length - received));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                written = false; // Sender went away mid-message
+                break;
+            }
+            received += n;
+            stream.next_in = (Bytef *)in.data();
+            stream.avail_in = n;
+        }
+
+        stream.next_out = (Bytef *)out.data();
+        stream.avail_out = out.size();
+        status = deflate(&stream, received < length ? Z_NO_FLUSH : Z_FINISH);
+        size_t produced = out.size() - stream.avail_out;
+        written = status != Z_STREAM_ERROR && writeAll(staged.fd, out.data(), produced);
+        staged.size += produced;
+    }
+    deflateEnd(&stream);
+
+    countStat(STAT_OUT_BYTES_WRITTEN, staged.size);
+    countStat(STAT_OUT_COMPRESSED);
+    countStat(STAT_OUT_COMPRESSED_RAW_BYTES, received);
+    return written;
+}
+
+/*
+Input: (int) A stored message opened for reading, (int) File descriptor to write it to,
+       (long long) Where the message starts and (long long) its length, -1 for the rest of the file.
+Output: (bool) Whether the whole message was written, as mail-out received it.
+Reads raw and compressed messages alike, from a file of their own or a packed
+segment; a compressed one is checked against its zlib checksum and stated length.
+*/
+bool copyStored(int fd, int out_fd, long long offset, long long length)
+{
+    struct stat st;
+    if (length < 0)
+    {
+        length = fstat(fd, &st) == 0 ? st.st_size - offset : 0;
+    }
+    long long end = offset + length;
+
+    StoredHeader header;
+    bool compressed = length >= (long long)sizeof(header) && pread(fd, &header, sizeof(header), offset) == (ssize_t)sizeof(header) &&
+                      memcmp(header.magic, STORED_MAGIC, sizeof(header.magic)) == 0;
+    if (compressed && header.codec != STORED_CODEC_ZLIB)
+    {
+        return false;
+    }
+
+    std::vector<char> in(COMPRESS_BLOCK);
+    if (!compressed)
+    {
+        while (offset < end)
+        {
+            ssize_t n = pread(fd, in.data(), std::min((long long)in.size(), end - offset), offset);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0 || !writeAll(out_fd, in.data(), n))
+            {
+                return false;
+            }
+            offset += n;
+        }
+        return true;
+    }
+
+    z_stream stream = z_stream();
+    if (inflateInit(&stream) != Z_OK)
+    {
+        return false;
+    }
+
+    std::vector<char> out(COMPRESS_BLOCK);
+    uint64_t total = 0;
+    int status = Z_OK;
+    bool written = true;
+    offset += sizeof(header);
+    while (written && status != Z_STREAM_END)
+    {
+        if (stream.avail_in == 0)
+        {
+            ssize_t n = offset < end ? pread(fd, in.data(), std::min((long long)in.size(), end - offset), offset) : 0;
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                written = false; // Truncated stream
+                break;
+            }
+            offset += n;
+            stream.next_in = (Bytef *)in.data();
+            stream.avail_in = n;
+        }
+
+        stream.next_out = (Bytef *)out.data();
+        stream.avail_out = out.size();
+        status = inflate(&stream, Z_NO_FLUSH);
+        size_t produced = out.size() - stream.avail_out;
+        total += produced;
+        written = (status == Z_OK || status == Z_STREAM_END || status == Z_BUF_ERROR) && writeAll(out_fd, out.data(), produced);
+    }
+    inflateEnd(&stream);
+
+    return written && total == header.length;
+}
+
+/*
+Input: (int) A stored message opened for reading, (long long) Where it starts and (long long) its length, -1 for the rest of the file,
+       (size_t) Most bytes wanted, (std::string) Filled with the start of the message as mail-out received it.
+Output: (long long) Length of the whole message as mail-out received it, -1 if it cannot be read.
+Only inflates as much of a compressed message as the bytes wanted need.
+*/
+long long readStoredHead(int fd, long long offset, long long length, size_t max, std::string &head)
+{
+    struct stat st;
+    if (length < 0)
+    {
+        length = fstat(fd, &st) == 0 ? st.st_size - offset : 0;
+    }
+    head.clear();
+
+    StoredHeader header;
+    bool compressed = length >= (long long)sizeof(header) && pread(fd, &header, sizeof(header), offset) == (ssize_t)sizeof(header) &&
+                      memcmp(header.magic, STORED_MAGIC, sizeof(header.magic)) == 0;
+    if (!compressed)
+    {
+        head.resize(std::min((long long)max, length));
+        ssize_t n = head.empty() ? 0 : pread(fd, &head[0], head.size(), offset);
+        head.resize(std::max((ssize_t)0, n));
+        return n == (ssize_t)head.size() ? length : -1;
+    }
+    if (header.codec != STORED_CODEC_ZLIB)
+    {
+        return -1;
+    }
+
+    z_stream stream = z_stream();
+    if (inflateInit(&stream) != Z_OK)
+    {
+        return -1;
+    }
+
+    // A block of input at a time, until enough has come out
+    std::vector<char> in(std::min((long long)COMPRESS_BLOCK, length));
+    long long end = offset + length;
+    offset += sizeof(header);
+    head.resize(std::min((uint64_t)max, header.length));
+    stream.next_out = (Bytef *)&head[0];
+    stream.avail_out = head.size();
+    int status = Z_OK;
+    while (stream.avail_out > 0 && status == Z_OK)
+    {
+        ssize_t n = offset < end ? pread(fd, in.data(), std::min((long long)in.size(), end - offset), offset) : 0;
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break; // Truncated stream
+        }
+        offset += n;
+        stream.next_in = (Bytef *)in.data();
+        stream.avail_in = n;
+        status = inflate(&stream, Z_NO_FLUSH);
+    }
+    bool read = stream.avail_out == 0;
+    inflateEnd(&stream);
+
+    return read ? (long long)header.length : -1;
+}
+
+/*
+Input: (StagedMessage) A staged message.
+Closes the staged file and removes its tmp/ name, if it has one.
+*/
+void releaseStaged(StagedMessage &staged)
+{
+    StageTimer timer(TIME_OUT_CLOSE);
+    if (staged.fd >= 0)
+    {
+        close(staged.fd);
+    }
+    if (!staged.path.empty())
+    {
+        unlinkat(staged.dirFd, staged.path.c_str(), 0);
+    }
+    staged = StagedMessage{-1, AT_FDCWD, "", 0, false};
+}
+
+/*
+Input: (StagedMessage) A staged message.
+Output: (bool) False if it is durable and could not be flushed to disk.
+*/
+static bool flushStaged(const StagedMessage &staged)
+{
+    if (!staged.durable)
+    {
+        return true;
+    }
+
+    StageTimer timer(TIME_OUT_SYNC);
+    return fdatasync(staged.fd) == 0;
+}
+
+/*
+Input: (StagedMessage) Staged message, (int) Mailbox directory fd, (std::string) Full message, only used if nothing is staged.
+Output: (StagedMessage) A private copy staged inside the mailbox, fd -1 on failure.
+The dot name keeps it out of mailbox listings and scans until it is published.
+*/
+static StagedMessage stageCopy(const StagedMessage &staged, int mailbox_fd, const std::string &message)
+{
+    StagedMessage copy = createNamed(mailbox_fd, STAGED_COPY_PREFIX);
+    if (copy.fd < 0)
+    {
+        return copy;
+    }
+
+    StageTimer timer(TIME_OUT_FILE_WRITE);
+    countStat(STAT_OUT_COPIES);
+
+    bool written;
+    if (staged.fd < 0)
+    {
+        copy.size = message.size();
+        written = writeAll(copy.fd, message.data(), message.size());
+    }
+    else
+    {
+        // Copied in the kernel from the staged file
+        off_t offset = 0;
+        copy.size = staged.size;
+        written = true;
+        while (written && offset < copy.size)
+        {
+            ssize_t n = sendfile(copy.fd, staged.fd, &offset, copy.size - offset);
+            written = n > 0 || (n < 0 && errno == EINTR);
+        }
+    }
+    countStat(STAT_OUT_BYTES_WRITTEN, copy.size);
+
+    copy.durable = staged.durable;
+    if (!written || !flushStaged(copy))
+    {
+        releaseStaged(copy);
+    }
+
+    return copy;
+}
+
+// Where a staged message is hard linked from (linkat's first two arguments and flags)
+struct LinkSource
+{
+    int dirFd;
+    std::string path;
+    int flags;
+};
+
+/*
+Input: (StagedMessage) Staged message.
+Output: (LinkSource) What to pass linkat to give it a new name.
+*/
+static LinkSource linkSource(const StagedMessage &staged)
+{
+    if (!staged.path.empty())
+    {
+        return LinkSource{staged.dirFd, staged.path, 0};
+    }
+
+    // Name the unnamed file through /proc (AT_EMPTY_PATH would need CAP_DAC_READ_SEARCH)
+    return LinkSource{AT_FDCWD, "/proc/self/fd/" + std::to_string(staged.fd), AT_SYMLINK_FOLLOW};
+}
+
+/*
+Input: (StagedMessage) Staged message, (int) Mailbox directory fd, (std::string) Message name.
+Output: (int) 0 on success, -1 with errno set (EEXIST if the name is taken).
+*/
+static int linkStaged(const StagedMessage &staged, int mailbox_fd, const std::string &name)
+{
+    StageTimer timer(TIME_OUT_PUBLISH);
+    countStat(STAT_OUT_LINKS);
+    LinkSource source = linkSource(staged);
+    return linkMessage(source.dirFd, source.path, mailbox_fd, name, source.flags);
+}
+
+/*
+Input: (int) errno from a failed link.
+Output: (bool) Whether a copy could succeed where the link did not.
+*/
+static bool linkRefused(int err)
+{
+    switch (err)
+    {
+        case EXDEV:      // mail/ and tmp/ on different filesystems
+        case EPERM:      // hard links refused (protected_hardlinks, filesystem)
+        case EMLINK:     // link count limit reached
+        case ENOENT:     // no /proc
+        case EOPNOTSUPP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+Input: (StagedMessage) Staged message, (int) Mailbox directory fd, (std::string) Full message, only used if nothing is staged,
+       (std::vector<std::string>*) If not NULL, gets the fanout directories created on the way appended.
+Output: (uint64_t) Number the message was stored under, 0 on failure.
+Publishes the complete message under the mailbox's next number with a hard link,
+which never replaces an existing file; a taken number is retried with the next one.
+Where the link is not possible (nothing staged, other filesystem, permissions) a
+copy is staged inside the mailbox under a dot name and published the same way.
+Readers never see a partially written message.
+*/
+uint64_t publishMessage(const StagedMessage &staged, int mailbox_fd, const std::string &message, std::vector<std::string> *new_dirs)
+{
+    StagedMessage copy{-1, AT_FDCWD, "", 0, false};
+    if (staged.fd < 0)
+    {
+        copy = stageCopy(staged, mailbox_fd, message);
+        if (copy.fd < 0)
+        {
+            return 0;
+        }
+    }
+
+    uint64_t published = 0;
+    for (int attempt = 0; attempt < MAX_PUBLISH_ATTEMPTS && published == 0; attempt++)
+    {
+        // Get next message number in mailbox
+        std::string next_file_name = getNextNumber(mailbox_fd, new_dirs);
+
+        // Check if getNextNumber failed (should not have to worry about this)
+        if (next_file_name == "ERROR")
+        {
+            break;
+        }
+
+        if (linkStaged(copy.fd < 0 ? staged : copy, mailbox_fd, next_file_name) == 0)
+        {
+            published = messageNumber(next_file_name);
+        }
+        else if (errno == EEXIST)
+        {
+            continue; // Number taken by a writer that bypassed the sequence file
+        }
+        else if (copy.fd < 0 && linkRefused(errno))
+        {
+            copy = stageCopy(staged, mailbox_fd, message);
+            if (copy.fd < 0)
+            {
+                break;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    releaseStaged(copy);
+    return published;
+}
+
+/*
+Input: (StagedMessage) Staged message, (std::vector<int>) Mailbox directory fds,
+       (std::string) Full message if nothing is staged, (std::string) Statuses, MAIL_OUT_DELIVERED for the mailboxes to publish to,
+       (std::vector<uint64_t>) Set to the number each mailbox stored the message under,
+       (std::vector<std::vector<std::string>>) Gets the fanout directories created in each mailbox appended.
+Publishes like publishMessage, into every mailbox at once: each gets its next number,
+then all the links go out as one IoBatch (a single io_uring submission). Taken
+numbers are retried the same way; mailboxes the link cannot reach go through
+publishMessage's copy. A mailbox that fails is marked MAIL_OUT_FAILED.
+*/
+static void publishAll(const StagedMessage &staged, const std::vector<int> &mailbox_fds, const std::string &message, std::string &statuses,
+                       std::vector<uint64_t> &numbers, std::vector<std::vector<std::string>> &new_dirs)
+{
+    LinkSource source = linkSource(staged);
+
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < statuses.size(); i++)
+    {
+        if (statuses[i] == MAIL_OUT_DELIVERED)
+        {
+            pending.push_back(i);
+        }
+    }
+
+    IoBatch batch;
+    std::vector<std::string> names;
+    std::vector<std::string> leaves;
+    std::vector<int> dir_fds;
+    std::vector<size_t> linked;
+    for (int attempt = 0; attempt < MAX_PUBLISH_ATTEMPTS && !pending.empty(); attempt++)
+    {
+        // Names first: the batch keeps pointers into them
+        names.clear();
+        linked.clear();
+        for (size_t i : pending)
+        {
+            std::string next_file_name = getNextNumber(mailbox_fds[i], &new_dirs[i]);
+            if (next_file_name == "ERROR")
+            {
+                statuses[i] = MAIL_OUT_FAILED;
+                continue;
+            }
+            names.push_back(next_file_name);
+            linked.push_back(i);
+        }
+
+        // Fanout directories are opened without following links and held until the batch is done
+        // (one that cannot be opened fails its link with EBADF)
+        leaves.assign(linked.size(), "");
+        dir_fds.assign(linked.size(), -1);
+        batch.clear();
+        for (size_t k = 0; k < linked.size(); k++)
+        {
+            dir_fds[k] = openMessageDir(mailbox_fds[linked[k]], names[k], leaves[k]);
+            batch.linkat(source.dirFd, source.path.c_str(), dir_fds[k], leaves[k].c_str(), source.flags);
+        }
+        {
+            StageTimer timer(TIME_OUT_PUBLISH);
+            countStat(STAT_OUT_LINKS, linked.size());
+            batch.submit();
+        }
+        for (size_t k = 0; k < linked.size(); k++)
+        {
+            closeMessageDir(mailbox_fds[linked[k]], dir_fds[k]);
+        }
+
+        pending.clear();
+        for (size_t k = 0; k < linked.size(); k++)
+        {
+            size_t i = linked[k];
+            long err = -batch.result(k);
+            if (err == 0)
+            {
+                numbers[i] = messageNumber(names[k]);
+            }
+            else if (err == EEXIST)
+            {
+                pending.push_back(i); // Number taken by a writer that bypassed the sequence file
+            }
+            else if (!linkRefused(err) || (numbers[i] = publishMessage(staged, mailbox_fds[i], message, &new_dirs[i])) == 0)
+            {
+                statuses[i] = MAIL_OUT_FAILED;
+            }
+        }
+    }
+
+    for (size_t i : pending)
+    {
+        statuses[i] = MAIL_OUT_FAILED;
+    }
+}
+
+/*
+Input: (StagedMessage) Staged message, (std::vector<int>) Mailbox directory fds, (std::vector<bool>) Which of them are packed,
+       (std::string) Full message if nothing is staged, (std::string) Statuses, MAIL_OUT_DELIVERED for the mailboxes to publish to,
+       (std::vector<uint64_t>) Set to the number each mailbox stored the message under,
+       (std::vector<std::vector<std::string>>) Gets the fanout directories created in each mailbox appended.
+Publishes into every mailbox in its own layout: appended to the packed ones (see
+appendPacked), linked into the others like publishAll. A mailbox that fails is
+marked MAIL_OUT_FAILED.
+*/
+static void publishEverywhere(const StagedMessage &staged, const std::vector<int> &mailbox_fds, const std::vector<bool> &packed,
+                              const std::string &message, std::string &statuses, std::vector<uint64_t> &numbers,
+                              std::vector<std::vector<std::string>> &new_dirs)
+{
+    std::string linked = statuses;
+    for (size_t i = 0; i < statuses.size(); i++)
+    {
+        if (packed[i] && statuses[i] == MAIL_OUT_DELIVERED)
+        {
+            linked[i] = MAIL_OUT_FAILED;
+            numbers[i] = appendPacked(mailbox_fds[i], staged, message);
+            if (numbers[i] == 0)
+            {
+                statuses[i] = MAIL_OUT_FAILED;
+            }
+        }
+    }
+
+    if (staged.fd >= 0 && linked.find(MAIL_OUT_DELIVERED) != std::string::npos)
+    {
+        publishAll(staged, mailbox_fds, message, linked, numbers, new_dirs);
+    }
+    for (size_t i = 0; i < statuses.size(); i++)
+    {
+        if (staged.fd < 0 && linked[i] == MAIL_OUT_DELIVERED && (numbers[i] = publishMessage(staged, mailbox_fds[i], message, &new_dirs[i])) == 0)
+        {
+            linked[i] = MAIL_OUT_FAILED;
+        }
+        if (!packed[i])
+        {
+            statuses[i] = linked[i];
+        }
+    }
+}
+
+/*
+Input: (StagedMessage) A staged message body, (int) A blob opened for reading.
+Output: (bool) Whether the blob is a regular file holding exactly the same bytes.
+*/
+static bool sameBlob(const StagedMessage &body, int blob_fd)
+{
+    struct stat st;
+    bool same = fstat(blob_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == body.size;
+
+    // Both are normally in the page cache: compared a block at a time
+    std::vector<char> ours(same && body.size > 0 ? BLOB_COMPARE_BLOCK : 0);
+    std::vector<char> theirs(ours.size());
+    for (long long offset = 0; same && offset < body.size; offset += ours.size())
+    {
+        size_t len = std::min((long long)ours.size(), body.size - offset);
+        same = pread(body.fd, ours.data(), len, offset) == (ssize_t)len &&
+               pread(blob_fd, theirs.data(), len, offset) == (ssize_t)len &&
+               memcmp(ours.data(), theirs.data(), len) == 0;
+    }
+    return same;
+}
+
+/*
+Input: (int) File descriptor, (long long) Body length, (std::string) Path of the blob it
+       should match, (StagedMessage) Set to the body, (bool) Set to whether the blob matched.
+Output: (bool) Whether the whole body was received.
+A body that is already stored (the usual case for a duplicate) is compared with the
+blob as it arrives and never written anywhere; body then holds the blob open, with
+no path of its own. Otherwise (no blob, or the bytes differ) the body is staged in tmp/.
+*/
+static bool receiveBody(int in_fd, long long length, const std::string &blob, StagedMessage &body, bool &hit)
+{
+    StageTimer timer(TIME_OUT_FILE_WRITE);
+    bool durable = body.durable;
+    hit = false;
+    body = StagedMessage{open(blob.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC), AT_FDCWD, "", 0, durable};
+
+    struct stat st;
+    if (body.fd >= 0 && !(fstat(body.fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == length))
+    {
+        releaseStaged(body);
+    }
+
+    std::vector<char> ours(body.fd >= 0 ? std::min((long long)BLOB_COMPARE_BLOCK, length) : 0);
+    std::vector<char> theirs(ours.size());
+    long long matched = 0;
+    while (body.fd >= 0 && matched < length)
+    {
+        size_t len = std::min((long long)ours.size(), length - matched);
+        if (!readAll(in_fd, ours.data(), len))
+        {
+            releaseStaged(body);
+            return false;
+        }
+        if (pread(body.fd, theirs.data(), len, matched) == (ssize_t)len && memcmp(ours.data(), theirs.data(), len) == 0)
+        {
+            matched += len;
+            continue;
+        }
+
+        // Same hash, other bytes: the part that matched comes from the blob, the rest as usual
+        StagedMessage staged = openStaged();
+        staged.durable = durable;
+        off_t offset = 0;
+        bool written = staged.fd >= 0;
+        while (written && offset < matched)
+        {
+            ssize_t n = sendfile(staged.fd, body.fd, &offset, matched - offset);
+            written = n > 0 || (n < 0 && errno == EINTR);
+        }
+        written = written && writeAll(staged.fd, ours.data(), len);
+        releaseStaged(body);
+        body = staged;
+        body.size = matched + len;
+        if (!written)
+        {
+            releaseStaged(body);
+            return false;
+        }
+        return stageFrom(body, in_fd, length);
+    }
+
+    if (body.fd >= 0)
+    {
+        hit = true;
+        body.size = length;
+        return true;
+    }
+
+    body = openStaged();
+    body.durable = durable;
+    return body.fd >= 0 && stageFrom(body, in_fd, length);
+}
+
+/*
+Input: (StagedMessage) A staged message body, (std::string) Path it is to be stored under.
+Output: (std::string) Path of a blob with exactly these contents, "" if blobs/ is unusable.
+Links the staged file in as a new, read-only blob. When a concurrent delivery stored
+the same body first, its blob is used after comparing the contents.
+*/
+static std::string storeBlob(const StagedMessage &body, const std::string &path)
+{
+    StageTimer timer(TIME_OUT_PUBLISH);
+
+    // A blob is shared by every mailbox that links it: nobody may change it
+    if (fchmod(body.fd, 0444) != 0)
+    {
+        return "";
+    }
+
+    LinkSource source = linkSource(body);
+    if (linkat(source.dirFd, source.path.c_str(), AT_FDCWD, path.c_str(), source.flags) == 0)
+    {
+        countStat(STAT_OUT_BLOB_STORES);
+        if (body.durable)
+        {
+            int dir_fd = open(MAIL_BLOB_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            bool synced = dir_fd >= 0 && fsync(dir_fd) == 0;
+            if (dir_fd >= 0)
+            {
+                close(dir_fd);
+            }
+            if (!synced)
+            {
+                return "";
+            }
+        }
+        return path;
+    }
+    if (errno != EEXIST)
+    {
+        return ""; // No blobs/ (or another filesystem): stored whole
+    }
+
+    int blob_fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    bool same = blob_fd >= 0 && sameBlob(body, blob_fd);
+    if (blob_fd >= 0)
+    {
+        close(blob_fd);
+    }
+    if (same)
+    {
+        countStat(STAT_OUT_BLOB_HITS);
+        return path;
+    }
+    return ""; // A different body with the same hash: stored whole
+}
+
+/*
+Input: (std::string) Message name in a mailbox, fanout directories included.
+Output: (std::string) Name of its body link when it is in the single-instance store.
+*/
+std::string bodyLinkName(const std::string &name)
+{
+    // Next to the message, fanout directories included
+    size_t base = name.rfind('/') + 1;
+    return name.substr(0, base) + "." + name.substr(base) + BLOB_BODY_SUFFIX;
+}
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Existing name, (std::string) New name.
+Output: (bool) Whether the new name links the same file (made now, or by an earlier run).
+*/
+static bool linkSame(int mailbox_fd, const std::string &from, const std::string &to)
+{
+    std::string leaf;
+    int from_fd = openMessageDir(mailbox_fd, from, leaf);
+    int rc = from_fd < 0 ? -1 : linkMessage(from_fd, leaf, mailbox_fd, to, 0);
+    closeMessageDir(mailbox_fd, from_fd);
+    if (rc == 0)
+    {
+        return true;
+    }
+
+    struct stat a, b;
+    return errno == EEXIST && statMessage(mailbox_fd, from, a) == 0 && statMessage(mailbox_fd, to, b) == 0 &&
+           a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (long) Number of messages moved, -1 if the mailbox could not be switched or a message could not be moved.
+Switches a flat mailbox to the fanout layout while mail keeps arriving: new messages
+go to fanout names at once, then every flat message (and its body link) is linked
+under its fanout name before the flat name is removed, so findMessage finds it
+throughout. A second pass picks up deliveries that took a flat number just before
+the switch. Safe to run again after an interruption.
+*/
+long migrateFanout(int mailbox_fd)
+{
+    if (!enableFanout(mailbox_fd))
+    {
+        return -1;
+    }
+
+    long moved = 0;
+    bool failed = false;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (const auto &message : listMessages(mailbox_fd))
+        {
+            if (message.second.find('/') != std::string::npos)
+            {
+                continue;
+            }
+
+            std::string target = messageName(message.first, true);
+            std::string body = bodyLinkName(message.second);
+            struct stat st;
+            bool has_body = statMessage(mailbox_fd, body, st) == 0;
+            if (!makeFanoutDirs(mailbox_fd, target) || (has_body && !linkSame(mailbox_fd, body, bodyLinkName(target))) ||
+                !linkSame(mailbox_fd, message.second, target))
+            {
+                failed = true;
+                continue;
+            }
+            unlinkMessage(mailbox_fd, message.second, 0);
+            if (has_body)
+            {
+                unlinkMessage(mailbox_fd, body, 0);
+            }
+            moved++;
+        }
+    }
+    return failed ? -1 : moved;
+}
+
+/*
+Output: (long) Number of blobs removed, -1 if blobs/ cannot be listed.
+Removes the blobs no mailbox links to any more (link count 1). A delivery that
+loses its blob to a concurrent sweep stores the message whole instead.
+*/
+long sweepBlobs()
+{
+    DIR *dir = opendir(MAIL_BLOB_DIR);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    long removed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        if (entry->d_name[0] != '.' &&
+            fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 &&
+            unlinkat(dirfd(dir), entry->d_name, 0) == 0)
+        {
+            removed++;
+        }
+    }
+    closedir(dir);
+    return removed;
+}
+
+/*
+Input: (int) Directory fd, (const char*) Name prefix of its staged files.
+Output: (long) Number of them removed: those whose process (the pid after the prefix) is gone.
+*/
+static long sweepStagedIn(int dir_fd, const char *prefix)
+{
+    int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 0;
+    }
+
+    long removed = 0;
+    size_t prefix_length = strlen(prefix);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, prefix, prefix_length) != 0)
+        {
+            continue;
+        }
+
+        // kill(pid, 0) fails with ESRCH only once nothing runs under that pid
+        char *end;
+        long pid = strtol(entry->d_name + prefix_length, &end, 10);
+        if (pid > 0 && *end == '.' && kill(pid, 0) != 0 && errno == ESRCH && unlinkat(dirfd(dir), entry->d_name, 0) == 0)
+        {
+            removed++;
+        }
+    }
+    closedir(dir);
+    return removed;
+}
+
+/*
+Output: (long) Number of staged files removed.
+Removes the named staged files (STAGED_TMP_PREFIX in tmp/, STAGED_COPY_PREFIX in
+each mailbox) of processes that are gone, as a delivery killed mid-message leaves
+them. Files of running processes are kept.
+*/
+long sweepStaged()
+{
+    int tmp_fd = open(MAIL_TMP_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    long removed = tmp_fd < 0 ? 0 : sweepStagedIn(tmp_fd, STAGED_TMP_PREFIX);
+    if (tmp_fd >= 0)
+    {
+        close(tmp_fd);
+    }
+
+    DIR *mail = opendir(MAIL_DIR);
+    if (mail == NULL)
+    {
+        return removed;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(mail)) != NULL)
+    {
+        int mailbox_fd = entry->d_name[0] == '.' ? -1 : openat(dirfd(mail), entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (mailbox_fd >= 0)
+        {
+            removed += sweepStagedIn(mailbox_fd, STAGED_COPY_PREFIX);
+            close(mailbox_fd);
+        }
+    }
+    closedir(mail);
+    return removed;
+}
+
+/*
+Input: (StagedMessage) Staged message headers, (std::string) Blob path of the body,
+       (std::vector<int>) Mailbox directory fds, (std::string) Statuses, MAIL_OUT_DELIVERED
+       for the mailboxes to publish to; those that cannot take the blob are set to MAIL_OUT_FAILED,
+       (std::vector<uint64_t>) Set to the number each mailbox stored the message under,
+       (std::vector<std::vector<std::string>>) Gets the fanout directories created in each mailbox appended.
+Publishes the message as N (the headers) plus .N.body (a link to the blob). The body
+link goes first, so a reader never finds a message without its body.
+*/
+static void publishWithBlob(const StagedMessage &headers, const std::string &blob, const std::vector<int> &mailbox_fds, std::string &statuses,
+                            std::vector<uint64_t> &numbers, std::vector<std::vector<std::string>> &new_dirs)
+{
+    for (size_t i = 0; i < statuses.size(); i++)
+    {
+        if (statuses[i] != MAIL_OUT_DELIVERED)
+        {
+            continue;
+        }
+
+        bool published = false;
+        for (int attempt = 0; attempt < MAX_PUBLISH_ATTEMPTS && !published; attempt++)
+        {
+            std::string next_file_name = getNextNumber(mailbox_fds[i], &new_dirs[i]);
+            if (next_file_name == "ERROR")
+            {
+                break;
+            }
+
+            std::string body_name = bodyLinkName(next_file_name);
+            StageTimer timer(TIME_OUT_PUBLISH);
+            countStat(STAT_OUT_LINKS);
+            if (linkMessage(AT_FDCWD, blob, mailbox_fds[i], body_name, 0) != 0)
+            {
+                if (errno == EEXIST)
+                {
+                    continue; // Left over from a delivery cut short, skip the number
+                }
+                break;
+            }
+            if (linkStaged(headers, mailbox_fds[i], next_file_name) == 0)
+            {
+                numbers[i] = messageNumber(next_file_name);
+                published = true;
+                continue;
+            }
+            int err = errno;
+            unlinkMessage(mailbox_fds[i], body_name, 0);
+            if (err != EEXIST)
+            {
+                break;
+            }
+        }
+
+        if (!published)
+        {
+            statuses[i] = MAIL_OUT_FAILED;
+        }
+    }
+}
+
+/*
+Input: (StagedMessage) Opened, empty staged file, (int) File descriptor, (long long) Length of the headers frame,
+       (std::vector<int>) Mailbox directory fds, (std::vector<bool>) Which of them are packed, (std::string) Statuses,
+       (std::vector<uint64_t>) Set to the number each mailbox stored the message under,
+       (std::vector<std::vector<std::string>>) Gets the fanout directories created in each mailbox appended,
+       (long long) Set to the whole message's length.
+Output: (bool) False if the message could not be received (every mailbox failed).
+Receives a FRAME_DEDUP message: the headers into staged, the body into the
+single-instance store (see receiveBody). Mailboxes the store cannot serve (no
+blobs/, other filesystem, a hash collision, packed mailboxes) get the whole message as usual.
+*/
+static bool deliverDeduped(StagedMessage &staged, int in_fd, long long length, const std::vector<int> &mailbox_fds,
+                           const std::vector<bool> &packed, std::string &statuses, std::vector<uint64_t> &numbers,
+                           std::vector<std::vector<std::string>> &new_dirs, long long &size)
+{
+    // The body frame starts with mail-in's hash of the body, which names its blob
+    FrameHeader body_header;
+    uint64_t hash = 0;
+    bool received = stageFrom(staged, in_fd, length) && receiveFrameHeader(in_fd, body_header) &&
+                    body_header.length >= sizeof(hash) && readAll(in_fd, (char *)&hash, sizeof(hash));
+
+    long long body_length = received ? body_header.length - sizeof(hash) : 0;
+    size = length + body_length;
+    char name[64];
+    snprintf(name, sizeof(name), "/%016llx-%lld", (unsigned long long)hash, body_length);
+    std::string path = std::string(MAIL_BLOB_DIR) + name;
+
+    StagedMessage body{-1, AT_FDCWD, "", 0, staged.durable};
+    // A blob hit is synced too: the delivery that wrote it may not have asked for durability
+    bool hit = false;
+    received = received && receiveBody(in_fd, body_length, path, body, hit) && flushStaged(staged) && flushStaged(body);
+    if (!received)
+    {
+        releaseStaged(body);
+        return false;
+    }
+
+    // Packed mailboxes hold whole messages only
+    std::string pending = statuses;
+    for (size_t i = 0; i < statuses.size(); i++)
+    {
+        if (packed[i])
+        {
+            statuses[i] = MAIL_OUT_FAILED;
+        }
+    }
+    std::string blob = hit ? path : storeBlob(body, path);
+    if (hit)
+    {
+        countStat(STAT_OUT_BLOB_HITS);
+    }
+    if (!blob.empty())
+    {
+        publishWithBlob(staged, blob, mailbox_fds, statuses, numbers, new_dirs);
+    }
+
+    // Mailboxes the blob could not go to get the whole message: headers and body
+    // joined into one more staged file, published as before
+    std::string whole(statuses.size(), MAIL_OUT_FAILED);
+    for (size_t i = 0; i < statuses.size(); i++)
+    {
+        if (pending[i] == MAIL_OUT_DELIVERED && (blob.empty() || statuses[i] == MAIL_OUT_FAILED))
+        {
+            whole[i] = MAIL_OUT_DELIVERED;
+        }
+    }
+    if (whole.find(MAIL_OUT_DELIVERED) != std::string::npos)
+    {
+        StagedMessage joined = openStaged();
+        joined.durable = staged.durable;
+        bool written = joined.fd >= 0;
+        for (const StagedMessage *part : {&staged, &body})
+        {
+            off_t offset = 0;
+            while (written && offset < part->size)
+            {
+                ssize_t n = sendfile(joined.fd, part->fd, &offset, part->size - offset);
+                written = n > 0 || (n < 0 && errno == EINTR);
+            }
+            joined.size += part->size;
+        }
+
+        std::string attempted = whole;
+        if (written && flushStaged(joined))
+        {
+            publishEverywhere(joined, mailbox_fds, packed, "", whole, numbers, new_dirs);
+        }
+        else
+        {
+            whole.assign(whole.size(), MAIL_OUT_FAILED);
+        }
+        for (size_t i = 0; i < statuses.size(); i++)
+        {
+            if (attempted[i] == MAIL_OUT_DELIVERED)
+            {
+                statuses[i] = whole[i];
+            }
+        }
+        releaseStaged(joined);
+    }
+
+    releaseStaged(body);
+    return true;
+}
+
+/*
+Input: (int) Mailbox directory fd, (std::vector<std::string>) Directories relative to it.
+Output: (bool) Whether every one of them was opened (never through a link) and synced.
+*/
+static bool syncDirs(int mailbox_fd, const std::vector<std::string> &dirs)
+{
+    bool synced = true;
+    for (const std::string &dir : dirs)
+    {
+        int fd = openBeneath(mailbox_fd, dir);
+        synced = fd >= 0 && fsync(fd) == 0 && synced;
+        countStat(STAT_OUT_DIR_SYNCS);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    return synced;
+}
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Number a message was just stored under,
+       (std::vector<std::string>) Fanout directories created while storing it.
+Output: (bool) Whether the directories below the mailbox that its name depends on are
+on disk: the one it was linked into (with its .N.body), and each new directory with
+its parent. The mailbox directory itself is left to the caller.
+*/
+static bool syncMessageDirs(int mailbox_fd, uint64_t number, const std::vector<std::string> &new_dirs)
+{
+    std::vector<std::string> dirs;
+    std::string name = findMessage(mailbox_fd, number);
+    size_t slash = name.rfind('/');
+    if (slash != std::string::npos)
+    {
+        dirs.push_back(name.substr(0, slash));
+    }
+    for (const std::string &dir : new_dirs)
+    {
+        dirs.push_back(dir);
+        size_t up = dir.rfind('/');
+        if (up != std::string::npos)
+        {
+            dirs.push_back(dir.substr(0, up));
+        }
+    }
+    std::sort(dirs.begin(), dirs.end());
+    dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+    return syncDirs(mailbox_fd, dirs);
+}
+
+/*
+Input: (int) File descriptor the framed message is read from, (std::vector<std::string>) Mailbox names.
+Output: (std::string) One MAIL_OUT_DELIVERED/MAIL_OUT_FAILED byte per mailbox, in order,
+followed by this delivery's raw MailStats when the frame has FRAME_WANT_STATS.
+Everything mail-out does for one message: checks the mailboxes, reads the message
+(only if some mailbox is valid) straight into a staged file and publishes it into
+each mailbox. Only when tmp/ is unusable is the message read into memory.
+With FRAME_SYNC a mailbox is only reported delivered once the message and its
+directory entry are on disk. With a FRAME_COMPRESS_* level the staged file is
+compressed (see stageCompressed), except under FRAME_DEDUP or without tmp/.
+Packed mailboxes get the message appended to their segments instead. Mailboxes
+with a summary (see mail_summary.h) get an entry for it once it is stored.
+*/
+std::string deliverMessage(int in_fd, const std::vector<std::string> &mailboxes)
+{
+    // Check the mail directories are valid; the fd opened here is the one written through
+    MailboxRegistry registry;
+    std::vector<int> mailbox_fds(mailboxes.size(), -1);
+    std::vector<bool> packed(mailboxes.size(), false);
+    std::string statuses(mailboxes.size(), MAIL_OUT_FAILED);
+    bool any_valid = false;
+    for (size_t i = 0; i < mailboxes.size(); i++)
+    {
+        mailbox_fds[i] = registry.dirFd(mailboxes[i]);
+        if (mailbox_fds[i] >= 0)
+        {
+            statuses[i] = MAIL_OUT_DELIVERED;
+            packed[i] = isPacked(mailbox_fds[i]);
+            any_valid = true;
+        }
+    }
+
+    // Nothing to read when no mailbox can take the message
+    if (!any_valid)
+    {
+        return statuses;
+    }
+
+    // Frame from mail-in (length checked against MAX_MSG_SIZE); the message follows it
+    FrameHeader header;
+    std::chrono::steady_clock::time_point receive_begin = std::chrono::steady_clock::now();
+    if (!receiveFrameHeader(in_fd, header))
+    {
+        return std::string(mailboxes.size(), MAIL_OUT_FAILED);
+    }
+
+    // Recording is on for this delivery only, when mail-in asked for it
+    MailStats stats = MailStats();
+    MailStats *previous_stats = activeStats;
+    if (header.flags & FRAME_WANT_STATS)
+    {
+        stats.counters[STAT_OUT_MESSAGES] = 1;
+        stats.nanos[TIME_OUT_RECEIVE] = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - receive_begin).count();
+        activeStats = &stats;
+    }
+
+    // Small messages stay raw: compressing them would not save a disk block
+    int level = (header.flags & FRAME_COMPRESS_MASK) >> FRAME_COMPRESS_SHIFT;
+    bool compress = level > 0 && header.length >= COMPRESS_MIN_SIZE;
+
+    // Packed mailboxes copy the message anyway: a small one for them alone is appended
+    // from memory, one pwrite per mailbox, without staging it first
+    bool all_packed = true;
+    for (size_t i = 0; i < mailboxes.size(); i++)
+    {
+        all_packed = all_packed && (statuses[i] != MAIL_OUT_DELIVERED || packed[i]);
+    }
+    bool from_memory = all_packed && !compress && !(header.flags & FRAME_DEDUP) && header.length <= PACKED_INLINE_MAX;
+
+    // Write the message once, every recipient gets its own name for it
+    std::string message;
+    std::vector<uint64_t> numbers(mailboxes.size(), 0);
+    std::vector<std::vector<std::string>> new_dirs(mailboxes.size());
+    long long size = header.length;
+    StagedMessage staged = from_memory ? StagedMessage{-1, AT_FDCWD, "", 0, false} : openStaged();
+    staged.durable = (header.flags & FRAME_SYNC) != 0;
+    if (staged.fd >= 0 && (header.flags & FRAME_DEDUP))
+    {
+        if (!deliverDeduped(staged, in_fd, header.length, mailbox_fds, packed, statuses, numbers, new_dirs, size))
+        {
+            statuses.assign(mailboxes.size(), MAIL_OUT_FAILED);
+        }
+    }
+    else if (staged.fd >= 0)
+    {
+        bool written = compress ? stageCompressed(staged, in_fd, header.length, level) : stageFrom(staged, in_fd, header.length);
+        if (written && flushStaged(staged))
+        {
+            publishEverywhere(staged, mailbox_fds, packed, message, statuses, numbers, new_dirs);
+        }
+        else
+        {
+            statuses.assign(mailboxes.size(), MAIL_OUT_FAILED);
+        }
+    }
+    else
+    {
+        // Nothing staged (packed mailboxes only, or tmp/ unusable): read it into memory, each mailbox gets its own copy
+        message.resize(header.length);
+        bool received = readAll(in_fd, &message[0], message.size());
+        FrameHeader body_header;
+        uint64_t hash;
+        if (received && (header.flags & FRAME_DEDUP))
+        {
+            // The body follows in a frame of its own, after its hash
+            size_t at = message.size();
+            received = receiveFrameHeader(in_fd, body_header) && body_header.length >= sizeof(hash) &&
+                       readAll(in_fd, (char *)&hash, sizeof(hash));
+            message.resize(received ? at + body_header.length - sizeof(hash) : at);
+            received = received && readAll(in_fd, &message[at], message.size() - at);
+        }
+        if (received)
+        {
+            size = message.size();
+            publishEverywhere(staged, mailbox_fds, packed, message, statuses, numbers, new_dirs);
+        }
+        else
+        {
+            statuses.assign(mailboxes.size(), MAIL_OUT_FAILED);
+        }
+    }
+
+    // Mailboxes with a summary get an entry for the message, read back from its start
+    std::vector<size_t> summarized;
+    for (size_t i = 0; i < mailboxes.size(); i++)
+    {
+        if (statuses[i] == MAIL_OUT_DELIVERED && numbers[i] > 0 && hasSummary(mailbox_fds[i]))
+        {
+            summarized.push_back(i);
+        }
+    }
+    if (!summarized.empty())
+    {
+        StageTimer timer(TIME_OUT_SUMMARY);
+        std::string head = message.substr(0, SUMMARY_HEAD_MAX);
+        if (staged.fd >= 0)
+        {
+            readSummaryHead(staged.fd, 0, staged.size, head);
+        }
+        SummaryEntry entry = makeSummary(head, size, time(NULL));
+        for (size_t i : summarized)
+        {
+            recordSummary(mailbox_fds[i], numbers[i], entry);
+        }
+    }
+
+    // The new names are only on disk once their directories are: in a fanout mailbox
+    // the one each was linked into, and any created for it, as well as the mailbox
+    if (staged.durable)
+    {
+        StageTimer timer(TIME_OUT_SYNC);
+        for (size_t i = 0; i < mailboxes.size(); i++)
+        {
+            if (statuses[i] != MAIL_OUT_DELIVERED)
+            {
+                continue;
+            }
+            bool synced = packed[i] || syncMessageDirs(mailbox_fds[i], numbers[i], new_dirs[i]);
+            countStat(STAT_OUT_DIR_SYNCS);
+            if (fsync(mailbox_fds[i]) != 0 || !synced)
+            {
+                statuses[i] = MAIL_OUT_FAILED;
+            }
+        }
+    }
+    releaseStaged(staged);
+
+    if (header.flags & FRAME_WANT_STATS)
+    {
+        activeStats = previous_stats;
+        statuses.append((const char *)&stats, sizeof(stats));
+    }
+    return statuses;
+}
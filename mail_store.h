@@ -0,0 +1,166 @@
+#include <string>
+#include <vector>
+#include <cstdint>
+#ifndef MAIL_STORE
+#define MAIL_STORE
+
+/**** CONSTANTS ****/
+#define MAX_PUBLISH_ATTEMPTS 16
+
+// Mode of every staged message, set whatever the umask of whoever ran mail-in: one
+// inode is linked into every recipient mailbox, so no recipient may write to it
+#define STAGED_MODE 0644
+
+// Names of staged files when they need one: in tmp/ where O_TMPFILE is unsupported, and
+// a private copy inside a mailbox where a link is not possible. The pid comes next.
+#define STAGED_TMP_PREFIX "mail-out."
+#define STAGED_COPY_PREFIX ".tmp."
+
+// Copy buffer for staging a message that cannot be spliced (from a socket)
+#define STAGE_BUFFER_SIZE (1 << 20)
+
+// Single-instance store: each distinct body once, named by hash and size. A message
+// stored this way is its headers as N plus a hard link to the blob as .N.body
+#define MAIL_BLOB_DIR "./blobs"
+#define BLOB_BODY_SUFFIX ".body"
+
+// Incoming bodies are checked against an existing blob this many bytes at a time
+#define BLOB_COMPARE_BLOCK (64 << 10)
+
+// Compressed storage (FRAME_COMPRESS_*): a stored message is either raw text, which
+// always starts with "From: ", or a StoredHeader followed by a zlib stream
+#define STORED_MAGIC "SMZ1"
+#define STORED_CODEC_ZLIB 1
+
+// Messages smaller than this are stored raw: they take a whole disk block either way
+#define COMPRESS_MIN_SIZE 4096
+
+// Bytes fed to zlib at a time, in either direction
+#define COMPRESS_BLOCK (256 << 10)
+
+/**** STRUCTS ****/
+
+// A fully written message waiting to be given its mailbox name(s)
+struct StagedMessage
+{
+    int fd;           // -1 if nothing is staged
+    int dirFd;        // Directory path is relative to (AT_FDCWD for tmp/)
+    std::string path; // Empty for an unnamed O_TMPFILE
+    long long size;   // Bytes written to it
+    bool durable;     // Flushed to disk before it is published (FRAME_SYNC), copies too
+};
+
+struct StoredHeader
+{
+    char magic[4];     // STORED_MAGIC, without the terminator
+    uint32_t codec;    // STORED_CODEC_*
+    uint64_t length;   // Bytes of the message once decompressed
+};
+
+/**** FUNCTIONS ****/
+
+/*
+Output: (StagedMessage) An empty file in the tree's tmp/ with STAGED_MODE, fd -1 if tmp/ is unusable.
+Uses an unnamed O_TMPFILE, or a uniquely named file where that is unsupported.
+*/
+StagedMessage openStaged();
+
+/*
+Input: (StagedMessage) From openStaged, (int) File descriptor to read from, (long long) Bytes to read.
+Output: (bool) Whether all of them were written to the staged file.
+Writes the message once so it can be linked into every recipient mailbox, moving it
+from the pipe or socket to the file without holding it in memory.
+*/
+bool stageFrom(StagedMessage &staged, int in_fd, long long length);
+
+/*
+Input: (StagedMessage) From openStaged, (int) File descriptor to read from, (long long) Bytes to read, (int) zlib level 1-9.
+Output: (bool) Whether all of them were compressed into the staged file.
+Like stageFrom, but the staged file is a StoredHeader and the zlib compressed message.
+Only a block at a time is held in memory.
+*/
+bool stageCompressed(StagedMessage &staged, int in_fd, long long length, int level);
+
+/*
+Input: (int) A stored message opened for reading, (int) File descriptor to write it to,
+       (long long) Where the message starts and (long long) its length, -1 for the rest of the file.
+Output: (bool) Whether the whole message was written, as mail-out received it.
+Reads raw and compressed messages alike, from a file of their own or a packed
+segment; a compressed one is checked against its zlib checksum and stated length.
+*/
+bool copyStored(int fd, int out_fd, long long offset = 0, long long length = -1);
+
+/*
+Input: (int) A stored message opened for reading, (long long) Where it starts and (long long) its length, -1 for the rest of the file,
+       (size_t) Most bytes wanted, (std::string) Filled with the start of the message as mail-out received it.
+Output: (long long) Length of the whole message as mail-out received it, -1 if it cannot be read.
+Only inflates as much of a compressed message as the bytes wanted need.
+*/
+long long readStoredHead(int fd, long long offset, long long length, size_t max, std::string &head);
+
+/*
+Input: (StagedMessage) A staged message.
+Closes the staged file and removes its tmp/ name, if it has one.
+*/
+void releaseStaged(StagedMessage &staged);
+
+/*
+Input: (StagedMessage) Staged message, (int) Mailbox directory fd, (std::string) Full message, only used if nothing is staged,
+       (std::vector<std::string>*) If not NULL, gets the fanout directories created on the way appended.
+Output: (uint64_t) Number the message was stored under, 0 on failure.
+Publishes the complete message under the mailbox's next number with a hard link,
+which never replaces an existing file; a taken number is retried with the next one.
+Where the link is not possible (nothing staged, other filesystem, permissions) a
+copy is staged inside the mailbox under a dot name and published the same way.
+Readers never see a partially written message.
+*/
+uint64_t publishMessage(const StagedMessage &staged, int mailbox_fd, const std::string &message, std::vector<std::string> *new_dirs = NULL);
+
+/*
+Input: (std::string) Message name in a mailbox, fanout directories included.
+Output: (std::string) Name of its body link when it is in the single-instance store.
+*/
+std::string bodyLinkName(const std::string &name);
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (long) Number of messages moved, -1 if the mailbox could not be switched or a message could not be moved.
+Switches a flat mailbox to the fanout layout while mail keeps arriving: new messages
+go to fanout names at once, then every flat message (and its body link) is linked
+under its fanout name before the flat name is removed, so findMessage finds it
+throughout. A second pass picks up deliveries that took a flat number just before
+the switch. Safe to run again after an interruption.
+*/
+long migrateFanout(int mailbox_fd);
+
+/*
+Output: (long) Number of blobs removed, -1 if blobs/ cannot be listed.
+Removes the blobs no mailbox links to any more (link count 1). A delivery that
+loses its blob to a concurrent sweep stores the message whole instead.
+*/
+long sweepBlobs();
+
+/*
+Output: (long) Number of staged files removed.
+Removes the named staged files (STAGED_TMP_PREFIX in tmp/, STAGED_COPY_PREFIX in
+each mailbox) of processes that are gone, as a delivery killed mid-message leaves
+them. Files of running processes are kept.
+*/
+long sweepStaged();
+
+/*
+Input: (int) File descriptor the framed message is read from, (std::vector<std::string>) Mailbox names.
+Output: (std::string) One MAIL_OUT_DELIVERED/MAIL_OUT_FAILED byte per mailbox, in order.
+Everything mail-out does for one message: checks the mailboxes, reads the message
+(only if some mailbox is valid) straight into a staged file and publishes it into
+each mailbox. Only when tmp/ is unusable is the message read into memory.
+With FRAME_SYNC a mailbox is only reported delivered once the message and its
+directory entry are on disk. With FRAME_DEDUP the body goes to the single-instance store.
+With a FRAME_COMPRESS_* level the message is stored compressed (see stageCompressed),
+except under FRAME_DEDUP or without tmp/. Packed mailboxes (see mail_packed.h) get
+the message appended to their segments instead. Mailboxes with a summary (see
+mail_summary.h) get an entry for it once it is stored.
+*/
+std::string deliverMessage(int in_fd, const std::vector<std::string> &mailboxes);
+
+#endif
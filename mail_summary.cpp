@@ -0,0 +1,417 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "mail_utils.h"
+#include "mail_store.h"
+#include "mail_packed.h"
+#include "mail_summary.h"
+
+/*
+Input: (int) Mailbox directory fd, (int) Open flags (O_RDONLY, O_WRONLY, O_RDWR | O_CREAT), (int) LOCK_SH or LOCK_EX.
+Output: (int) The mailbox's summary, open and locked, -1 if it has none.
+The lock is released when the descriptor is closed.
+*/
+static int lockSummary(int mailbox_fd, int flags, int operation)
+{
+    // Never a link, or a file planted by the mailbox owner
+    int fd = openMailboxFile(mailbox_fd, SUMMARY_FILE, flags, SUMMARY_MODE);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    while (flock(fd, operation) != 0)
+    {
+        if (errno != EINTR)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/*
+Input: (int) Open summary, (size_t) Set to the number of whole slots, the header's included.
+Output: (const SummaryEntry*) The slots mapped read-only, NULL if the summary is empty or has no valid header.
+*/
+static const SummaryEntry *mapEntries(int summary_fd, size_t &count)
+{
+    struct stat st;
+    count = fstat(summary_fd, &st) == 0 ? st.st_size / sizeof(SummaryEntry) : 0;
+    void *data = count > 0 ? mmap(NULL, count * sizeof(SummaryEntry), PROT_READ, MAP_SHARED, summary_fd, 0) : MAP_FAILED;
+    if (data == MAP_FAILED)
+    {
+        count = 0;
+        return NULL;
+    }
+
+    if (memcmp(((const SummaryHeader *)data)->magic, SUMMARY_MAGIC, 4) != 0)
+    {
+        munmap(data, count * sizeof(SummaryEntry));
+        count = 0;
+        return NULL;
+    }
+    return (const SummaryEntry *)data;
+}
+
+/*
+Input: (std::string_view) Rest of the message head, advanced past the line if it matches, (std::string_view) Header name and ": ".
+Output: (std::string_view) The header's value, empty if the next line is not that header.
+*/
+static std::string_view headerValue(std::string_view &rest, std::string_view name)
+{
+    if (rest.compare(0, name.size(), name) != 0)
+    {
+        return std::string_view();
+    }
+
+    size_t end = rest.find('\n');
+    std::string_view value = rest.substr(name.size(), end == std::string_view::npos ? std::string_view::npos : end - name.size());
+    rest.remove_prefix(end == std::string_view::npos ? rest.size() : end + 1);
+    return value;
+}
+
+/*
+Input: (std::string) Start of a message.
+Output: (std::string_view) Its From address, pointing into head.
+*/
+static std::string_view headSender(const std::string &head)
+{
+    std::string_view rest(head);
+    return headerValue(rest, "From: ");
+}
+
+/*
+Input: (std::string) Start of a message (see SUMMARY_HEAD_MAX), (uint64_t) Its whole length, (int64_t) Delivery time.
+Output: (SummaryEntry) Entry describing it, sender and recipients taken from its From and To lines.
+*/
+SummaryEntry makeSummary(const std::string &head, uint64_t size, int64_t time)
+{
+    SummaryEntry entry = SummaryEntry();
+    entry.size = size;
+    entry.time = time;
+    entry.flags = SUMMARY_PRESENT;
+
+    // "From: sender\nTo: a, b\n" as ipcHelper writes them
+    std::string_view rest(head);
+    std::string_view from = headerValue(rest, "From: ");
+    std::string_view to = headerValue(rest, "To: ");
+
+    memcpy(entry.sender, from.data(), std::min(from.size(), sizeof(entry.sender)));
+    if (from.size() > sizeof(entry.sender))
+    {
+        entry.flags |= SUMMARY_SENDER_CUT;
+    }
+
+    // Mailbox names never hold a comma
+    entry.recipients = to.empty() ? 0 : std::count(to.begin(), to.end(), ',') + 1;
+    return entry;
+}
+
+/*
+Input: (int) A stored or staged message opened for reading, (long long) Where it starts and (long long) its length, -1 for the rest of the file,
+       (std::string) Filled with its start, From and To lines included (see SUMMARY_HEAD_MAX).
+Output: (long long) Length of the whole message as mail-out received it, -1 if it cannot be read.
+*/
+long long readSummaryHead(int fd, long long offset, long long length, std::string &head)
+{
+    long long size = readStoredHead(fd, offset, length, SUMMARY_HEAD_FIRST, head);
+    if (size > (long long)head.size() && head.find("\n\n") == std::string::npos)
+    {
+        size = readStoredHead(fd, offset, length, SUMMARY_HEAD_MAX, head);
+    }
+    return size;
+}
+
+/*
+Input: (SummaryEntry) An entry.
+Output: (std::string) Its sender, as far as the entry holds it.
+*/
+std::string summarySender(const SummaryEntry &entry)
+{
+    return std::string(entry.sender, strnlen(entry.sender, sizeof(entry.sender)));
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (bool) Whether the mailbox has a summary for deliveries to keep up to date.
+*/
+bool hasSummary(int mailbox_fd)
+{
+    return faccessat(mailbox_fd, SUMMARY_FILE, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number, (SummaryEntry) Its entry.
+Output: (bool) Whether the entry was written to the mailbox's summary.
+Called once the message is stored, so a slot never describes a message that is not
+there yet. Not flushed to disk: a slot lost in a crash is put back by checkSummary.
+*/
+bool recordSummary(int mailbox_fd, uint64_t number, const SummaryEntry &entry)
+{
+    // Shared: deliveries write different slots, only a check needs the summary to itself
+    int fd = lockSummary(mailbox_fd, O_WRONLY, LOCK_SH);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool recorded = number > 0 && pwrite(fd, &entry, sizeof(entry), number * sizeof(entry)) == (ssize_t)sizeof(entry);
+    close(fd);
+    return recorded;
+}
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number.
+Output: (bool) Whether the mailbox has no summary or its slot for the message is now empty.
+*/
+bool clearSummary(int mailbox_fd, uint64_t number)
+{
+    int fd = lockSummary(mailbox_fd, O_RDWR, LOCK_SH);
+    if (fd < 0)
+    {
+        return errno == ENOENT;
+    }
+
+    // Slots past the end are empty already
+    SummaryEntry entry = SummaryEntry();
+    struct stat st;
+    bool cleared = number > 0 && fstat(fd, &st) == 0 &&
+                   ((off_t)(number * sizeof(entry)) >= st.st_size || pwrite(fd, &entry, sizeof(entry), number * sizeof(entry)) == (ssize_t)sizeof(entry));
+    close(fd);
+    return cleared;
+}
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Message name, (SummaryEntry) Filled from the message,
+       (std::string) Set to its whole From address.
+Output: (bool) Whether the message could be read.
+*/
+static bool summarizeFile(int mailbox_fd, const std::string &name, SummaryEntry &entry, std::string &sender)
+{
+    int fd = openMessage(mailbox_fd, name, O_RDONLY);
+    struct stat st;
+    std::string head;
+    long long size = fd >= 0 && fstat(fd, &st) == 0 ? readSummaryHead(fd, 0, st.st_size, head) : -1;
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (size < 0)
+    {
+        return false;
+    }
+
+    // A single-instance message's body is its body link
+    struct stat body;
+    if (statMessage(mailbox_fd, bodyLinkName(name), body) == 0)
+    {
+        size += body.st_size;
+    }
+
+    entry = makeSummary(head, size, st.st_mtime);
+    sender = headSender(head);
+    return true;
+}
+
+/*
+Input: (int) Packed mailbox directory fd, (uint64_t) Message number, (SummaryEntry) Filled from the message,
+       (std::string) Set to its whole From address.
+Output: (bool) Whether the message exists and could be read.
+*/
+static bool summarizePacked(int mailbox_fd, uint64_t number, SummaryEntry &entry, std::string &sender)
+{
+    PackedEntry packed;
+    int segment_fd = openPacked(mailbox_fd, number, packed);
+    struct stat st;
+    std::string head;
+    long long size = segment_fd >= 0 && fstat(segment_fd, &st) == 0 ? readSummaryHead(segment_fd, packed.offset, packed.length, head) : -1;
+    if (segment_fd >= 0)
+    {
+        close(segment_fd);
+    }
+    if (size < 0)
+    {
+        return false;
+    }
+
+    entry = makeSummary(head, size, st.st_mtime);
+    sender = headSender(head);
+    return true;
+}
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number, (SummaryEntry) Filled from the stored message,
+       (std::string) Set to its whole From address.
+Output: (bool) Whether the message exists and could be read.
+Reads the message itself (in any layout), not the summary: sender and size exactly,
+time from the file's modification time (a packed message gets its segment's).
+*/
+bool summarizeStored(int mailbox_fd, uint64_t number, SummaryEntry &entry, std::string &sender)
+{
+    if (isPacked(mailbox_fd))
+    {
+        return summarizePacked(mailbox_fd, number, entry, sender);
+    }
+
+    std::string name = findMessage(mailbox_fd, number);
+    return !name.empty() && summarizeFile(mailbox_fd, name, entry, sender);
+}
+
+/*
+Input: (int) Mailbox directory fd, (bool) Whether to rebuild every entry.
+Output: (long) Number of entries written or cleared, -1 on failure.
+Creates the summary if the mailbox has none, then compares it with the mailbox's
+listing: messages without an entry are read and given one, entries without a
+message are cleared. A full rebuild reads every message again. Only names are
+listed, so a check of an intact summary opens no message. Deliveries wait for it.
+*/
+long checkSummary(int mailbox_fd, bool full)
+{
+    int fd = lockSummary(mailbox_fd, O_RDWR | O_CREAT, LOCK_EX);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // A fresh header for a new, damaged or discarded summary; a torn last slot goes
+    SummaryHeader header;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    bool fresh = full || !ok || st.st_size < (off_t)sizeof(header) || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+                 memcmp(header.magic, SUMMARY_MAGIC, sizeof(header.magic)) != 0;
+    if (fresh)
+    {
+        header = SummaryHeader();
+        memcpy(header.magic, SUMMARY_MAGIC, sizeof(header.magic));
+        ok = ftruncate(fd, 0) == 0 && pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+    }
+    else if (st.st_size % sizeof(SummaryEntry) != 0)
+    {
+        ok = ftruncate(fd, st.st_size - st.st_size % sizeof(SummaryEntry)) == 0;
+    }
+
+    // Every message number in the mailbox, with its name unless it is packed
+    bool packed = isPacked(mailbox_fd);
+    std::vector<std::pair<uint64_t, std::string>> messages;
+    if (packed)
+    {
+        for (uint64_t number : listPacked(mailbox_fd))
+        {
+            messages.push_back(std::make_pair(number, std::string()));
+        }
+    }
+    else
+    {
+        messages = listMessages(mailbox_fd);
+    }
+
+    size_t count = 0;
+    const SummaryEntry *entries = ok ? mapEntries(fd, count) : NULL;
+    ok = ok && entries != NULL;
+    long changed = 0;
+
+    // Entries whose message is gone
+    SummaryEntry empty = SummaryEntry();
+    size_t k = 0;
+    for (uint64_t number = 1; ok && number < count; number++)
+    {
+        while (k < messages.size() && messages[k].first < number)
+        {
+            k++;
+        }
+        if ((entries[number].flags & SUMMARY_PRESENT) && (k == messages.size() || messages[k].first != number))
+        {
+            ok = pwrite(fd, &empty, sizeof(empty), number * sizeof(empty)) == (ssize_t)sizeof(empty);
+            changed++;
+        }
+    }
+
+    // Messages without an entry; one that cannot be read (removed meanwhile) gets none
+    for (size_t i = 0; ok && i < messages.size(); i++)
+    {
+        uint64_t number = messages[i].first;
+        if (number < count && (entries[number].flags & SUMMARY_PRESENT))
+        {
+            continue;
+        }
+
+        SummaryEntry entry;
+        std::string sender;
+        bool read = packed ? summarizePacked(mailbox_fd, number, entry, sender) : summarizeFile(mailbox_fd, messages[i].second, entry, sender);
+        if (read)
+        {
+            ok = pwrite(fd, &entry, sizeof(entry), number * sizeof(entry)) == (ssize_t)sizeof(entry);
+            changed++;
+        }
+    }
+
+    if (entries != NULL)
+    {
+        munmap((void *)entries, count * sizeof(SummaryEntry));
+    }
+    close(fd);
+    return ok ? changed : -1;
+}
+
+/*
+Input: (int) Mailbox directory fd.
+*/
+SummaryMap::SummaryMap(int mailbox_fd) : entries(NULL), count(0)
+{
+    fd = lockSummary(mailbox_fd, O_RDONLY, LOCK_SH);
+    if (fd >= 0)
+    {
+        entries = mapEntries(fd, count);
+    }
+}
+
+/*
+Unmaps the summary.
+*/
+SummaryMap::~SummaryMap()
+{
+    if (entries != NULL)
+    {
+        munmap((void *)entries, count * sizeof(SummaryEntry));
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+/*
+Output: (bool) Whether the mailbox has a valid summary.
+*/
+bool SummaryMap::valid() const
+{
+    return entries != NULL;
+}
+
+/*
+Output: (uint64_t) One past the highest message number with a slot.
+*/
+uint64_t SummaryMap::end() const
+{
+    return count;
+}
+
+/*
+Input: (uint64_t) Message number, 1 to end() - 1.
+Output: (SummaryEntry) Its slot; check SUMMARY_PRESENT.
+*/
+const SummaryEntry &SummaryMap::operator[](uint64_t number) const
+{
+    return entries[number];
+}
@@ -0,0 +1,149 @@
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#ifndef MAIL_SUMMARY
+#define MAIL_SUMMARY
+
+/**** CONSTANTS ****/
+
+// A mailbox holding this file has a summary of its messages, one SummaryEntry per
+// message number, kept up to date by mail-out so mail-list never opens a message
+#define SUMMARY_FILE ".summary"
+#define SUMMARY_MAGIC "SMS1"
+#define SUMMARY_MODE 0600
+
+// Bytes of a From address kept in an entry; longer ones are cut (SUMMARY_SENDER_CUT)
+#define SUMMARY_SENDER_MAX 104
+
+// Bytes read from the start of a message to summarize it; up to SUMMARY_HEAD_MAX when
+// its From and To lines go on past them
+#define SUMMARY_HEAD_FIRST 4096
+#define SUMMARY_HEAD_MAX (64 << 10)
+
+// SummaryEntry flags
+#define SUMMARY_PRESENT 0x1    // Slot describes a stored message (unset: no such message)
+#define SUMMARY_SENDER_CUT 0x2 // sender holds only the start of the From address
+
+/**** STRUCTS ****/
+
+// Slot N of the summary (at N * sizeof(SummaryEntry)) is message number N
+struct SummaryEntry
+{
+    uint64_t size;       // Bytes of the message as mail-out received it (before compression)
+    int64_t time;        // When it was delivered, seconds since the epoch
+    uint32_t recipients; // Addresses on its To line
+    uint32_t flags;      // SUMMARY_* bits
+    char sender[SUMMARY_SENDER_MAX]; // From address, NUL padded (unterminated when it fills the field)
+};
+
+// First slot of the summary
+struct SummaryHeader
+{
+    char magic[4];       // SUMMARY_MAGIC, without the terminator
+    uint32_t reserved0;
+    uint64_t reserved[(sizeof(SummaryEntry) - 8) / 8];
+};
+
+/**** FUNCTIONS ****/
+
+/*
+Input: (std::string) Start of a message (see SUMMARY_HEAD_MAX), (uint64_t) Its whole length, (int64_t) Delivery time.
+Output: (SummaryEntry) Entry describing it, sender and recipients taken from its From and To lines.
+*/
+SummaryEntry makeSummary(const std::string &head, uint64_t size, int64_t time);
+
+/*
+Input: (int) A stored or staged message opened for reading, (long long) Where it starts and (long long) its length, -1 for the rest of the file,
+       (std::string) Filled with its start, From and To lines included (see SUMMARY_HEAD_MAX).
+Output: (long long) Length of the whole message as mail-out received it, -1 if it cannot be read.
+*/
+long long readSummaryHead(int fd, long long offset, long long length, std::string &head);
+
+/*
+Input: (SummaryEntry) An entry.
+Output: (std::string) Its sender, as far as the entry holds it.
+*/
+std::string summarySender(const SummaryEntry &entry);
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (bool) Whether the mailbox has a summary for deliveries to keep up to date.
+*/
+bool hasSummary(int mailbox_fd);
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number, (SummaryEntry) Its entry.
+Output: (bool) Whether the entry was written to the mailbox's summary.
+Called once the message is stored, so a slot never describes a message that is not
+there yet. Not flushed to disk: a slot lost in a crash is put back by checkSummary.
+*/
+bool recordSummary(int mailbox_fd, uint64_t number, const SummaryEntry &entry);
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number.
+Output: (bool) Whether the mailbox has no summary or its slot for the message is now empty.
+*/
+bool clearSummary(int mailbox_fd, uint64_t number);
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number, (SummaryEntry) Filled from the stored message,
+       (std::string) Set to its whole From address.
+Output: (bool) Whether the message exists and could be read.
+Reads the message itself (in any layout), not the summary: sender and size exactly,
+time from the file's modification time (a packed message gets its segment's).
+*/
+bool summarizeStored(int mailbox_fd, uint64_t number, SummaryEntry &entry, std::string &sender);
+
+/*
+Input: (int) Mailbox directory fd, (bool) Whether to rebuild every entry.
+Output: (long) Number of entries written or cleared, -1 on failure.
+Creates the summary if the mailbox has none, then compares it with the mailbox's
+listing: messages without an entry are read and given one, entries without a
+message are cleared. A full rebuild reads every message again. Only names are
+listed, so a check of an intact summary opens no message. Deliveries wait for it.
+*/
+long checkSummary(int mailbox_fd, bool full);
+
+/**** CLASSES ****/
+
+/*
+Read-only view of a mailbox's summary, mapped into memory as it was when opened.
+Entries recorded later are not seen; a torn last slot is left out. Holds the
+summary's shared lock, so checkSummary waits for it (deliveries do not).
+*/
+class SummaryMap
+{
+public:
+    /*
+    Input: (int) Mailbox directory fd.
+    */
+    explicit SummaryMap(int mailbox_fd);
+
+    /*
+    Unmaps the summary.
+    */
+    ~SummaryMap();
+
+    /*
+    Output: (bool) Whether the mailbox has a valid summary.
+    */
+    bool valid() const;
+
+    /*
+    Output: (uint64_t) One past the highest message number with a slot.
+    */
+    uint64_t end() const;
+
+    /*
+    Input: (uint64_t) Message number, 1 to end() - 1.
+    Output: (SummaryEntry) Its slot; check SUMMARY_PRESENT.
+    */
+    const SummaryEntry &operator[](uint64_t number) const;
+
+private:
+    int fd;
+    const SummaryEntry *entries;
+    size_t count; // Slots mapped, the header's included
+};
+
+#endif
@@ -1,17 +1,70 @@
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <string>
 #include <filesystem>
 #include <iostream>
 #include <vector>
 #include <algorithm>
-#include <regex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NAME_X86 1
+#endif
 #include "mail_utils.h"
+#include "mail_stats.h"
 namespace fs = std::filesystem;
 
 #define MAILBOX_NAME_MAX 255
 #define MAIL_FROM_MAX 12
 #define RCPT_TO_MAX 10
 
+// Tries at opening a mailbox file that another process keeps creating and removing
+#define MAX_OPEN_ATTEMPTS 16
+
+/*
+Character classes of every byte, built at compile time so a check is one table lookup.
+Matches std::isalpha/std::isdigit in the "C" locale (the only one these programs run in):
+ASCII only, bytes >= 0x80 belong to no class.
+*/
+#define CHAR_ALPHA 0x1
+#define CHAR_DIGIT 0x2
+#define CHAR_MAILBOX 0x4 // Letters, digits, '+', '-' and '_'
+
+struct CharClassTable
+{
+    unsigned char map[256];
+
+    constexpr CharClassTable() : map()
+    {
+        for (int c = 0; c < 256; c++)
+        {
+            bool alpha = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+            bool digit = c >= '0' && c <= '9';
+            map[c] = (alpha ? CHAR_ALPHA : 0) | (digit ? CHAR_DIGIT : 0) |
+                     (alpha || digit || c == '+' || c == '-' || c == '_' ? CHAR_MAILBOX : 0);
+        }
+    }
+};
+
+static constexpr CharClassTable CHAR_CLASS;
+
+/*
+Input: (char) A character, (int) CHAR_* class bits.
+Output: (bool) Whether the character is in any of the classes.
+*/
+static inline bool charIs(char c, int classes)
+{
+    return (CHAR_CLASS.map[(unsigned char)c] & classes) != 0;
+}
+
 /*
 Input: (std::string) A string.
 Output: (boolean) Whether the string's characters are all alphabetic.
@@ -19,33 +72,190 @@ Gives back whether a string only has alphabetic characters.
 */
 bool isAlpha(const std::string &str)
 {
-    bool alpha = true;
-
     // Make sure string has a single char
     if (str.empty())
     {
-        alpha = false;
+        return false;
     }
 
     // Check incrementally that all characters are alphabetical
     for(char const &c : str)
     {
-        if( !alpha || !std::isalpha(c) )
+        if( !charIs(c, CHAR_ALPHA) )
         {
-            alpha = false;
-            break;
-        }        
+            return false;
+        }
     }
 
-    return alpha;
+    return true;
 }
 
 /*
-Input: (std::string) A string.
+Input: (const char*) Characters, (size_t) Count.
+Output: (size_t) Index of the first character outside the mailbox alphabet, or the count.
+*/
+static size_t mailboxSpanScalar(const char *p, size_t n)
+{
+    size_t i = 0;
+    while (i < n && charIs(p[i], CHAR_MAILBOX))
+    {
+        i++;
+    }
+    return i;
+}
+
+#ifdef NAME_X86
+/*
+SIMD versions of mailboxSpanScalar, 16 or 32 characters per step. A character is
+accepted if (c | 0x20) is in 'a'..'z', c is in '0'..'9', or c is '+', '-' or '_'.
+The ranges are tested with one signed compare each after shifting the range start to -128.
+*/
+
+/*
+Input: (const char*) 16 characters.
+Output: (unsigned) Bit i set if character i is in the mailbox alphabet.
+Inlined into both kernels, so the AVX2 one stays in VEX encoding for its tail
+(calling SSE2 code with the upper AVX state dirty costs more than the whole check).
+*/
+static inline __attribute__((always_inline)) unsigned mailboxMask16(const char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i alpha = _mm_cmplt_epi8(_mm_add_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8((char)(0x80 - 'a'))), _mm_set1_epi8((char)(0x80 + 26)));
+    __m128i digit = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - '0'))), _mm_set1_epi8((char)(0x80 + 10)));
+    __m128i other = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('+')), _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')), _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), other));
+}
+
+static size_t mailboxSpanSse2(const char *p, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        unsigned ok = mailboxMask16(p + i);
+        if (ok != 0xFFFF)
+        {
+            return i + __builtin_ctz(~ok);
+        }
+    }
+
+    return i + mailboxSpanScalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t mailboxSpanAvx2(const char *p, size_t n)
+{
+    const __m256i lowerBit = _mm256_set1_epi8(0x20);
+    const __m256i alphaBias = _mm256_set1_epi8((char)(0x80 - 'a'));
+    const __m256i alphaLimit = _mm256_set1_epi8((char)(0x80 + 26));
+    const __m256i digitBias = _mm256_set1_epi8((char)(0x80 - '0'));
+    const __m256i digitLimit = _mm256_set1_epi8((char)(0x80 + 10));
+    const __m256i plus = _mm256_set1_epi8('+');
+    const __m256i minus = _mm256_set1_epi8('-');
+    const __m256i underscore = _mm256_set1_epi8('_');
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i alpha = _mm256_cmpgt_epi8(alphaLimit, _mm256_add_epi8(_mm256_or_si256(v, lowerBit), alphaBias));
+        __m256i digit = _mm256_cmpgt_epi8(digitLimit, _mm256_add_epi8(v, digitBias));
+        __m256i other = _mm256_or_si256(_mm256_cmpeq_epi8(v, plus), _mm256_or_si256(_mm256_cmpeq_epi8(v, minus), _mm256_cmpeq_epi8(v, underscore)));
+        unsigned ok = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(alpha, digit), other));
+        if (ok != 0xFFFFFFFF)
+        {
+            return i + __builtin_ctz(~ok);
+        }
+    }
+
+    if (i + 16 <= n)
+    {
+        unsigned ok = mailboxMask16(p + i);
+        if (ok != 0xFFFF)
+        {
+            return i + __builtin_ctz(~ok);
+        }
+        i += 16;
+    }
+
+    return i + mailboxSpanScalar(p + i, n - i);
+}
+#endif
+
+typedef size_t (*MailboxSpanFn)(const char *p, size_t n);
+
+/*
+Output: (NameKernel) Widest mailbox character scan this CPU runs.
+*/
+static NameKernel detectNameKernel()
+{
+#ifdef NAME_X86
+    __builtin_cpu_init(); // May run before libgcc's own constructor
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return NAME_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return NAME_SSE2;
+    }
+#endif
+    return NAME_SCALAR;
+}
+
+/*
+Input: (NameKernel) A kernel.
+Output: (MailboxSpanFn) Its implementation.
+*/
+static MailboxSpanFn nameFunction(NameKernel kernel)
+{
+    switch (kernel)
+    {
+#ifdef NAME_X86
+        case NAME_AVX2:
+            return mailboxSpanAvx2;
+        case NAME_SSE2:
+            return mailboxSpanSse2;
+#endif
+        default:
+            return mailboxSpanScalar;
+    }
+}
+
+static NameKernel nameKernel = detectNameKernel();
+static MailboxSpanFn mailboxSpan = nameFunction(nameKernel);
+
+/*
+Output: (NameKernel) Kernel validMailboxChars uses: AVX2 or SSE2 when the CPU has it, scalar otherwise.
+*/
+NameKernel activeNameKernel()
+{
+    return nameKernel;
+}
+
+/*
+Input: (NameKernel) Kernel to use from now on.
+Output: (bool) False if this CPU or build cannot run it (nothing changes).
+Lets tests and benchmarks compare the kernels.
+*/
+bool useNameKernel(NameKernel kernel)
+{
+    if (kernel > detectNameKernel())
+    {
+        return false;
+    }
+
+    nameKernel = kernel;
+    mailboxSpan = nameFunction(kernel);
+    return true;
+}
+
+/*
+Input: (std::string_view) A string.
 Output: (boolean) Whether a string's characters are all valid mailbox chars.
 Checks whether characters are included in upper and lower case letters, digits, +, -, and _
+and that the first one is a letter.
 */
-bool validMailboxChars(const std::string &str)
+bool validMailboxChars(std::string_view str)
 {    
     if (str.empty())
     {
@@ -53,97 +263,157 @@ bool validMailboxChars(const std::string &str)
     }
 
     // First character must be alphabetic
-    if (!std::isalpha(str[0]))
+    if (!charIs(str[0], CHAR_ALPHA))
     {
         return false;
     }
 
-    for(char const &c : str)
+    return mailboxSpan(str.data(), str.size()) == str.size();
+}
+
+/*
+Lower case folding for ASCII letters, every other byte maps to itself.
+Built at compile time so keyword matching is a table lookup per byte.
+*/
+struct CaseFoldTable
+{
+    unsigned char map[256];
+
+    constexpr CaseFoldTable() : map()
     {
-        if (!std::isalpha(c) && 
-        !std::isdigit(c) && 
-        c != '+' && c != '-' && c != '_')
+        for (int c = 0; c < 256; c++)
         {
-            return false;
+            map[c] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
         }
     }
-
-    return true;
-}
+};
+static constexpr CaseFoldTable CASE_FOLD;
 
 /*
-Input: (std::string) Input line from mail-in parsed file.
-Output: (bool) Whether the line is in valid MAIL FROM format.
-Returns an indication of whether line is in correct MAIL FROM format.
+Input: (std::string_view) A line, (const char[]) Lower case keyword.
+Output: (bool) Whether the line starts with the keyword, ignoring letter case.
 */
-bool checkMailFrom(const std::string &line)
+template <std::size_t N>
+static constexpr bool matchKeyword(std::string_view line, const char (&keyword)[N])
 {
-    // Regex for MAIL FROM:<username>
-    std::regex mail_from_regex("^[mM][aA][iI][lL] [fF][rR][oO][mM]:<.{1,255}>$");
-
-    // Check characters do not exceed maximum possible length
-    if (line.length() > MAILBOX_NAME_MAX + MAIL_FROM_MAX)
+    if (line.size() < N - 1)
     {
         return false;
     }
 
-    // Check MAIL FROM:<username> format
-    if ( !std::regex_match(line, mail_from_regex) )
+    for (std::size_t i = 0; i < N - 1; i++)
     {
-        return false;
+        if (CASE_FOLD.map[(unsigned char)line[i]] != (unsigned char)keyword[i])
+        {
+            return false;
+        }
     }
 
     return true;
 }
 
 /*
-Input: (std::string) Input line from mail-in parsed file.
-Output: (bool) Whether the line is in valid DATA (delimiter) format.
-Returns an indication of whether line is in correct DATA format.
+Input: (std::string_view) Line after the "<", (std::string_view) Set to the mailbox.
+Output: (bool) Whether the rest is 1 to MAILBOX_NAME_MAX characters closed by a final ">".
+Mirrors ".{1,255}>$" (ECMAScript "." does not match line terminators).
 */
-bool checkDataDelimiter(const std::string &line)
+static bool matchBracketed(std::string_view rest, std::string_view &mailbox)
 {
-    // Regex for MAIL FROM:<username>
-    std::regex rgx("^[dD][aA][tT][aA]$");
-
-    // Check characters do not exceed maximum possible length
-    if (line.length() > MAILBOX_NAME_MAX + RCPT_TO_MAX)
+    if (rest.size() < 2 || rest.size() > MAILBOX_NAME_MAX + 1 || rest.back() != '>')
     {
         return false;
     }
 
-    // Check DATA format
-    if ( !std::regex_match(line, rgx) )
+    mailbox = rest.substr(0, rest.size() - 1);
+    for (char const &c : mailbox)
     {
-        return false;
+        if (c == '\n' || c == '\r')
+        {
+            return false;
+        }
     }
 
     return true;
 }
 
+static constexpr char MAIL_FROM_KEYWORD[] = "mail from:<";
+static constexpr char RCPT_TO_KEYWORD[] = "rcpt to:<";
+static constexpr char DATA_KEYWORD[] = "data";
+
 /*
-Input: (std::string) Input line from mail-in parsed file.
-Output: (bool) Whether the line is in valid RCPT TO format.
-Returns an indication of whether line is in correct RCPT TO format.
+Input: (std::string_view) Input line from mail-in parsed file, (std::string_view) Set to the bracketed mailbox.
+Output: (ControlLine) Which control line the line is, CONTROL_INVALID if none.
+Single pass over the line with compile time keyword tables. Accepts exactly what
+checkMailFrom, checkRcptTo and checkDataDelimiter accept. For MAIL FROM and RCPT TO
+the mailbox view points into line and equals extractUsername(line).
 */
-bool checkRcptTo(const std::string &line)
+ControlLine classifyControlLine(std::string_view line, std::string_view &mailbox)
 {
-    // Regex for MAIL FROM:<username>
-    std::regex rgx("^[rR][cC][pP][tT] [tT][oO]:<.{1,255}>$");
-
     // Check characters do not exceed maximum possible length
-    if (line.length() > MAILBOX_NAME_MAX + MAIL_FROM_MAX)
+    if (line.empty() || line.length() > MAILBOX_NAME_MAX + MAIL_FROM_MAX)
     {
-        return false;
+        return CONTROL_INVALID;
     }
 
-    // Check RCP TO:<username> format
-    if ( !std::regex_match(line, rgx) )
+    // The first letter alone decides which keyword can match
+    switch (CASE_FOLD.map[(unsigned char)line[0]])
     {
-        return false;
+        case 'm':
+            if (matchKeyword(line, MAIL_FROM_KEYWORD) &&
+                matchBracketed(line.substr(sizeof(MAIL_FROM_KEYWORD) - 1), mailbox))
+            {
+                return CONTROL_MAIL_FROM;
+            }
+            break;
+        case 'r':
+            if (matchKeyword(line, RCPT_TO_KEYWORD) &&
+                matchBracketed(line.substr(sizeof(RCPT_TO_KEYWORD) - 1), mailbox))
+            {
+                return CONTROL_RCPT_TO;
+            }
+            break;
+        case 'd':
+            if (line.size() == sizeof(DATA_KEYWORD) - 1 && matchKeyword(line, DATA_KEYWORD))
+            {
+                return CONTROL_DATA;
+            }
+            break;
     }
 
-    return true;
+    return CONTROL_INVALID;
+}
+
+/*
+Input: (std::string) Input line from mail-in parsed file.
+Output: (bool) Whether the line is in valid MAIL FROM format.
+Returns an indication of whether line is in correct MAIL FROM format.
+*/
+bool checkMailFrom(const std::string &line)
+{
+    std::string_view mailbox;
+    return classifyControlLine(line, mailbox) == CONTROL_MAIL_FROM;
+}
+
+/*
+Input: (std::string) Input line from mail-in parsed file.
+Output: (bool) Whether the line is in valid DATA (delimiter) format.
+Returns an indication of whether line is in correct DATA format.
+*/
+bool checkDataDelimiter(const std::string &line)
+{
+    std::string_view mailbox;
+    return classifyControlLine(line, mailbox) == CONTROL_DATA;
+}
+
+/*
+Input: (std::string) Input line from mail-in parsed file.
+Output: (bool) Whether the line is in valid RCPT TO format.
+Returns an indication of whether line is in correct RCPT TO format.
+*/
+bool checkRcptTo(const std::string &line)
+{
+    std::string_view mailbox;
+    return classifyControlLine(line, mailbox) == CONTROL_RCPT_TO;
 }
 
 /*
@@ -209,100 +479,169 @@ std::string extractUsername(const std::string &line)
     return username;
 }
 
-/* 
-Input: (std::string) Mailbox name.
-Output: (bool) Whether mailbox directory exists in system or not.
-Checks if mailbox path exists (used by mail-out)
+/*
+Input: (std::string) A string.
+Output: (boolean) Whether the string's characters are all numeric.
+Gives back whether a string only has numeric characters.
 */
-bool doesMailboxExist(const std::string &s)
+bool isNumeric(const std::string &str)
 {
-    // Must check valid mailbox characters first
-    if ( !validMailboxChars(s) )
+    for(char const &c : str)
     {
-        return false;
+        if( !charIs(c, CHAR_DIGIT) )
+        {
+            return false;
+        }
     }
 
-    std::string mail_prefix = "./mail/";
-    std::string mailbox_path = mail_prefix + s;
-    struct stat buffer;
-    return (stat (mailbox_path.c_str(), &buffer) == 0);
+    return true;
 }
 
 /*
-Input: (std::string) Mailbox name, (std::string) File name.
-Output: (std::string) Path to new writing new file.
-Gives back the appropriate path to write the new mailed file to.
+Input: (int) Directory fd, (dirent) One of its entries.
+Output: (bool) Whether the entry is a directory (never following a link).
 */
-std::string newMailPath(const std::string &mailbox_name, const std::string &file_name)
+static bool isDirectory(int dir_fd, const struct dirent *entry)
 {
-    const std::string mail_prefix = "./mail/";
-    std::string mailbox_path = mail_prefix + mailbox_name + "/" + file_name;
-    return mailbox_path;
+    if (entry->d_type != DT_UNKNOWN)
+    {
+        return entry->d_type == DT_DIR;
+    }
+
+    struct stat st;
+    return fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
 }
 
 /*
-Input: (std::string) A string.
-Output: (boolean) Whether the string's characters are all numeric.
-Gives back whether a string only has numeric characters.
+Input: (int) Directory fd, (std::string) Path of a directory relative to it, (bool) Whether to list directories or files,
+       (std::vector<uint64_t>) Filled with the numbers found, highest first.
+Output: (bool) Whether the directory could be listed.
+Only names that are all digits count; dot files and everything else are skipped.
 */
-bool isNumeric(const std::string &str)
+static bool listNumbers(int dir_fd, const std::string &path, bool dirs, std::vector<uint64_t> &numbers)
+{
+    int fd = openBeneath(dir_fd, path);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        if (entry->d_name[0] != '.' && len <= 19 && isNumeric(entry->d_name) && isDirectory(dirfd(dir), entry) == dirs)
+        {
+            numbers.push_back(std::strtoull(entry->d_name, NULL, 10));
+        }
+    }
+    closedir(dir);
+
+    std::sort(numbers.rbegin(), numbers.rend());
+    return true;
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (long long) Highest number in the mailbox's fanout directories, 0 if there is none.
+Only the highest directories holding a message are listed, not the whole tree.
+*/
+static long long scanHighestFanout(int mailbox_fd)
 {
-    return std::all_of(str.begin(), str.end(), ::isdigit);
+    std::vector<uint64_t> tops;
+    listNumbers(mailbox_fd, ".", true, tops);
+    for (uint64_t top : tops)
+    {
+        std::vector<uint64_t> mids;
+        listNumbers(mailbox_fd, std::to_string(top), true, mids);
+        for (uint64_t mid : mids)
+        {
+            char path[48];
+            snprintf(path, sizeof(path), "%llu/%03llu", (unsigned long long)top, (unsigned long long)mid);
+            std::vector<uint64_t> files;
+            if (listNumbers(mailbox_fd, path, false, files) && !files.empty())
+            {
+                return files[0];
+            }
+        }
+    }
+    return 0;
 }
 
 /* 
-Input:  (std::string) Mailbox name.
-Output: (std::string) Next message name in current mailbox.
-Checks the current highest numbering of the messages in the mailbox
-and returns the next number.
+Input:  (int) Mailbox directory fd, (bool) Whether the mailbox uses the fanout layout.
+Output: (long long) Highest message number in the mailbox (0 if empty), -1 on error.
+Scans the whole mailbox (flat messages, and the fanout directories if it uses them).
+Only used to rebuild a missing or corrupt sequence file.
 */
 std::string get_stem(const fs::path &p) { return (p.stem().string()); }
-std::string getNextNumber(const std::string &mailbox_name)
+static long long scanHighestNumber(int mailbox_fd, bool fanout)
 {
-    std::string mail_prefix = "./mail/";
-    std::string mailbox_path = mail_prefix + mailbox_name;
     std::vector<std::string> files;
 
-    // Iterate over the directory
-    for(const auto & entry : fs::directory_iterator(mailbox_path))
+    // Iterate over the directory (fdopendir owns the descriptor it is given)
+    int fd = dup(mailbox_fd);
+    DIR *dir = fd < 0 ? NULL : fdopendir(fd);
+    if (dir == NULL)
     {
-        try
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    rewinddir(dir);
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        // Dot files are mailbox bookkeeping (sequence file, staged copies), not messages
+        if (entry->d_name[0] == '.')
         {
-            files.push_back(get_stem(entry.path()));
+            continue;
         }
-        catch(...)
+
+        // Fanout directories are scanned below
+        if (fanout && isDirectory(dirfd(dir), entry))
         {
-            return "ERROR";
+            continue;
         }
+        files.push_back(get_stem(entry->d_name));
     }
+    closedir(dir);
 
     // Get the maximum number file
-    int max = 0;
+    long long max = fanout ? scanHighestFanout(mailbox_fd) : 0;
     for(std::string file_name : files)
     {
         // Check that file is appropriate length
         if (file_name.length() > 5)
         {
-            return "ERROR";
+            return -1;
         }
 
         // Check that file ONLY has numbers
         if (!isNumeric(file_name))
         {
-            return "ERROR";
+            return -1;
         }
         
         file_name.erase(0, file_name.find_first_not_of('0'));
-        int num;
+        long num;
 
         // Check that file can be converted to a number
         try
         {
-            num = std::stoi(file_name);
+            num = std::stol(file_name);
         }
         catch(std::invalid_argument &e)
         {
-            return "ERROR";
+            return -1;
         }
         
         if (num > max)
@@ -311,9 +650,16 @@ std::string getNextNumber(const std::string &mailbox_name)
         }
     }
 
-    // Format new file number in ##### format
-    int new_num = max + 1;
-    std::string num_str = std::to_string(new_num);
+    return max;
+}
+
+/*
+Input: (long) Message number.
+Output: (std::string) Number in ##### format.
+*/
+static std::string formatNumber(long num)
+{
+    std::string num_str = std::to_string(num);
     while(num_str.length() < 5)
     {
         num_str = "0" + num_str;
@@ -322,42 +668,808 @@ std::string getNextNumber(const std::string &mailbox_name)
     return num_str;
 }
 
-std::vector<std::string> ipcHelper(FullMessage fullMessage)
+/*
+Input: (int) Mailbox directory fd.
+Output: (bool) Whether new messages go to the fanout layout.
+*/
+bool isFanout(int mailbox_fd)
 {
-    std::vector<std::string> writeList;
-
-    // FROM line
-    std::string headerFrom;
-    headerFrom = "From: " + fullMessage.mailFrom + "\n";
-    writeList.push_back(headerFrom);
+    struct stat st;
+    return fstatat(mailbox_fd, MAILBOX_FANOUT_FILE, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid();
+}
 
-    // TO line
-    std::string headerTo = "To: ";
-    for (std::string rcpt : fullMessage.rcptTo)
+/*
+Input: (uint64_t) Message number, (bool) Whether it is in the fanout layout.
+Output: (std::string) Its name relative to the mailbox: ##### in the flat layout,
+TOP/MID/N in the fanout layout (see FANOUT_LEAF_SIZE).
+*/
+std::string messageName(uint64_t number, bool fanout)
+{
+    if (!fanout)
     {
-        headerTo = headerTo + rcpt + ", ";
+        return formatNumber(number);
     }
-    headerTo.pop_back();
-    headerTo.pop_back();
-    headerTo = headerTo + "\n";
-    writeList.push_back(headerTo);
 
-    // Line break character
-    writeList.push_back("\n");
+    char name[64];
+    snprintf(name, sizeof(name), "%llu/%03llu/%llu", (unsigned long long)(number / (FANOUT_LEAF_SIZE * FANOUT_LEAF_SIZE)),
+             (unsigned long long)(number / FANOUT_LEAF_SIZE % FANOUT_LEAF_SIZE), (unsigned long long)number);
+    return name;
+}
+
+/*
+Input: (std::string) Message name relative to the mailbox, in either layout.
+Output: (uint64_t) Its number, 0 if the name is not a message.
+*/
+uint64_t messageNumber(const std::string &name)
+{
+    std::string last = name.substr(name.rfind('/') + 1);
+    if (last.empty() || last.length() > 19 || !isNumeric(last))
+    {
+        return 0;
+    }
+    return std::strtoull(last.c_str(), NULL, 10);
+}
 
-    // Message lines
-    for(std::string msgLine : fullMessage.data)
+/*
+Input: (int) Directory fd, (std::string) Relative path of a directory below it ("." for itself).
+Output: (int) That directory, opened one component at a time without following a link, -1 on failure.
+The mailbox owner can swap any directory in the mailbox for a link; a path opened
+this way still never leaves the mailbox.
+*/
+int openBeneath(int dir_fd, const std::string &path)
+{
+    int fd = -1;
+    size_t start = 0;
+    while (start != std::string::npos)
     {
-        if ( msgLine == "\n")
+        size_t slash = path.find('/', start);
+        std::string component = path.substr(start, slash == std::string::npos ? std::string::npos : slash - start);
+        int next = -1;
+        if (component.empty() || component == "..")
         {
-            writeList.push_back("\n");
-        } 
+            errno = EINVAL;
+        }
         else
         {
-            std::string formattedMsg = msgLine + "\n";
-            writeList.push_back(formattedMsg);
+            next = openat(fd < 0 ? dir_fd : fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+
+        int err = errno;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        if (next < 0)
+        {
+            errno = err;
+            return -1;
         }
+        fd = next;
+        start = slash == std::string::npos ? slash : slash + 1;
+    }
+    return fd;
+}
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Message name relative to it, in either layout,
+       (std::string) Set to the name's last component.
+Output: (int) Directory holding the name, -1 on failure: the mailbox fd itself for a flat
+name, otherwise its fanout directory opened with openBeneath (close it with closeMessageDir).
+*/
+int openMessageDir(int mailbox_fd, const std::string &name, std::string &leaf)
+{
+    size_t slash = name.rfind('/');
+    if (slash == std::string::npos)
+    {
+        leaf = name;
+        return mailbox_fd;
     }
 
-    return writeList;
-}
\ No newline at end of file
+    leaf = name.substr(slash + 1);
+    return openBeneath(mailbox_fd, name.substr(0, slash));
+}
+
+/*
+Input: (int) Mailbox directory fd, (int) A directory from openMessageDir.
+*/
+void closeMessageDir(int mailbox_fd, int dir_fd)
+{
+    if (dir_fd >= 0 && dir_fd != mailbox_fd)
+    {
+        int err = errno; // Callers report the error of the call before
+        close(dir_fd);
+        errno = err;
+    }
+}
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Message name relative to it, (int) Open flags.
+Output: (int) The file, opened without following a link at any step, -1 with errno set on failure.
+*/
+int openMessage(int mailbox_fd, const std::string &name, int flags)
+{
+    std::string leaf;
+    int dir_fd = openMessageDir(mailbox_fd, name, leaf);
+    int fd = dir_fd < 0 ? -1 : openat(dir_fd, leaf.c_str(), flags | O_NOFOLLOW | O_CLOEXEC);
+    closeMessageDir(mailbox_fd, dir_fd);
+    return fd;
+}
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Message name relative to it, (struct stat) Filled in.
+Output: (int) 0 on success, -1 with errno set; no link is followed at any step.
+*/
+int statMessage(int mailbox_fd, const std::string &name, struct stat &st)
+{
+    std::string leaf;
+    int dir_fd = openMessageDir(mailbox_fd, name, leaf);
+    int rc = dir_fd < 0 ? -1 : fstatat(dir_fd, leaf.c_str(), &st, AT_SYMLINK_NOFOLLOW);
+    closeMessageDir(mailbox_fd, dir_fd);
+    return rc;
+}
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Name relative to it, (int) unlinkat flags (AT_REMOVEDIR).
+Output: (int) 0 on success, -1 with errno set; no link is followed at any step.
+*/
+int unlinkMessage(int mailbox_fd, const std::string &name, int flags)
+{
+    std::string leaf;
+    int dir_fd = openMessageDir(mailbox_fd, name, leaf);
+    int rc = dir_fd < 0 ? -1 : unlinkat(dir_fd, leaf.c_str(), flags);
+    closeMessageDir(mailbox_fd, dir_fd);
+    return rc;
+}
+
+/*
+Input: (int) Source directory fd, (std::string) Source path, (int) Mailbox directory fd,
+       (std::string) New message name relative to the mailbox, (int) linkat flags.
+Output: (int) 0 on success, -1 with errno set (EEXIST if the name is taken). The new
+name's directories are reached without following a link.
+*/
+int linkMessage(int from_fd, const std::string &from, int mailbox_fd, const std::string &name, int flags)
+{
+    std::string leaf;
+    int dir_fd = openMessageDir(mailbox_fd, name, leaf);
+    int rc = dir_fd < 0 ? -1 : linkat(from_fd, from.c_str(), dir_fd, leaf.c_str(), flags);
+    closeMessageDir(mailbox_fd, dir_fd);
+    return rc;
+}
+
+/*
+Input: (int) Mailbox directory fd, (std::string) A fanout message name,
+       (std::vector<std::string>*) If not NULL, gets each directory this call created appended,
+       relative to the mailbox, outermost first.
+Output: (bool) Whether its directories exist (created as needed, with the mailbox's owner and mode,
+never through a link). A new directory is only durable once it and its parent are synced.
+*/
+bool makeFanoutDirs(int mailbox_fd, const std::string &name, std::vector<std::string> *created)
+{
+    struct stat mailbox;
+    if (fstat(mailbox_fd, &mailbox) != 0)
+    {
+        return false;
+    }
+
+    // Each level is made in, and then opened from, the one above it
+    int fd = mailbox_fd;
+    bool made = true;
+    size_t start = 0;
+    for (size_t slash = name.find('/'); slash != std::string::npos && made; slash = name.find('/', start))
+    {
+        std::string component = name.substr(start, slash - start);
+        bool fresh = mkdirat(fd, component.c_str(), mailbox.st_mode & 07777) == 0;
+        made = fresh || errno == EEXIST;
+
+        int next = made ? openat(fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+
+        // Owned like the mailbox, so its user can manage the messages in it
+        made = next >= 0 && (!fresh || fchown(next, mailbox.st_uid, mailbox.st_gid) == 0);
+        if (made && fresh && created != NULL)
+        {
+            created->push_back(name.substr(0, slash));
+        }
+        if (fd != mailbox_fd)
+        {
+            close(fd);
+        }
+        fd = next;
+        start = slash + 1;
+    }
+    if (fd >= 0 && fd != mailbox_fd)
+    {
+        close(fd);
+    }
+    return made;
+}
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number.
+Output: (std::string) Name of the message in whichever layout holds it, "" if there is none.
+A message that is being migrated is found in one place or the other.
+*/
+std::string findMessage(int mailbox_fd, uint64_t number)
+{
+    // Fanout first: a migrated message is linked there before its flat name goes
+    std::string fanout = messageName(number, true);
+    std::string flat = messageName(number, false);
+    struct stat st;
+    if (statMessage(mailbox_fd, fanout, st) == 0 && S_ISREG(st.st_mode))
+    {
+        return fanout;
+    }
+    if (number <= FLAT_NUMBER_MAX && statMessage(mailbox_fd, flat, st) == 0 && S_ISREG(st.st_mode))
+    {
+        return flat;
+    }
+
+    // Moved between the two lookups
+    if (number <= FLAT_NUMBER_MAX && statMessage(mailbox_fd, fanout, st) == 0 && S_ISREG(st.st_mode))
+    {
+        return fanout;
+    }
+    return "";
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (std::vector<std::pair<uint64_t, std::string>>) Number and name of every message, in
+either layout, in number order.
+*/
+std::vector<std::pair<uint64_t, std::string>> listMessages(int mailbox_fd)
+{
+    std::vector<std::pair<uint64_t, std::string>> messages;
+
+    std::vector<uint64_t> numbers;
+    listNumbers(mailbox_fd, ".", false, numbers);
+    for (uint64_t number : numbers)
+    {
+        if (number > 0 && number <= FLAT_NUMBER_MAX)
+        {
+            messages.push_back(std::make_pair(number, formatNumber(number)));
+        }
+    }
+
+    std::vector<uint64_t> tops;
+    listNumbers(mailbox_fd, ".", true, tops);
+    for (uint64_t top : tops)
+    {
+        std::vector<uint64_t> mids;
+        listNumbers(mailbox_fd, std::to_string(top), true, mids);
+        for (uint64_t mid : mids)
+        {
+            char dir[48];
+            snprintf(dir, sizeof(dir), "%llu/%03llu", (unsigned long long)top, (unsigned long long)mid);
+            std::vector<uint64_t> files;
+            listNumbers(mailbox_fd, dir, false, files);
+            for (uint64_t number : files)
+            {
+                // Only where the layout puts it: anything else is not a message
+                std::string name = messageName(number, true);
+                if (name == std::string(dir) + "/" + std::to_string(number))
+                {
+                    messages.push_back(std::make_pair(number, name));
+                }
+            }
+        }
+    }
+
+    // A message caught mid-migration is in both places: listed once
+    std::sort(messages.begin(), messages.end());
+    messages.erase(std::unique(messages.begin(), messages.end(),
+                               [](const std::pair<uint64_t, std::string> &a, const std::pair<uint64_t, std::string> &b) { return a.first == b.first; }),
+                   messages.end());
+    return messages;
+}
+
+/*
+Input: (int) Open sequence file, (int) Mailbox directory fd, (bool) Whether the mailbox uses the fanout layout.
+Output: (long long) Last number handed out, -1 if the file is missing a valid value.
+The value is only trusted if the number after it is still free; otherwise
+something wrote to the mailbox without the sequence file and it must be rebuilt.
+*/
+static long long readSequence(int fd, int mailbox_fd, bool fanout)
+{
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n < 2 || buf[n - 1] != '\n')
+    {
+        return -1;
+    }
+
+    std::string value(buf, n - 1);
+    if (!isNumeric(value) || value.length() > (fanout ? 18 : 5))
+    {
+        return -1;
+    }
+
+    long long last = std::stoll(value);
+    struct stat buffer;
+    if (statMessage(mailbox_fd, messageName(last + 1, fanout), buffer) == 0 ||
+        (fanout && last + 1 <= FLAT_NUMBER_MAX && fstatat(mailbox_fd, formatNumber(last + 1).c_str(), &buffer, AT_SYMLINK_NOFOLLOW) == 0))
+    {
+        return -1;
+    }
+
+    return last;
+}
+
+/*
+Input: (int) Mailbox directory fd, whose sequence file the caller holds locked.
+Output: (bool) Whether the mailbox now uses the fanout layout.
+*/
+static bool markFanout(int mailbox_fd)
+{
+    // One the owner planted is refused, as isFanout would ignore it
+    int fd = openMailboxFile(mailbox_fd, MAILBOX_FANOUT_FILE, O_RDONLY | O_CREAT, MAILBOX_FANOUT_MODE);
+    if (fd < 0)
+    {
+        return false;
+    }
+    close(fd);
+    return fsync(mailbox_fd) == 0;
+}
+
+/*
+Input: (int) Directory fd, (const char*) Name in it, (int) Open flags: O_CREAT makes a missing file
+       (O_EXCL: only a new one), O_TRUNC empties it once it is checked, (mode_t) Mode of a new file.
+Output: (int) The file, open, -1 on failure or if it is not a file this process owns.
+For the files mail-out keeps in mailboxes their owners can write to (.seq, .summary,
+.index, segments). A link is never followed, and only a regular file with a single
+link, owned by our effective uid, is accepted, so a hard link the owner planted cannot
+send root's reads or writes anywhere else. A read-only open by a process without root
+(the mailbox owner running mail-tool cat) takes files of any owner, since it can only
+read what its own uid may. A new file is made with O_EXCL and given exactly the mode,
+whatever the umask.
+*/
+int openMailboxFile(int dir_fd, const char *name, int flags, mode_t mode)
+{
+    bool create = (flags & O_CREAT) != 0;
+    bool exclusive = (flags & O_EXCL) != 0;
+    bool truncate = (flags & O_TRUNC) != 0;
+    flags = (flags & ~(O_CREAT | O_EXCL | O_TRUNC)) | O_NOFOLLOW | O_CLOEXEC;
+
+    for (int attempt = 0; attempt < MAX_OPEN_ATTEMPTS; attempt++)
+    {
+        int fd = exclusive ? -1 : openat(dir_fd, name, flags);
+        bool created = false;
+        if (fd < 0 && create && (exclusive || errno == ENOENT))
+        {
+            fd = openat(dir_fd, name, flags | O_CREAT | O_EXCL, mode);
+            if (fd < 0 && errno == EEXIST && !exclusive)
+            {
+                continue; // Made meanwhile by another delivery: open that one
+            }
+            created = fd >= 0;
+        }
+        if (fd < 0)
+        {
+            return -1;
+        }
+
+        struct stat st;
+        bool anyOwner = (flags & O_ACCMODE) == O_RDONLY && geteuid() != 0;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink > 1 || (st.st_uid != geteuid() && !anyOwner) ||
+            (created && fchmod(fd, mode) != 0) || (truncate && ftruncate(fd, 0) != 0))
+        {
+            close(fd);
+            errno = EPERM;
+            return -1;
+        }
+        return fd;
+    }
+    return -1;
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (int) The mailbox's sequence file, open and exclusively locked, -1 on failure.
+The lock is released when the descriptor is closed.
+*/
+static int lockSequence(int mailbox_fd)
+{
+    int fd = openMailboxFile(mailbox_fd, MAILBOX_SEQ_FILE, O_RDWR | O_CREAT, MAILBOX_SEQ_MODE);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    while (flock(fd, LOCK_EX) != 0)
+    {
+        if (errno != EINTR)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (bool) Whether the mailbox now uses the fanout layout.
+Switches the mailbox over under its sequence lock: every number handed out after
+this is a fanout name. Messages already stored keep their flat names.
+*/
+bool enableFanout(int mailbox_fd)
+{
+    int fd = lockSequence(mailbox_fd);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool enabled = markFanout(mailbox_fd);
+    close(fd);
+    return enabled;
+}
+
+/* 
+Input:  (int) Mailbox directory fd, (std::vector<std::string>*) If not NULL, gets the fanout
+        directories created for the name appended (see makeFanoutDirs).
+Output: (std::string) Next message name in current mailbox, "ERROR" on failure.
+Hands out the next message number from the mailbox's sequence file under an
+exclusive lock, so concurrent mail-outs never get the same number and the cost
+does not grow with the mailbox. The number is reserved even if the delivery
+later fails. The file is rebuilt from a directory scan when missing or corrupt.
+A flat mailbox that runs out of 5-digit numbers switches to the fanout layout;
+in a fanout mailbox the name includes its directories, which are created here.
+*/
+std::string getNextNumber(int mailbox_fd, std::vector<std::string> *created_dirs)
+{
+    StageTimer timer(TIME_OUT_NEXT_NUMBER);
+    countStat(STAT_OUT_NEXT_NUMBER_CALLS);
+
+    int fd = lockSequence(mailbox_fd);
+    if (fd < 0)
+    {
+        return "ERROR";
+    }
+
+    // Decided under the lock, so a switch of layout never splits a number
+    bool fanout = isFanout(mailbox_fd);
+    long long last = readSequence(fd, mailbox_fd, fanout);
+    if (last < 0)
+    {
+        countStat(STAT_OUT_SEQUENCE_REBUILDS);
+        last = scanHighestNumber(mailbox_fd, fanout);
+    }
+
+    // Flat names only have room for 5 digits
+    long long new_num = last + 1;
+    if (last >= 0 && !fanout && new_num > FLAT_NUMBER_MAX)
+    {
+        fanout = markFanout(mailbox_fd);
+    }
+    if (last < 0 || (!fanout && new_num > FLAT_NUMBER_MAX))
+    {
+        close(fd);
+        return "ERROR";
+    }
+
+    std::string value = std::to_string(new_num) + "\n";
+    if (pwrite(fd, value.data(), value.size(), 0) != (ssize_t)value.size() || ftruncate(fd, value.size()) != 0)
+    {
+        close(fd);
+        return "ERROR";
+    }
+    close(fd);
+
+    std::string name = messageName(new_num, fanout);
+    if (fanout && !makeFanoutDirs(mailbox_fd, name, created_dirs))
+    {
+        return "ERROR";
+    }
+    return name;
+}
+
+/*
+Input: (FullMessage) A fully parsed message.
+Output: (std::string) Headers mail-out stores ahead of the body: From, To and a blank line.
+*/
+std::string ipcHelper(const FullMessage &fullMessage)
+{
+    std::string headers;
+
+    // FROM line
+    headers += "From: " + fullMessage.mailFrom + "\n";
+
+    // TO line
+    headers += "To: ";
+    for (size_t i = 0; i < fullMessage.rcptTo.size(); i++)
+    {
+        if (i > 0)
+        {
+            headers += ", ";
+        }
+        headers += fullMessage.rcptTo[i];
+    }
+    headers += "\n";
+
+    // Line break character
+    headers += "\n";
+
+    return headers;
+}
+
+/*
+Input: (int) File descriptor, (const char*) Data, (size_t) Length.
+Output: (bool) Whether every byte was written.
+*/
+bool writeAll(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/*
+Input: (int) File descriptor, (char*) Buffer, (size_t) Length.
+Output: (bool) Whether exactly len bytes were read before end of file.
+*/
+bool readAll(int fd, char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = read(fd, data, len);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/*
+Input: (int) File descriptor, (std::string) Message headers, (std::string) Message body, (uint32_t) FRAME_* flags.
+Output: (bool) Whether the whole frame was written.
+Sends a FrameHeader followed by headers and body with gathered writes, normally
+a single writev no matter how many lines the message has.
+*/
+bool sendFrame(int fd, const std::string &headers, const std::string &body, uint32_t flags)
+{
+    FrameHeader header;
+    memcpy(header.magic, FRAME_MAGIC, sizeof(header.magic));
+    header.flags = flags;
+    header.length = headers.size() + body.size();
+
+    struct iovec iov[3];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)headers.data();
+    iov[1].iov_len = headers.size();
+    iov[2].iov_base = (void *)body.data();
+    iov[2].iov_len = body.size();
+
+    int first = 0;
+    while (first < 3)
+    {
+        ssize_t n = writev(fd, iov + first, 3 - first);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+
+        // Skip what went out, a pipe may take less than everything
+        while (first < 3 && (size_t)n >= iov[first].iov_len)
+        {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < 3)
+        {
+            iov[first].iov_base = (char *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+
+    return true;
+}
+
+/*
+Input: (int) File descriptor, (std::string) Message headers, (int) Spool file, (long long) Bytes at its start,
+       (std::string) Rest of the body, (uint32_t) FRAME_* flags.
+Output: (bool) Whether the whole frame was written.
+Sends a frame whose message is the headers, the first spooled bytes of the spool
+file and then body. The spooled part goes out with sendfile, never through memory.
+*/
+bool sendSpooledFrame(int fd, const std::string &headers, int spool_fd, long long spooled, const std::string &body, uint32_t flags)
+{
+    FrameHeader header;
+    memcpy(header.magic, FRAME_MAGIC, sizeof(header.magic));
+    header.flags = flags;
+    header.length = headers.size() + spooled + body.size();
+
+    if (!writeAll(fd, (const char *)&header, sizeof(header)) || !writeAll(fd, headers.data(), headers.size()))
+    {
+        return false;
+    }
+
+    // Explicit offset: the spool file's own position is left alone
+    off_t offset = 0;
+    while (offset < spooled)
+    {
+        ssize_t n = sendfile(fd, spool_fd, &offset, spooled - offset);
+        if (n <= 0 && !(n < 0 && errno == EINTR))
+        {
+            return false;
+        }
+    }
+
+    return writeAll(fd, body.data(), body.size());
+}
+
+/*
+Input: (FullMessage) A message being read.
+Output: (bool) Whether the in-memory body could be moved to the spool file.
+Appends body to the message's spool file (created in tmp/ on first use) and empties it.
+*/
+bool spoolBody(FullMessage &fullMessage)
+{
+    if (fullMessage.spoolFd < 0)
+    {
+        fullMessage.spoolFd = open(MAIL_TMP_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+    if (fullMessage.spoolFd < 0)
+    {
+        // No O_TMPFILE: a named file, removed right away
+        std::string path = std::string(MAIL_TMP_DIR) + "/mail-in.XXXXXX";
+        fullMessage.spoolFd = mkostemp(&path[0], O_CLOEXEC);
+        if (fullMessage.spoolFd < 0)
+        {
+            return false;
+        }
+        unlink(path.c_str());
+    }
+
+    // Positioned writes: a reused spool file is simply overwritten from the start.
+    // Nothing changes on failure, the body stays in memory and is retried next time.
+    const char *data = fullMessage.body.data();
+    size_t left = fullMessage.body.size();
+    off_t offset = fullMessage.spooled;
+    while (left > 0)
+    {
+        ssize_t n = pwrite(fullMessage.spoolFd, data, left, offset);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        left -= n;
+        offset += n;
+    }
+
+    fullMessage.spooled = offset;
+    fullMessage.body.clear();
+    return true;
+}
+
+/*
+Input: (int) File descriptor, (FrameHeader) Filled with the header.
+Output: (bool) Whether a well formed header (magic, length within MAX_MSG_SIZE) was read.
+The message itself is left in the file descriptor for the caller.
+*/
+bool receiveFrameHeader(int fd, FrameHeader &header)
+{
+    if (!readAll(fd, (char *)&header, sizeof(header)))
+    {
+        return false;
+    }
+
+    return memcmp(header.magic, FRAME_MAGIC, sizeof(header.magic)) == 0 && header.length <= MAX_MSG_SIZE;
+}
+
+/*
+Input: (int) File descriptor, (std::string) Filled with the message, (uint32_t*) Set to the frame's flags if not NULL.
+Output: (bool) Whether a well formed frame was read.
+Reads one FrameHeader and exactly the message length it announces.
+*/
+bool receiveFrame(int fd, std::string &message, uint32_t *flags)
+{
+    FrameHeader header;
+    if (!receiveFrameHeader(fd, header))
+    {
+        return false;
+    }
+    if (flags != NULL)
+    {
+        *flags = header.flags;
+    }
+
+    message.resize(header.length);
+    return readAll(fd, &message[0], header.length);
+}
+
+#define BODY_HASH_K 0x9E3779B97F4A7C15ULL
+
+BodyHash::BodyHash() : lanes{BODY_HASH_K, BODY_HASH_K ^ 1, BODY_HASH_K ^ 2, BODY_HASH_K ^ 3}, tailLen(0), total(0)
+{
+}
+
+/*
+Input: (const char*) 32 bytes.
+*/
+void BodyHash::block(const char *p)
+{
+    for (int l = 0; l < 4; l++)
+    {
+        uint64_t w;
+        memcpy(&w, p + 8 * l, sizeof(w));
+        lanes[l] = (lanes[l] ^ w) * BODY_HASH_K;
+        lanes[l] ^= lanes[l] >> 29;
+    }
+}
+
+/*
+Input: (const char*) Bytes, (size_t) Length.
+*/
+void BodyHash::update(const char *p, size_t n)
+{
+    total += n;
+    if (tailLen > 0)
+    {
+        size_t take = std::min(n, sizeof(tail) - tailLen);
+        memcpy(tail + tailLen, p, take);
+        tailLen += take;
+        p += take;
+        n -= take;
+        if (tailLen < sizeof(tail))
+        {
+            return;
+        }
+        block(tail);
+        tailLen = 0;
+    }
+
+    for (; n >= sizeof(tail); p += sizeof(tail), n -= sizeof(tail))
+    {
+        block(p);
+    }
+    memcpy(tail, p, n);
+    tailLen = n;
+}
+
+/*
+Output: (uint64_t) Hash of everything given to update so far.
+*/
+uint64_t BodyHash::digest() const
+{
+    uint64_t h = total;
+    for (int l = 0; l < 4; l++)
+    {
+        h = (h ^ lanes[l]) * BODY_HASH_K;
+        h ^= h >> 31;
+    }
+    for (size_t i = 0; i < tailLen; i++)
+    {
+        h = (h ^ (unsigned char)tail[i]) * BODY_HASH_K;
+    }
+    return h ^ (h >> 32);
+}
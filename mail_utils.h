@@ -1,6 +1,9 @@
 #include <sys/stat.h>
 #include <string>
 #include <vector>
+#include <string_view>
+#include <utility>
+#include <cstdint>
 #ifndef MAIL_UTILS
 #define MAIL_UTILS
 
@@ -10,12 +13,85 @@
 #define RCPT_TO_MAX 10
 #define MAX_MSG_SIZE 1e9
 
+// Scratch files (staged messages, spooled bodies) live in the tree's tmp/
+#define MAIL_TMP_DIR "./tmp"
+
+// Default size a body may reach in memory before mail-in moves it to a spool file
+#define SPOOL_THRESHOLD (8 << 20)
+
+// Per-mailbox file holding the last message number handed out
+#define MAILBOX_SEQ_FILE ".seq"
+#define MAILBOX_SEQ_MODE 0600
+
+// Flat layout: message N is the file ##### in the mailbox, so N stops at 99999
+#define FLAT_NUMBER_MAX 99999
+
+// Fanout layout, for mailboxes holding this file: message N is TOP/MID/N with
+// TOP = N / 1000000 and MID = N / 1000 % 1000 (3 digits), so no directory below the
+// top holds more than this many entries and N can take 64 bits
+#define MAILBOX_FANOUT_FILE ".fanout"
+#define MAILBOX_FANOUT_MODE 0600
+#define FANOUT_LEAF_SIZE 1000
+
+// mail-in -> mail-out wire format: a FrameHeader, then length bytes of message
+#define FRAME_MAGIC "SMF1"
+#define FRAME_WANT_STATS 0x1 // mail-out appends its MailStats after the status bytes
+#define FRAME_SYNC 0x2       // mail-out flushes the message and mailboxes to disk before reporting
+#define FRAME_DEDUP 0x4      // Message is only the headers; a second frame holds the body's BodyHash digest, then the body
+#define FRAME_COMPRESS_SHIFT 8     // Bits 8-11: zlib level mail-out stores the message at, 0 to store it raw
+#define FRAME_COMPRESS_MASK 0xF00
+
+// mail-out reports one status byte per recipient, in argument order, on this fd
+#define MAIL_OUT_STATUS_FD 3
+#define MAIL_OUT_DELIVERED '0'
+#define MAIL_OUT_FAILED '1'
+
+// mail-outd, when running, takes deliveries on this socket instead of mail-in spawning mail-out
+#define MAIL_OUTD_SOCKET "./tmp/mail-outd.sock"
+
+/**** ENUMS ****/
+enum ControlLine
+{
+    CONTROL_INVALID,
+    CONTROL_MAIL_FROM,
+    CONTROL_RCPT_TO,
+    CONTROL_DATA
+};
+
+// Implementations of the mailbox name check, picked at runtime
+enum NameKernel
+{
+    NAME_SCALAR,
+    NAME_SSE2,
+    NAME_AVX2
+};
+
 /**** STRUCTS ****/
 struct FullMessage
 {
     std::string mailFrom;
     std::vector<std::string> rcptTo;
-    std::vector<std::string> data;
+    std::string body; // Un-stuffed data lines, each ending in '\n', in one buffer
+
+    // Large bodies: the first spooled bytes are in spoolFd, body holds the rest
+    int spoolFd = -1;       // Unnamed file in tmp/, opened on first use and kept
+    long long spooled = 0;
+
+    // Empties the message but keeps its buffers (and spool file) for the next one
+    void clear()
+    {
+        mailFrom.clear();
+        rcptTo.clear();
+        body.clear();
+        spooled = 0;
+    }
+};
+
+struct FrameHeader
+{
+    char magic[4];     // FRAME_MAGIC, without the terminator
+    uint32_t flags;    // FRAME_* bits, 0 for none
+    uint64_t length;   // Bytes of message following the header
 };
 
 /**** FUNCTIONS ****/
@@ -28,11 +104,33 @@ Gives back whether a string only has alphabetic characters.
 bool isAlpha(const std::string &str);
 
 /*
-Input: (std::string) A string.
+Input: (std::string_view) A string.
 Output: (boolean) Whether a string's characters are all valid mailbox chars.
 Checks whether characters are included in upper and lower case letters, digits, +, -, and _
+and that the first one is a letter.
+*/
+bool validMailboxChars(std::string_view str);
+
+/*
+Output: (NameKernel) Kernel validMailboxChars uses: AVX2 or SSE2 when the CPU has it, scalar otherwise.
+*/
+NameKernel activeNameKernel();
+
+/*
+Input: (NameKernel) Kernel to use from now on.
+Output: (bool) False if this CPU or build cannot run it (nothing changes).
+Lets tests and benchmarks compare the kernels.
+*/
+bool useNameKernel(NameKernel kernel);
+
+/*
+Input: (std::string_view) Input line from mail-in parsed file, (std::string_view) Set to the bracketed mailbox.
+Output: (ControlLine) Which control line the line is, CONTROL_INVALID if none.
+Single pass over the line with compile time keyword tables. Accepts exactly what
+checkMailFrom, checkRcptTo and checkDataDelimiter accept. For MAIL FROM and RCPT TO
+the mailbox view points into line and equals extractUsername(line).
 */
-bool validMailboxChars(const std::string &str);
+ControlLine classifyControlLine(std::string_view line, std::string_view &mailbox);
 
 /*
 Input: (std::string) Input line from mail-in parsed file.
@@ -62,13 +160,6 @@ Returns the username in the brackets.
 */
 std::string extractUsername(const std::string &line);
 
-/* 
-Input: (std::string) Mailbox name.
-Output: (bool) Whether mailbox directory exists in system or not.
-Checks if mailbox path exists (used by mail-out)
-*/
-bool doesMailboxExist(const std::string &s);
-
 /*
 Input: (std::string) A string.
 Output: (boolean) Whether the string's characters are all numeric.
@@ -77,20 +168,215 @@ Gives back whether a string only has numeric characters.
 bool isNumeric(const std::string &str);
 
 /*
-Input: (std::string) Mailbox name, (std::string) File name.
-Output: (std::string) Path to new writing new file.
-Gives back the appropriate path to write the new mailed file to.
+Input: (int) Mailbox directory fd.
+Output: (bool) Whether new messages go to the fanout layout: the mailbox holds a
+MAILBOX_FANOUT_FILE that our effective uid made, not one its owner planted.
+*/
+bool isFanout(int mailbox_fd);
+
+/*
+Input: (uint64_t) Message number, (bool) Whether it is in the fanout layout.
+Output: (std::string) Its name relative to the mailbox: ##### in the flat layout,
+TOP/MID/N in the fanout layout (see FANOUT_LEAF_SIZE).
+*/
+std::string messageName(uint64_t number, bool fanout);
+
+/*
+Input: (std::string) Message name relative to the mailbox, in either layout.
+Output: (uint64_t) Its number, 0 if the name is not a message.
+*/
+uint64_t messageNumber(const std::string &name);
+
+/*
+Input: (int) Directory fd, (std::string) Relative path of a directory below it ("." for itself).
+Output: (int) That directory, opened one component at a time without following a link, -1 on failure.
+The mailbox owner can swap any directory in the mailbox for a link; a path opened
+this way still never leaves the mailbox.
 */
-std::string newMailPath(const std::string &mailbox_name, const std::string &file_name);
+int openBeneath(int dir_fd, const std::string &path);
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Message name relative to it, in either layout,
+       (std::string) Set to the name's last component.
+Output: (int) Directory holding the name, -1 on failure: the mailbox fd itself for a flat
+name, otherwise its fanout directory opened with openBeneath (close it with closeMessageDir).
+*/
+int openMessageDir(int mailbox_fd, const std::string &name, std::string &leaf);
+
+/*
+Input: (int) Mailbox directory fd, (int) A directory from openMessageDir.
+*/
+void closeMessageDir(int mailbox_fd, int dir_fd);
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Message name relative to it, (int) Open flags.
+Output: (int) The file, opened without following a link at any step, -1 with errno set on failure.
+*/
+int openMessage(int mailbox_fd, const std::string &name, int flags);
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Message name relative to it, (struct stat) Filled in.
+Output: (int) 0 on success, -1 with errno set; no link is followed at any step.
+*/
+int statMessage(int mailbox_fd, const std::string &name, struct stat &st);
+
+/*
+Input: (int) Mailbox directory fd, (std::string) Name relative to it, (int) unlinkat flags (AT_REMOVEDIR).
+Output: (int) 0 on success, -1 with errno set; no link is followed at any step.
+*/
+int unlinkMessage(int mailbox_fd, const std::string &name, int flags);
+
+/*
+Input: (int) Source directory fd, (std::string) Source path, (int) Mailbox directory fd,
+       (std::string) New message name relative to the mailbox, (int) linkat flags.
+Output: (int) 0 on success, -1 with errno set (EEXIST if the name is taken). The new
+name's directories are reached without following a link.
+*/
+int linkMessage(int from_fd, const std::string &from, int mailbox_fd, const std::string &name, int flags);
+
+/*
+Input: (int) Mailbox directory fd, (std::string) A fanout message name,
+       (std::vector<std::string>*) If not NULL, gets each directory this call created appended,
+       relative to the mailbox, outermost first.
+Output: (bool) Whether its directories exist (created as needed, with the mailbox's owner and mode,
+never through a link). A new directory is only durable once it and its parent are synced.
+*/
+bool makeFanoutDirs(int mailbox_fd, const std::string &name, std::vector<std::string> *created = NULL);
+
+/*
+Input: (int) Mailbox directory fd, (uint64_t) Message number.
+Output: (std::string) Name of the message in whichever layout holds it, "" if there is none.
+A message that is being migrated is found in one place or the other.
+*/
+std::string findMessage(int mailbox_fd, uint64_t number);
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (std::vector<std::pair<uint64_t, std::string>>) Number and name of every message, in
+either layout, in number order.
+*/
+std::vector<std::pair<uint64_t, std::string>> listMessages(int mailbox_fd);
+
+/*
+Input: (int) Directory fd, (const char*) Name in it, (int) Open flags: O_CREAT makes a missing file
+       (O_EXCL: only a new one), O_TRUNC empties it once it is checked, (mode_t) Mode of a new file.
+Output: (int) The file, open, -1 on failure or if it is not a file this process owns.
+For the files mail-out keeps in mailboxes their owners can write to (.seq, .summary,
+.index, segments). A link is never followed, and only a regular file with a single
+link, owned by our effective uid, is accepted, so a hard link the owner planted cannot
+send root's reads or writes anywhere else. A read-only open by a process without root
+(the mailbox owner running mail-tool cat) takes files of any owner, since it can only
+read what its own uid may. A new file is made with O_EXCL and given exactly the mode,
+whatever the umask.
+*/
+int openMailboxFile(int dir_fd, const char *name, int flags, mode_t mode);
+
+/*
+Input: (int) Mailbox directory fd.
+Output: (bool) Whether the mailbox now uses the fanout layout.
+Switches the mailbox over under its sequence lock: every number handed out after
+this is a fanout name. Messages already stored keep their flat names.
+*/
+bool enableFanout(int mailbox_fd);
 
 /* 
-Input:  (std::string) Mailbox name.
-Output: (std::string) Next message name in current mailbox.
-Checks the current highest numbering of the messages in the mailbox
-and returns the next number.
+Input:  (int) Mailbox directory fd, (std::vector<std::string>*) If not NULL, gets the fanout
+        directories created for the name appended (see makeFanoutDirs).
+Output: (std::string) Next message name in current mailbox, "ERROR" on failure.
+Hands out the next message number from the mailbox's sequence file under an
+exclusive lock, so concurrent mail-outs never get the same number and the cost
+does not grow with the mailbox. The number is reserved even if the delivery
+later fails. The file is rebuilt from a directory scan when missing or corrupt.
+A flat mailbox that runs out of 5-digit numbers switches to the fanout layout;
+in a fanout mailbox the name includes its directories, which are created here.
 */
-std::string getNextNumber(const std::string &mailbox_name);
+std::string getNextNumber(int mailbox_fd, std::vector<std::string> *created_dirs = NULL);
 
-std::vector<std::string> ipcHelper(FullMessage fullMessage);
+/*
+Input: (FullMessage) A fully parsed message.
+Output: (std::string) Headers mail-out stores ahead of the body: From, To and a blank line.
+*/
+std::string ipcHelper(const FullMessage &fullMessage);
+
+/*
+Input: (int) File descriptor, (const char*) Data, (size_t) Length.
+Output: (bool) Whether every byte was written.
+*/
+bool writeAll(int fd, const char *data, size_t len);
+
+/*
+Input: (int) File descriptor, (char*) Buffer, (size_t) Length.
+Output: (bool) Whether exactly len bytes were read before end of file.
+*/
+bool readAll(int fd, char *data, size_t len);
+
+/*
+Input: (int) File descriptor, (std::string) Message headers, (std::string) Message body, (uint32_t) FRAME_* flags.
+Output: (bool) Whether the whole frame was written.
+Sends a FrameHeader followed by headers and body with gathered writes, normally
+a single writev no matter how many lines the message has.
+*/
+bool sendFrame(int fd, const std::string &headers, const std::string &body, uint32_t flags = 0);
+
+/*
+Input: (int) File descriptor, (std::string) Message headers, (int) Spool file, (long long) Bytes at its start,
+       (std::string) Rest of the body, (uint32_t) FRAME_* flags.
+Output: (bool) Whether the whole frame was written.
+Sends a frame whose message is the headers, the first spooled bytes of the spool
+file and then body. The spooled part goes out with sendfile, never through memory.
+*/
+bool sendSpooledFrame(int fd, const std::string &headers, int spool_fd, long long spooled, const std::string &body, uint32_t flags);
+
+/*
+Input: (FullMessage) A message being read.
+Output: (bool) Whether the in-memory body could be moved to the spool file.
+Appends body to the message's spool file (created in tmp/ on first use) and empties it.
+*/
+bool spoolBody(FullMessage &fullMessage);
+
+/*
+Input: (int) File descriptor, (FrameHeader) Filled with the header.
+Output: (bool) Whether a well formed header (magic, length within MAX_MSG_SIZE) was read.
+The message itself is left in the file descriptor for the caller.
+*/
+bool receiveFrameHeader(int fd, FrameHeader &header);
+
+/*
+Input: (int) File descriptor, (std::string) Filled with the message, (uint32_t*) Set to the frame's flags if not NULL.
+Output: (bool) Whether a well formed frame was read.
+Reads one FrameHeader and exactly the message length it announces.
+*/
+bool receiveFrame(int fd, std::string &message, uint32_t *flags = NULL);
+
+/**** CLASSES ****/
+
+/*
+64-bit hash of a message body, fed in pieces of any size. Names blobs in the
+single-instance store; not collision resistant, so a blob is only ever reused
+after comparing its contents.
+*/
+class BodyHash
+{
+public:
+    BodyHash();
+
+    /*
+    Input: (const char*) Bytes, (size_t) Length.
+    */
+    void update(const char *p, size_t n);
+
+    /*
+    Output: (uint64_t) Hash of everything given to update so far.
+    */
+    uint64_t digest() const;
+
+private:
+    void block(const char *p);
+
+    uint64_t lanes[4]; // Independent multiply-xor lanes over 8-byte words
+    char tail[32];     // Bytes short of a whole 32-byte block
+    size_t tailLen;
+    uint64_t total;
+};
 
 #endif